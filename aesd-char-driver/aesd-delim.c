@@ -0,0 +1,190 @@
+/**
+ * @file aesd-delim.c
+ * @brief Packet delimiter scanning shared by the aesdchar driver and aesdsocket
+ *
+ * The kernel build compares a machine word at a time, since vector registers
+ * are off limits there without saving the FPU state. The userspace build
+ * uses SSE2 or AVX2 on x86, picked at run time, and the word variant
+ * everywhere else.
+ */
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#include <linux/bitops.h>
+#define lowest_bit(w) __ffs(w)
+#define highest_bit(w) __fls(w)
+#else
+#include <string.h>
+#define lowest_bit(w) __builtin_ctzl(w)
+#define highest_bit(w) (BITS_PER_WORD - 1 - __builtin_clzl(w))
+#if defined(__x86_64__) || defined(__i386__)
+#define AESD_DELIM_X86 1
+#include <immintrin.h>
+#endif
+#endif
+
+#include "aesd-delim.h"
+
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+// 0x0101...01 and 0x7f7f...7f for whatever the word size is
+#define ONES (~0ul / 0xff)
+#define LOWS (ONES * 0x7f)
+
+/*
+ * The scanners below continue a scan: they look at buf[i..len), append to
+ * pos[n..max) and return the new n.
+ */
+
+static size_t scan_byte(const char *buf, size_t i, size_t len, char delim, size_t *pos, size_t n, size_t max)
+{
+    for (; i < len && n < max; i++)
+    {
+        if (buf[i] == delim)
+            pos[n++] = i;
+    }
+    return n;
+}
+
+static size_t scan_word(const char *buf, size_t i, size_t len, char delim, size_t *pos, size_t n, size_t max)
+{
+    const unsigned long pattern = ONES * (unsigned char)delim;
+
+    while (n < max && i + sizeof(unsigned long) <= len)
+    {
+        unsigned long w;
+        memcpy(&w, buf + i, sizeof w);
+        w ^= pattern;
+        // The top bit of each byte that matched, and of no other byte
+        unsigned long hits = ~(((w & LOWS) + LOWS) | w | LOWS);
+
+        while (hits && n < max)
+        {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            pos[n++] = i + lowest_bit(hits) / 8;
+            hits &= hits - 1;
+#else
+            unsigned bit = highest_bit(hits);
+            pos[n++] = i + (BITS_PER_WORD - 1 - bit) / 8;
+            hits &= ~(1ul << bit);
+#endif
+        }
+        i += sizeof w;
+    }
+    return scan_byte(buf, i, len, delim, pos, n, max);
+}
+
+#ifdef AESD_DELIM_X86
+// Record the bits of one comparison mask covering buf[i..i+32) at most
+static inline size_t take_mask(unsigned mask, size_t i, size_t *pos, size_t n, size_t max)
+{
+    while (mask && n < max)
+    {
+        pos[n++] = i + __builtin_ctz(mask);
+        mask &= mask - 1;
+    }
+    return n;
+}
+
+__attribute__((target("sse2")))
+static size_t scan_sse2(const char *buf, size_t i, size_t len, char delim, size_t *pos, size_t n, size_t max)
+{
+    const __m128i pattern = _mm_set1_epi8(delim);
+
+    // Sparse delimiters are the common case, skip 64 bytes per test
+    while (n < max && i + 64 <= len)
+    {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), pattern);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 16)), pattern);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 32)), pattern);
+        __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 48)), pattern);
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d))))
+        {
+            n = take_mask(_mm_movemask_epi8(a), i, pos, n, max);
+            n = take_mask(_mm_movemask_epi8(b), i + 16, pos, n, max);
+            n = take_mask(_mm_movemask_epi8(c), i + 32, pos, n, max);
+            n = take_mask(_mm_movemask_epi8(d), i + 48, pos, n, max);
+        }
+        i += 64;
+    }
+    while (n < max && i + 16 <= len)
+    {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), pattern);
+        n = take_mask(_mm_movemask_epi8(a), i, pos, n, max);
+        i += 16;
+    }
+    return scan_word(buf, i, len, delim, pos, n, max);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *buf, size_t i, size_t len, char delim, size_t *pos, size_t n, size_t max)
+{
+    const __m256i pattern = _mm256_set1_epi8(delim);
+
+    while (n < max && i + 64 <= len)
+    {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), pattern);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 32)), pattern);
+        if (!_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b)))
+        {
+            n = take_mask(_mm256_movemask_epi8(a), i, pos, n, max);
+            n = take_mask(_mm256_movemask_epi8(b), i + 32, pos, n, max);
+        }
+        i += 64;
+    }
+    while (n < max && i + 32 <= len)
+    {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), pattern);
+        n = take_mask(_mm256_movemask_epi8(a), i, pos, n, max);
+        i += 32;
+    }
+    // Stay clear of the legacy SSE encodings in scan_sse2, mixing them with AVX stalls
+    return scan_word(buf, i, len, delim, pos, n, max);
+}
+#endif
+
+size_t aesd_delim_scan(const char *buf, size_t len, char delim, size_t *pos, size_t max)
+{
+#ifdef AESD_DELIM_X86
+    if (__builtin_cpu_supports("avx2"))
+        return scan_avx2(buf, 0, len, delim, pos, 0, max);
+    if (__builtin_cpu_supports("sse2"))
+        return scan_sse2(buf, 0, len, delim, pos, 0, max);
+#endif
+    return scan_word(buf, 0, len, delim, pos, 0, max);
+}
+
+size_t aesd_delim_find(const char *buf, size_t len, char delim)
+{
+    size_t off;
+    return aesd_delim_scan(buf, len, delim, &off, 1) ? off : len;
+}
+
+#ifndef __KERNEL__
+size_t aesd_delim_scan_byte(const char *buf, size_t len, char delim, size_t *pos, size_t max)
+{
+    return scan_byte(buf, 0, len, delim, pos, 0, max);
+}
+
+size_t aesd_delim_scan_word(const char *buf, size_t len, char delim, size_t *pos, size_t max)
+{
+    return scan_word(buf, 0, len, delim, pos, 0, max);
+}
+
+size_t aesd_delim_scan_sse2(const char *buf, size_t len, char delim, size_t *pos, size_t max)
+{
+#ifdef AESD_DELIM_X86
+    if (__builtin_cpu_supports("sse2"))
+        return scan_sse2(buf, 0, len, delim, pos, 0, max);
+#endif
+    return scan_word(buf, 0, len, delim, pos, 0, max);
+}
+
+size_t aesd_delim_scan_avx2(const char *buf, size_t len, char delim, size_t *pos, size_t max)
+{
+#ifdef AESD_DELIM_X86
+    if (__builtin_cpu_supports("avx2"))
+        return scan_avx2(buf, 0, len, delim, pos, 0, max);
+#endif
+    return aesd_delim_scan_sse2(buf, len, delim, pos, max);
+}
+#endif
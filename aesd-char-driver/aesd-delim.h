@@ -0,0 +1,46 @@
+/*
+ * aesd-delim.h
+ *
+ *  @brief Packet delimiter scanning shared by the aesdchar driver and aesdsocket
+ */
+
+#ifndef AESD_DELIM_H
+#define AESD_DELIM_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h> // size_t
+#endif
+
+/**
+ * Find delimiters in buf, recording the offset of each one in pos.
+ * @param buf is the data to scan, it needs no alignment
+ * @param len is the number of bytes in buf
+ * @param delim is the delimiter byte, '\n' for the aesd packet protocol
+ * @param pos receives the offsets of the delimiters found, in increasing order
+ * @param max is the most offsets stored in pos. The scan stops once pos is
+ *      full, continue after the last offset returned to find the rest.
+ * @return the number of offsets stored in pos
+ */
+size_t aesd_delim_scan(const char *buf, size_t len, char delim, size_t *pos, size_t max);
+
+/**
+ * @return the offset of the first delim in buf, or len when there is none
+ */
+size_t aesd_delim_find(const char *buf, size_t len, char delim);
+
+#ifndef __KERNEL__
+/*
+ * The individual implementations behind aesd_delim_scan(), which picks the
+ * widest one the CPU supports. Exposed so they can be compared and checked
+ * against each other. A variant the build or CPU lacks falls back to the
+ * next narrower one.
+ */
+size_t aesd_delim_scan_byte(const char *buf, size_t len, char delim, size_t *pos, size_t max);
+size_t aesd_delim_scan_word(const char *buf, size_t len, char delim, size_t *pos, size_t max);
+size_t aesd_delim_scan_sse2(const char *buf, size_t len, char delim, size_t *pos, size_t max);
+size_t aesd_delim_scan_avx2(const char *buf, size_t len, char delim, size_t *pos, size_t max);
+#endif
+
+#endif /* AESD_DELIM_H */
@@ -18,10 +18,13 @@
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/version.h>
 #include <asm/uaccess.h>
 
 #include "aesdchar.h"
 #include "aesd-circular-buffer.h"
+#include "aesd-delim.h"
 #include "aesd_ioctl.h"
 
 int aesd_major = 0; // use dynamic major
@@ -136,6 +139,33 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
     return retval;
 }
 
+/**
+ * iov_iter flavour of aesd_read, it lets sendfile() and splice() take the
+ * device contents without a trip through a userspace buffer
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    size_t count = iov_iter_count(to);
+    PDEBUG("read_iter %zu bytes with offset %lld", count, iocb->ki_pos);
+
+    const size_t avail = get_available_data_size();
+    if (iocb->ki_pos >= avail || count == 0)
+        return 0;
+    if (count > avail - iocb->ki_pos)
+        count = avail - iocb->ki_pos;
+
+    char *tmp = kmalloc(count, GFP_KERNEL);
+    if (tmp == NULL)
+        return -ENOMEM;
+
+    size_t retval = aesd_circular_buffer_find_entry_offset_for_fpos_and_copy(&circular_buffer, iocb->ki_pos, tmp, count);
+    retval = copy_to_iter(tmp, retval, to);
+    kfree(tmp);
+
+    iocb->ki_pos += retval;
+    return retval;
+}
+
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
 {
     ssize_t retval = -ENOMEM;
@@ -150,13 +180,7 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff
         retval = count;
         total_count += count;
 
-        for (size_t i = 0; i < count; i++)
-        {
-            if ('\n' == node->data[i])
-            {
-                completed = true;
-            }
-        }
+        completed = aesd_delim_find(node->data, count, '\n') < count;
     }
 
     if (completed)
@@ -269,6 +293,12 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 struct file_operations aesd_fops = {
     .owner = THIS_MODULE,
     .read = aesd_read,
+    .read_iter = aesd_read_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
     .write = aesd_write,
     .open = aesd_open,
     .release = aesd_release,
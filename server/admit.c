@@ -0,0 +1,377 @@
+/**
+ * @file admit.c
+ * @brief Admission control: the connection caps, per client rate limits and
+ * backpressure from the log writer
+ *
+ * Clients live in a hash table keyed by peer address, each chain under a
+ * lock of its own. A client stays while it has connections open and until
+ * its buckets have refilled after the last one closed, so reconnecting
+ * does not reset its rate. Buckets refill continuously from the monotonic
+ * clock when they are looked at, so an idle client costs nothing. A
+ * connection is charged after a read, for the bytes it brought in and the
+ * packets they completed, and waits out any debt of its client before its
+ * next read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include "aesdsocket.h"
+#include "admit.h"
+#include "diaglog.h"
+#include "timer.h"
+
+// How often the counters are logged while they move
+#define ADMIT_REPORT_MS 10000
+// admit_conns until admit_start() derives it from the descriptor limit
+#define ADMIT_CONNS_FROM_LIMIT UINT_MAX
+// Descriptors the derived cap leaves for the listeners, the log and its segments
+#define ADMIT_SPARE_FDS 64
+#define ADMIT_DEFAULT_BACKLOG (4 * 1024 * 1024)
+#define ADMIT_DEFAULT_PACKET (1024 * 1024)
+// Hash chains of the client table, a power of two
+#define ADMIT_CHAINS 1024
+// Address family tag and the longest address, an IPv6 one
+#define ADMIT_KEY_LEN (1 + sizeof(struct in6_addr))
+
+struct AdmitClient
+{
+    struct AdmitClient *next; // in its chain
+    unsigned chain;
+    unsigned char key[ADMIT_KEY_LEN];
+    unsigned conns; // live connections, guarded by the chain lock as is everything below
+    // Token buckets holding up to one second's worth of the byte and packet rates
+    double bytes;
+    double packets;
+    uint64_t last_ns;
+};
+
+struct ClientChain
+{
+    pthread_mutex_t mtx;
+    struct AdmitClient *head;
+};
+
+unsigned admit_conns = ADMIT_CONNS_FROM_LIMIT;
+unsigned admit_client_conns;
+size_t admit_backlog = ADMIT_DEFAULT_BACKLOG;
+size_t admit_packet = ADMIT_DEFAULT_PACKET;
+
+static double rate_bytes;   // per second, 0 for no limit
+static double rate_packets;
+static atomic_uint live;
+static atomic_uint nclients;
+static struct ClientChain chains[ADMIT_CHAINS];
+static pthread_once_t chains_once = PTHREAD_ONCE_INIT;
+static atomic_ulong refused;
+static atomic_ulong throttled;
+static atomic_ulong backpressured;
+static atomic_ulong oversized;
+static atomic_size_t partial;
+static struct AdmitStats reported; // only touched by the timer job
+
+static uint64_t nowns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int admit_parserate(const char *arg)
+{
+    char *end;
+    rate_bytes = strtod(arg, &end);
+    rate_packets = 0;
+    if (*end == ':')
+        rate_packets = strtod(end + 1, &end);
+    if (end == arg || *end != '\0' || rate_bytes < 0 || rate_packets < 0)
+        return ERROR;
+    return 0;
+}
+
+void admit_stats(struct AdmitStats *stats)
+{
+    stats->live = atomic_load(&live);
+    stats->refused = atomic_load(&refused);
+    stats->clients = atomic_load(&nclients);
+    stats->throttled = atomic_load(&throttled);
+    stats->backpressured = atomic_load(&backpressured);
+    stats->oversized = atomic_load(&oversized);
+    stats->partial = atomic_load(&partial);
+}
+
+static void report(void *arg)
+{
+    struct AdmitStats now;
+    admit_stats(&now);
+    if (now.refused == reported.refused && now.throttled == reported.throttled &&
+        now.backpressured == reported.backpressured && now.oversized == reported.oversized)
+        return;
+    DIAG(DIAG_INFO, "admit: %u live, %lu refused, %lu throttled, %lu backpressured, %lu oversized", now.live,
+         now.refused, now.throttled, now.backpressured, now.oversized);
+    reported = now;
+}
+
+/**
+ * Every connection holds a descriptor: lift the soft limit as far as allowed
+ * and cap connections below it, so one over it is refused rather than left
+ * failing accept() with EMFILE
+ * @return the cap, 0 when the limit is too large to matter
+ */
+static unsigned fdcap(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        return 0;
+    if (rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
+        {
+            perror("setrlimit");
+            getrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur >= UINT_MAX)
+        return 0;
+    return (rl.rlim_cur > 2 * ADMIT_SPARE_FDS) ? rl.rlim_cur - ADMIT_SPARE_FDS : rl.rlim_cur / 2;
+}
+
+int admit_start(void)
+{
+    if (admit_conns == ADMIT_CONNS_FROM_LIMIT)
+    {
+        admit_conns = fdcap();
+        DIAG(DIAG_DEBUG, "admit: up to %u connections, 0 for no cap", admit_conns);
+    }
+    return timer_add(ADMIT_REPORT_MS, report, NULL);
+}
+
+void admit_stop(void)
+{
+    struct AdmitStats total;
+    admit_stats(&total);
+    // Every connection is closed, what is left only waits to be forgotten
+    for (unsigned i = 0; i < ADMIT_CHAINS; i++)
+    {
+        while (chains[i].head)
+        {
+            struct AdmitClient *next = chains[i].head->next;
+            free(chains[i].head);
+            chains[i].head = next;
+        }
+    }
+    if (total.refused || total.throttled || total.backpressured || total.oversized)
+        DIAG(DIAG_INFO, "admit: %lu refused, %lu throttled, %lu backpressured, %lu oversized", total.refused,
+             total.throttled, total.backpressured, total.oversized);
+}
+
+static void initchains(void)
+{
+    for (unsigned i = 0; i < ADMIT_CHAINS; i++)
+        pthread_mutex_init(&chains[i].mtx, NULL);
+}
+
+// The key of a peer address: its family, then the address without the port
+static void clientkey(const struct sockaddr_storage *addr, unsigned char key[ADMIT_KEY_LEN])
+{
+    memset(key, 0, ADMIT_KEY_LEN);
+    key[0] = addr->ss_family;
+    if (addr->ss_family == AF_INET)
+        memcpy(key + 1, &((const struct sockaddr_in *)addr)->sin_addr, sizeof(struct in_addr));
+    else if (addr->ss_family == AF_INET6)
+        memcpy(key + 1, &((const struct sockaddr_in6 *)addr)->sin6_addr, sizeof(struct in6_addr));
+    // Unix socket peers have no address worth telling apart, they are one client
+}
+
+// FNV-1a
+static unsigned hashkey(const unsigned char key[ADMIT_KEY_LEN])
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < ADMIT_KEY_LEN; i++)
+        h = (h ^ key[i]) * 16777619u;
+    return h & (ADMIT_CHAINS - 1);
+}
+
+// Credit the time since the last look, up to a full bucket, with the chain lock held
+static void refill(struct AdmitClient *c, uint64_t now)
+{
+    double secs = (now - c->last_ns) / 1e9;
+    c->last_ns = now;
+    c->bytes += secs * rate_bytes;
+    if (c->bytes > rate_bytes)
+        c->bytes = rate_bytes;
+    c->packets += secs * rate_packets;
+    if (c->packets > rate_packets)
+        c->packets = rate_packets;
+}
+
+// A client without connections may go once its buckets are full again
+static bool forgettable(struct AdmitClient *c, uint64_t now)
+{
+    if (c->conns)
+        return false;
+    refill(c, now);
+    return c->bytes >= rate_bytes && c->packets >= rate_packets;
+}
+
+/**
+ * Find the client keyed key in its chain, or add it, dropping the clients
+ * found on the way that can be forgotten. The chain lock is held.
+ */
+static struct AdmitClient *findclient(struct ClientChain *chain, unsigned index,
+                                      const unsigned char key[ADMIT_KEY_LEN])
+{
+    uint64_t now = nowns();
+    struct AdmitClient *found = NULL;
+    struct AdmitClient **link = &chain->head;
+    while (*link)
+    {
+        struct AdmitClient *c = *link;
+        if (memcmp(c->key, key, ADMIT_KEY_LEN) == 0)
+            found = c;
+        else if (forgettable(c, now))
+        {
+            *link = c->next;
+            free(c);
+            atomic_fetch_sub(&nclients, 1);
+            continue;
+        }
+        link = &c->next;
+    }
+    if (found)
+        return found;
+
+    found = calloc(1, sizeof(struct AdmitClient));
+    if (found == NULL)
+    {
+        perror("malloc");
+        return NULL;
+    }
+    found->chain = index;
+    memcpy(found->key, key, ADMIT_KEY_LEN);
+    found->bytes = rate_bytes;
+    found->packets = rate_packets;
+    found->last_ns = now;
+    found->next = chain->head;
+    chain->head = found;
+    atomic_fetch_add(&nclients, 1);
+    return found;
+}
+
+struct AdmitClient *conn_admit(const struct sockaddr_storage *addr)
+{
+    unsigned n = atomic_load(&live);
+    do
+    {
+        if (admit_conns && n >= admit_conns)
+        {
+            atomic_fetch_add(&refused, 1);
+            return NULL;
+        }
+    } while (!atomic_compare_exchange_weak(&live, &n, n + 1));
+
+    unsigned char key[ADMIT_KEY_LEN];
+    clientkey(addr, key);
+    unsigned index = hashkey(key);
+    struct ClientChain *chain = &chains[index];
+    pthread_once(&chains_once, initchains);
+    pthread_mutex_lock(&chain->mtx);
+    struct AdmitClient *c = findclient(chain, index, key);
+    bool full = c && admit_client_conns && c->conns >= admit_client_conns;
+    if (c && !full)
+        c->conns++;
+    pthread_mutex_unlock(&chain->mtx);
+
+    if (c == NULL || full)
+    {
+        if (full)
+            atomic_fetch_add(&refused, 1);
+        atomic_fetch_sub(&live, 1);
+        return NULL;
+    }
+    return c;
+}
+
+void conn_leave(struct AdmitClient *client)
+{
+    // The client stays in its chain, the next lookup there drops it once it may go
+    struct ClientChain *chain = &chains[client->chain];
+    pthread_mutex_lock(&chain->mtx);
+    client->conns--;
+    pthread_mutex_unlock(&chain->mtx);
+    atomic_fetch_sub(&live, 1);
+}
+
+void rate_charge(struct AdmitClient *client, size_t bytes, unsigned packets)
+{
+    if (rate_bytes == 0 && rate_packets == 0)
+        return;
+
+    struct ClientChain *chain = &chains[client->chain];
+    pthread_mutex_lock(&chain->mtx);
+    refill(client, nowns());
+    bool was_over = (rate_bytes && client->bytes < 0) || (rate_packets && client->packets < 0);
+    if (rate_bytes)
+        client->bytes -= bytes;
+    if (rate_packets)
+        client->packets -= packets;
+    bool over = (rate_bytes && client->bytes < 0) || (rate_packets && client->packets < 0);
+    pthread_mutex_unlock(&chain->mtx);
+    if (over && !was_over)
+        atomic_fetch_add(&throttled, 1);
+}
+
+unsigned rate_pause(struct AdmitClient *client)
+{
+    if (rate_bytes == 0 && rate_packets == 0)
+        return 0;
+
+    struct ClientChain *chain = &chains[client->chain];
+    pthread_mutex_lock(&chain->mtx);
+    refill(client, nowns());
+    double secs = 0;
+    if (rate_bytes && client->bytes < 0)
+        secs = -client->bytes / rate_bytes;
+    if (rate_packets && client->packets < 0 && -client->packets / rate_packets > secs)
+        secs = -client->packets / rate_packets;
+    pthread_mutex_unlock(&chain->mtx);
+    // Rounded up, the bucket is out of debt when the pause is over
+    return (unsigned)(secs * 1000) + (secs > 0);
+}
+
+bool backlog_pause(size_t queued)
+{
+    if (queued <= admit_backlog)
+        return false;
+    atomic_fetch_add(&backpressured, 1);
+    return true;
+}
+
+void partial_add(ptrdiff_t delta)
+{
+    if (delta)
+        atomic_fetch_add(&partial, (size_t)delta);
+}
+
+bool partial_keep(size_t len)
+{
+    if (len <= admit_packet && atomic_load_explicit(&partial, memory_order_relaxed) <= admit_backlog)
+        return true;
+    atomic_fetch_add(&oversized, 1);
+    return false;
+}
+
+bool frame_oversized(size_t len)
+{
+    if (len <= admit_packet)
+        return false;
+    atomic_fetch_add(&oversized, 1);
+    return true;
+}
@@ -0,0 +1,121 @@
+/*
+ * admit.h
+ *
+ *  @brief Admission control: the connection caps, per client rate limits and
+ *  backpressure from the log writer
+ *
+ * Every server model asks here before it accepts a connection and before it
+ * reads from one. A client is a peer address, every connection from the
+ * Unix socket is the one client "local"; its connections count against its
+ * cap and share its rate. A connection whose client is over its rate, or one that would add to a
+ * backlog of appends the log has not taken yet, stops reading for a while
+ * and leaves its data in the socket, so TCP pushes back on the client
+ * instead of the server buffering what it cannot write.
+ */
+
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Live connections allowed, 0 for no cap. Unless -c says otherwise
+// admit_start() derives it from the descriptor limit.
+extern unsigned admit_conns;
+// Live connections allowed from one client, 0 for no cap
+extern unsigned admit_client_conns;
+// Bytes of appends waiting for the log above which connections stop reading
+extern size_t admit_backlog;
+// Longest packet kept in memory until it is complete
+extern size_t admit_packet;
+
+// The connection count and token buckets shared by the connections of one peer
+struct AdmitClient;
+
+struct AdmitStats
+{
+    unsigned live;               // connections open
+    unsigned long refused;       // connections closed at accept for a cap
+    unsigned clients;            // peers with connections open, or whose rate debt is not paid back yet
+    unsigned long throttled;     // times a client overran its rate
+    unsigned long backpressured; // times a connection stopped reading for the log backlog
+    unsigned long oversized;     // partial packets cut short, see partial_keep()
+    size_t partial;              // bytes held in partial packets
+};
+
+/**
+ * Parse a -R argument: bytes[:packets] per second, 0 for either is no limit
+ * @return 0 on success, ERROR when arg is malformed
+ */
+int admit_parserate(const char *arg);
+
+/**
+ * Raise the descriptor limit to its hard limit and, unless -c gave one,
+ * derive the connection cap from it. Add the timer job that logs the
+ * counters while they move.
+ * @return 0 on success, ERROR if the job could not be added
+ */
+int admit_start(void);
+
+/**
+ * Log the totals, called once the timer is stopped
+ */
+void admit_stop(void);
+
+void admit_stats(struct AdmitStats *stats);
+
+/**
+ * Take a slot for a connection newly accepted from addr, every server model
+ * asks before it sets a connection up and closes it straight away on refusal
+ * @return the client the connection belongs to, NULL when the live
+ *  connection cap or the cap of that client is reached
+ */
+struct AdmitClient *conn_admit(const struct sockaddr_storage *addr);
+
+/**
+ * Give back the slot of a closed connection taken with conn_admit()
+ */
+void conn_leave(struct AdmitClient *client);
+
+/**
+ * Take what a read brought in out of the buckets of its client. They may go
+ * below zero, every connection of the client then pays the debt back with
+ * rate_pause().
+ */
+void rate_charge(struct AdmitClient *client, size_t bytes, unsigned packets);
+
+/**
+ * @return milliseconds until client is out of debt and its connections may
+ *  read again, 0 when they may read now
+ */
+unsigned rate_pause(struct AdmitClient *client);
+
+/**
+ * Check whether a connection about to read has to wait for the log to take
+ * queued bytes of appends first, counting it when it does
+ */
+bool backlog_pause(size_t queued);
+
+/**
+ * Account for delta more bytes, or fewer when negative, held in partial
+ * packets across all connections
+ */
+void partial_add(ptrdiff_t delta);
+
+/**
+ * Check whether a text packet still missing its newline may stay in memory
+ * at len bytes: not once it is longer than admit_packet, nor while partial
+ * packets together hold more than admit_backlog. The caller then sends what
+ * it has to the log unfinished. Counts it when it may not stay.
+ */
+bool partial_keep(size_t len);
+
+/**
+ * Check a binary frame length against admit_packet, counting it when it is
+ * longer. Its connection is closed, a frame is never split.
+ */
+bool frame_oversized(size_t len);
+
+#endif /* ADMIT_H */
@@ -0,0 +1,721 @@
+/**
+ * @file aesdbench.c
+ * @brief Load generator and latency benchmark for aesdsocket
+ *
+ * Opens a number of connections spread over worker threads and runs one of
+ * two loads against them for a fixed duration.
+ *
+ * By default every connection streams fixed-size chunks without a trailing
+ * newline, so the server never replies. The chunks add up to one partial
+ * packet per connection, which the server holds until it outgrows -P or
+ * the -Q budget and then spills to the log, so this measures the receive
+ * path in bytes only. Chunks are not packets, no packet rate is given;
+ * appends the server completes are what -a is for.
+ *
+ * With -a every connection speaks the binary protocol instead and sends
+ * newline terminated packets as APPEND frames, fixed or uniformly random in
+ * size, each optionally followed by a READ of the start of the log so the
+ * reply path is loaded too. Closed loop, a connection sends its next request
+ * once the previous one is answered, at most at the rate given with -R.
+ * Open loop (-o), requests go out on the -R schedule whether or not the
+ * replies kept up, and latency counts from when a request was due rather
+ * than from when it could be sent, so a stalled server is not hidden by the
+ * client waiting for it. Latencies go into log-linear histograms that keep
+ * every value to within 1/64 of itself, from which p50, p99 and p999 are
+ * read. -j prints the results as one JSON object.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <endian.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "aesdproto.h"
+
+#define ERROR (-1)
+
+// Histogram values below HIST_SUB are exact, larger ones keep HIST_SUB_BITS - 1 bits below their top bit
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 2) * (HIST_SUB / 2))
+
+// Frames a connection may have waiting for replies
+#define INFLIGHT 1024
+// Requests a connection may have queued for sending
+#define OUTBUF (256 * 1024)
+#define RECVBUF (64 * 1024)
+
+enum FrameKind
+{
+    KIND_APPEND,
+    KIND_READ,
+    KINDS,
+};
+
+static const char *const kind_names[KINDS] = {"append", "read"};
+
+struct Options
+{
+    const char *host;
+    const char *port;
+    const char *local; // Unix socket path of the server, used instead of host and port
+    int connections;
+    int threads;
+    int seconds;
+    size_t size;     // smallest packet
+    size_t size_max; // largest packet, packets are uniformly sized in between
+    bool acked;
+    size_t read_bytes; // READ this much of the log after every APPEND, 0 for none
+    double rate;       // requests per second over all connections, 0 for as fast as replies come
+    bool open_loop;
+    bool json;
+};
+
+// Latencies in nanoseconds
+struct Hist
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+    double sum;
+};
+
+struct Conn
+{
+    int fd;
+    uint32_t seq;                 // of the next request frame
+    uint32_t acked;               // frames answered so far
+    double due[INFLIGHT];         // when each frame in flight was sent, or due in an open loop
+    uint8_t kind[INFLIGHT];
+    double next_send;             // when the next request is due under -R
+    char *out;                    // requests not sent yet
+    size_t out_len;
+    size_t out_sent;
+    struct aesd_frame head;       // the reply header being received
+    size_t head_got;
+    size_t payload_left;          // of the reply being received
+};
+
+struct Worker
+{
+    pthread_t thread;
+    const struct Options *opts;
+    int nconns;
+    double interval; // between requests of one connection under -R
+    uint64_t seed;
+    unsigned long long packets;
+    unsigned long long bytes;       // appended
+    unsigned long long reply_bytes; // received as READ replies
+    unsigned long long stalls;      // requests that went out late because the connection was backed up
+    bool failed;
+    struct Hist hist[KINDS];
+};
+
+static atomic_int stop;
+static pthread_barrier_t connected;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t nextrand(uint64_t *state)
+{
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ull;
+}
+
+static int hist_index(uint64_t v)
+{
+    if (v < HIST_SUB)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - (HIST_SUB_BITS - 1);
+    return shift * (HIST_SUB / 2) + (v >> shift);
+}
+
+// The largest value that lands in bucket i
+static uint64_t hist_value(int i)
+{
+    if (i < HIST_SUB)
+        return i;
+    int shift = i / (HIST_SUB / 2) - 1;
+    uint64_t top = i - shift * (HIST_SUB / 2);
+    return ((top + 1) << shift) - 1;
+}
+
+static void hist_record(struct Hist *h, uint64_t v)
+{
+    h->counts[hist_index(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+static void hist_merge(struct Hist *into, const struct Hist *h)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        into->counts[i] += h->counts[i];
+    into->total += h->total;
+    into->sum += h->sum;
+    if (h->max > into->max)
+        into->max = h->max;
+}
+
+// The value below which fraction q of the recorded values lie
+static uint64_t hist_quantile(const struct Hist *h, double q)
+{
+    uint64_t want = (uint64_t)(q * h->total + 0.5);
+    if (want == 0)
+        want = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen >= want)
+            return (hist_value(i) < h->max) ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+static int connectlocal(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd != ERROR && connect(fd, (struct sockaddr *)&addr, sizeof addr) == ERROR)
+    {
+        perror(path);
+        close(fd);
+        fd = ERROR;
+    }
+    return fd;
+}
+
+static int connectto(const struct Options *opts)
+{
+    if (opts->local)
+        return connectlocal(opts->local);
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(opts->host, opts->port, &hints, &res) != 0)
+    {
+        perror("getaddrinfo");
+        return ERROR;
+    }
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd != ERROR && connect(fd, res->ai_addr, res->ai_addrlen) == ERROR)
+    {
+        perror("connect");
+        close(fd);
+        fd = ERROR;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static bool recvall(int fd, void *buf, size_t len)
+{
+    for (size_t got = 0; got < len;)
+    {
+        ssize_t n = recv(fd, (char *)buf + got, len - got, 0);
+        if (n <= 0)
+            return false;
+        got += n;
+    }
+    return true;
+}
+
+static bool hello(int fd)
+{
+    struct aesd_frame reply;
+    return send(fd, AESD_BINARY_HELLO, strlen(AESD_BINARY_HELLO), MSG_NOSIGNAL) ==
+               (ssize_t)strlen(AESD_BINARY_HELLO) &&
+           recvall(fd, &reply, sizeof reply);
+}
+
+static size_t packetsize(struct Worker *w)
+{
+    const struct Options *opts = w->opts;
+    if (opts->size_max <= opts->size)
+        return opts->size;
+    return opts->size + nextrand(&w->seed) % (opts->size_max - opts->size + 1);
+}
+
+static size_t requestsize(const struct Options *opts)
+{
+    size_t len = sizeof(struct aesd_frame) + opts->size_max;
+    if (opts->read_bytes)
+        len += sizeof(struct aesd_frame) + sizeof(struct aesd_frame_range);
+    return len;
+}
+
+// Queue a frame header, the caller fills in the len bytes of payload behind it
+static char *addframe(struct Conn *c, enum FrameKind kind, uint8_t opcode, size_t len, double due)
+{
+    struct aesd_frame head = {.opcode = opcode, .length = htole32(len), .seq = htole32(c->seq)};
+    char *payload = c->out + c->out_len + sizeof head;
+    memcpy(c->out + c->out_len, &head, sizeof head);
+    c->out_len += sizeof head + len;
+    c->due[c->seq % INFLIGHT] = due;
+    c->kind[c->seq % INFLIGHT] = kind;
+    c->seq++;
+    return payload;
+}
+
+/**
+ * Queue one request, an APPEND of a newline terminated packet and the READ
+ * that may follow it
+ * @param due is the time latency counts from
+ */
+static void queuerequest(struct Worker *w, struct Conn *c, const char *packet, double due)
+{
+    size_t size = packetsize(w);
+    char *payload = addframe(c, KIND_APPEND, AESD_OP_APPEND, size, due);
+    // The fill is the same for every packet, only the newline moves
+    memcpy(payload, packet, size - 1);
+    payload[size - 1] = '\n';
+    w->packets++;
+    w->bytes += size;
+
+    if (w->opts->read_bytes)
+    {
+        struct aesd_frame_range range = {.first = 0, .count = htole64(w->opts->read_bytes)};
+        memcpy(addframe(c, KIND_READ, AESD_OP_READ, sizeof range, due), &range, sizeof range);
+    }
+}
+
+// Send what is queued as far as the socket takes it
+static bool flushout(struct Conn *c)
+{
+    while (c->out_sent < c->out_len)
+    {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        c->out_sent += n;
+    }
+    c->out_len = c->out_sent = 0;
+    return true;
+}
+
+// Consume replies as far as they came in, recording the latency of each frame
+static bool readreplies(struct Worker *w, struct Conn *c, char *buf)
+{
+    ssize_t n = recv(c->fd, buf, RECVBUF, MSG_DONTWAIT);
+    if (n == 0)
+        return false;
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+    double t = now();
+    for (char *p = buf; n > 0;)
+    {
+        if (c->head_got < sizeof c->head)
+        {
+            size_t take = sizeof c->head - c->head_got;
+            if (take > (size_t)n)
+                take = n;
+            memcpy((char *)&c->head + c->head_got, p, take);
+            c->head_got += take;
+            p += take;
+            n -= take;
+            if (c->head_got < sizeof c->head)
+                break;
+            if (c->head.status != 0)
+            {
+                fprintf(stderr, "request failed: %s\n", strerror(c->head.status));
+                return false;
+            }
+            c->payload_left = le32toh(c->head.length);
+        }
+
+        size_t skip = (c->payload_left < (size_t)n) ? c->payload_left : (size_t)n;
+        c->payload_left -= skip;
+        p += skip;
+        n -= skip;
+        uint32_t seq = le32toh(c->head.seq);
+        if (c->kind[seq % INFLIGHT] == KIND_READ)
+            w->reply_bytes += skip;
+        if (c->payload_left)
+            break;
+
+        hist_record(&w->hist[c->kind[seq % INFLIGHT]], (uint64_t)((t - c->due[seq % INFLIGHT]) * 1e9));
+        c->acked++;
+        c->head_got = 0;
+    }
+    return true;
+}
+
+// Keep every connection's requests going until stop is set
+static void runacked(struct Worker *w, struct Conn *conns, int open)
+{
+    const struct Options *opts = w->opts;
+    unsigned per_request = opts->read_bytes ? 2 : 1;
+    size_t request = requestsize(opts);
+    struct pollfd *pfds = calloc(open, sizeof *pfds);
+    char *buf = malloc(RECVBUF);
+    char *packet = malloc(opts->size_max);
+    if (pfds == NULL || buf == NULL || packet == NULL)
+    {
+        perror("malloc");
+        w->failed = true;
+        goto out;
+    }
+    memset(packet, 'a', opts->size_max);
+
+    // Spread the connections over the first interval so they do not send in lockstep
+    double start = now();
+    for (int i = 0; i < open; i++)
+        conns[i].next_send = start + w->interval * (nextrand(&w->seed) % 1000) / 1000.0;
+
+    while (!atomic_load(&stop))
+    {
+        double t = now();
+        double wake = t + 0.1;
+        for (int i = 0; i < open; i++)
+        {
+            struct Conn *c = &conns[i];
+            for (;;)
+            {
+                unsigned inflight = c->seq - c->acked;
+                if (!opts->open_loop && inflight > 0)
+                    break;
+                if (opts->rate && c->next_send > t)
+                {
+                    if (c->next_send < wake)
+                        wake = c->next_send;
+                    break;
+                }
+                if (inflight + per_request > INFLIGHT || c->out_len + request > OUTBUF)
+                {
+                    // Backed up, the request goes out late and its latency shows it
+                    w->stalls++;
+                    break;
+                }
+                queuerequest(w, c, packet, opts->open_loop ? c->next_send : t);
+                c->next_send += w->interval;
+                if (!opts->rate)
+                    break;
+            }
+            if (!flushout(c))
+                w->failed = true;
+            pfds[i].fd = c->fd;
+            pfds[i].events = POLLIN | (c->out_len ? POLLOUT : 0);
+        }
+        if (w->failed)
+            break;
+
+        double wait = wake - now();
+        struct timespec ts = {.tv_sec = 0, .tv_nsec = (wait > 0) ? (long)(wait * 1e9) : 0};
+        if (ppoll(pfds, open, &ts, NULL) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            w->failed = true;
+            break;
+        }
+        for (int i = 0; i < open; i++)
+        {
+            if ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) && !readreplies(w, &conns[i], buf))
+                w->failed = true;
+        }
+        if (w->failed)
+            break;
+    }
+
+out:
+    free(packet);
+    free(buf);
+    free(pfds);
+}
+
+static void runstream(struct Worker *w, struct Conn *conns, int open)
+{
+    char *packet = malloc(w->opts->size);
+    if (packet == NULL)
+    {
+        perror("malloc");
+        return;
+    }
+    memset(packet, 'a', w->opts->size);
+
+    while (!atomic_load(&stop))
+    {
+        for (int i = 0; i < open; i++)
+        {
+            ssize_t sent = send(conns[i].fd, packet, w->opts->size, MSG_NOSIGNAL);
+            if (sent <= 0)
+            {
+                atomic_store(&stop, 1);
+                break;
+            }
+            w->packets++;
+            w->bytes += sent;
+        }
+    }
+    free(packet);
+}
+
+static void *worker(void *arg)
+{
+    struct Worker *w = arg;
+    const struct Options *opts = w->opts;
+    int open = 0;
+    struct Conn *conns = calloc(w->nconns, sizeof(struct Conn));
+    if (conns == NULL)
+    {
+        perror("malloc");
+        pthread_barrier_wait(&connected);
+        return NULL;
+    }
+
+    for (; open < w->nconns; open++)
+    {
+        struct Conn *c = &conns[open];
+        c->fd = connectto(opts);
+        if (c->fd == ERROR)
+            break;
+        if (opts->acked && !hello(c->fd))
+        {
+            fprintf(stderr, "no reply to the binary hello\n");
+            close(c->fd);
+            break;
+        }
+        if (opts->acked && (c->out = malloc(OUTBUF)) == NULL)
+        {
+            perror("malloc");
+            close(c->fd);
+            break;
+        }
+    }
+
+    // The clock starts once every worker has its connections up
+    pthread_barrier_wait(&connected);
+
+    if (open > 0 && opts->acked)
+        runacked(w, conns, open);
+    else if (open > 0)
+        runstream(w, conns, open);
+
+    for (int i = 0; i < open; i++)
+    {
+        close(conns[i].fd);
+        free(conns[i].out);
+    }
+    free(conns);
+    return NULL;
+}
+
+static void printlatency(const char *name, const struct Hist *h, bool json)
+{
+    if (json)
+    {
+        printf("\"%s\":{\"count\":%llu,\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}", name,
+               (unsigned long long)h->total, h->total ? h->sum / h->total / 1e3 : 0.0,
+               hist_quantile(h, 0.5) / 1e3, hist_quantile(h, 0.99) / 1e3, hist_quantile(h, 0.999) / 1e3,
+               h->max / 1e3);
+        return;
+    }
+    printf("%s latency us mean %.1f p50 %.1f p99 %.1f p999 %.1f max %.1f\n", name,
+           h->total ? h->sum / h->total / 1e3 : 0.0, hist_quantile(h, 0.5) / 1e3, hist_quantile(h, 0.99) / 1e3,
+           hist_quantile(h, 0.999) / 1e3, h->max / 1e3);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-h host] [-p port] [-u path] [-c connections] [-t threads] [-d seconds]\n"
+                    "       [-s size[:max-size]] [-a] [-r read-bytes] [-R rate] [-o] [-j]\n", prog);
+    fprintf(stderr, "  -u  connect to the server's Unix socket at path instead of over TCP\n");
+    fprintf(stderr, "  -s  packet size, or uniformly random sizes between size and max-size\n");
+    fprintf(stderr, "  -a  send acknowledged binary appends of newline terminated packets and\n");
+    fprintf(stderr, "      report their latency\n");
+    fprintf(stderr, "  -r  follow every append with a READ of read-bytes from the start of the log\n");
+    fprintf(stderr, "  -R  send at most rate requests per second over all connections\n");
+    fprintf(stderr, "  -o  open loop: send on the -R schedule whether or not replies kept up\n");
+    fprintf(stderr, "  -j  print the results as JSON\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct Options opts = {
+        .host = "127.0.0.1",
+        .port = "9000",
+        .connections = 64,
+        .threads = 4,
+        .seconds = 5,
+        .size = 64,
+    };
+
+    int opt;
+    char *end;
+    while ((opt = getopt(argc, argv, "h:p:u:c:t:d:s:ar:R:oj")) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            opts.host = optarg;
+            break;
+        case 'p':
+            opts.port = optarg;
+            break;
+        case 'u':
+            opts.local = optarg;
+            break;
+        case 'c':
+            opts.connections = atoi(optarg);
+            break;
+        case 't':
+            opts.threads = atoi(optarg);
+            break;
+        case 'd':
+            opts.seconds = atoi(optarg);
+            break;
+        case 's':
+            opts.size = strtoul(optarg, &end, 0);
+            opts.size_max = (*end == ':') ? strtoul(end + 1, NULL, 0) : opts.size;
+            break;
+        case 'a':
+            opts.acked = true;
+            break;
+        case 'r':
+            opts.read_bytes = strtoul(optarg, NULL, 0);
+            opts.acked = true;
+            break;
+        case 'R':
+            opts.rate = strtod(optarg, NULL);
+            opts.acked = true;
+            break;
+        case 'o':
+            opts.open_loop = true;
+            break;
+        case 'j':
+            opts.json = true;
+            break;
+        default:
+            usage(argv[0]);
+            return ERROR;
+        }
+    }
+    if (opts.size_max < opts.size)
+        opts.size_max = opts.size;
+    if (opts.connections < 1 || opts.threads < 1 || opts.seconds < 1 || opts.size < 1 || opts.rate < 0 ||
+        (opts.open_loop && opts.rate == 0) || (!opts.acked && opts.size_max != opts.size) ||
+        requestsize(&opts) > OUTBUF)
+    {
+        usage(argv[0]);
+        return ERROR;
+    }
+    if (opts.threads > opts.connections)
+        opts.threads = opts.connections;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    struct Worker *workers = calloc(opts.threads, sizeof(struct Worker));
+    if (workers == NULL)
+    {
+        perror("malloc");
+        return ERROR;
+    }
+
+    pthread_barrier_init(&connected, NULL, opts.threads + 1);
+    for (int i = 0; i < opts.threads; i++)
+    {
+        workers[i].opts = &opts;
+        workers[i].nconns = opts.connections / opts.threads + (i < opts.connections % opts.threads);
+        workers[i].interval = opts.rate ? opts.connections / opts.rate : 0;
+        workers[i].seed = 0x9e3779b97f4a7c15ull * (i + 1);
+        pthread_create(&workers[i].thread, NULL, worker, &workers[i]);
+    }
+
+    pthread_barrier_wait(&connected);
+    double start = now();
+    sleep(opts.seconds);
+    atomic_store(&stop, 1);
+
+    unsigned long long packets = 0, bytes = 0, reply_bytes = 0, stalls = 0;
+    bool failed = false;
+    static struct Hist hist[KINDS];
+    for (int i = 0; i < opts.threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        packets += workers[i].packets;
+        bytes += workers[i].bytes;
+        reply_bytes += workers[i].reply_bytes;
+        stalls += workers[i].stalls;
+        failed |= workers[i].failed;
+        for (int k = 0; k < KINDS; k++)
+            hist_merge(&hist[k], &workers[i].hist[k]);
+    }
+    double elapsed = now() - start;
+
+    if (opts.json)
+    {
+        printf("{\"mode\":\"%s\",\"loop\":\"%s\",\"connections\":%d,\"threads\":%d,\"seconds\":%.2f,"
+               "\"size\":%zu,\"size_max\":%zu,\"read_bytes\":%zu,\"target_rate\":%.1f,",
+               opts.acked ? "acked" : "stream", opts.open_loop ? "open" : "closed", opts.connections,
+               opts.threads, elapsed, opts.size, opts.size_max, opts.read_bytes, opts.rate);
+        if (opts.acked)
+            printf("\"packets\":%llu,\"packets_per_sec\":%.1f,", packets, packets / elapsed);
+        printf("\"append_mb_per_sec\":%.3f,", bytes / elapsed / 1e6);
+        if (opts.acked)
+        {
+            printf("\"replies_per_sec\":%.1f,\"reply_mb_per_sec\":%.3f,\"stalls\":%llu,",
+                   (hist[KIND_APPEND].total + hist[KIND_READ].total) / elapsed, reply_bytes / elapsed / 1e6,
+                   stalls);
+            printf("\"latency_us\":{");
+            printlatency(kind_names[KIND_APPEND], &hist[KIND_APPEND], true);
+            if (opts.read_bytes)
+            {
+                printf(",");
+                printlatency(kind_names[KIND_READ], &hist[KIND_READ], true);
+            }
+            printf("},");
+        }
+        printf("\"failed\":%s}\n", failed ? "true" : "false");
+    }
+    else
+    {
+        printf("connections %d threads %d size %zu seconds %.2f", opts.connections, opts.threads, opts.size,
+               elapsed);
+        if (opts.acked)
+            printf(" packets/s %.0f", packets / elapsed);
+        printf(" MB/s %.2f\n", bytes / elapsed / 1e6);
+        if (opts.acked)
+        {
+            printf("replies/s %.0f reply MB/s %.2f stalls %llu\n",
+                   (hist[KIND_APPEND].total + hist[KIND_READ].total) / elapsed, reply_bytes / elapsed / 1e6,
+                   stalls);
+            printlatency(kind_names[KIND_APPEND], &hist[KIND_APPEND], false);
+            if (opts.read_bytes)
+                printlatency(kind_names[KIND_READ], &hist[KIND_READ], false);
+        }
+        if (failed)
+            printf("a connection failed, the run stopped early for it\n");
+    }
+
+    pthread_barrier_destroy(&connected);
+    free(workers);
+    return failed ? ERROR : 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * aesdproto.h
+ *
+ *  @brief Binary framing of the aesdsocket protocol
+ *
+ * A connection whose first bytes are AESD_BINARY_HELLO speaks in frames
+ * for the rest of its life, any other connection keeps the newline
+ * delimited text protocol. The server answers the hello with an
+ * AESD_OP_HELLO reply. Every request frame is answered by one reply frame
+ * carrying the same sequence number, and the replies to all requests
+ * received together go out together once their appends are in the log.
+ * All integers are little endian.
+ */
+
+#ifndef AESDPROTO_H
+#define AESDPROTO_H
+
+#include <stdint.h>
+
+#define AESD_BINARY_HELLO "AESDSOCKET_BINARY\n"
+
+enum aesd_opcode
+{
+    AESD_OP_HELLO = 0,     // reply to AESD_BINARY_HELLO, never sent by a client
+    AESD_OP_APPEND = 1,    // payload: bytes appended to the log as they are; reply: empty
+    AESD_OP_READ = 2,      // payload: struct aesd_frame_range of bytes; reply: the bytes
+    AESD_OP_READPKT = 3,   // payload: struct aesd_frame_range of packets; reply: the packets
+    AESD_OP_SEEK = 4,      // payload: struct aesd_seekto; reply: the log from there to its end
+    AESD_OP_SUBSCRIBE = 5, // payload: uint64_t log offset; reply: empty, after it the
+                           // connection carries the raw log from the offset on, as in text mode
+};
+
+// Set in the opcode of a reply
+#define AESD_OP_REPLY 0x80
+
+struct aesd_frame
+{
+    uint8_t opcode;
+    uint8_t status;    // replies: 0, or an errno value when the request was not understood
+    uint16_t reserved;
+    uint32_t length;   // payload bytes following the header
+    uint32_t seq;      // chosen by the client, echoed in the reply
+} __attribute__((packed));
+
+struct aesd_frame_range
+{
+    uint64_t first;
+    uint64_t count;    // UINT64_MAX runs to the end of the log
+} __attribute__((packed));
+
+#endif /* AESDPROTO_H */
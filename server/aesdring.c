@@ -0,0 +1,172 @@
+/**
+ * @file aesdring.c
+ * @brief Client side of the aesdsocket shared memory ring
+ *
+ * Link this file into a local producer to append packets through the ring
+ * aesdsocket -M created. It needs nothing from the rest of the server.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "aesdring.h"
+
+// Longest a producer waiting for space sleeps before it looks again
+#define AESDRING_WAIT_NS (100 * 1000 * 1000)
+
+struct aesdring
+{
+    struct aesdring_shared *shared;
+    char *data;
+    size_t mapped;
+};
+
+// Shared futexes, the words live in a mapping of several processes
+static long futex(atomic_uint *addr, int op, unsigned val, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+struct aesdring *aesdring_open(const char *name)
+{
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    struct aesdring *ring = calloc(1, sizeof *ring);
+    if (ring == NULL || fstat(fd, &st) < 0 || st.st_size < AESDRING_DATA)
+    {
+        int err = ring ? EINVAL : ENOMEM;
+        free(ring);
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+
+    ring->mapped = st.st_size;
+    void *map = mmap(NULL, ring->mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        free(ring);
+        return NULL;
+    }
+    ring->shared = map;
+    ring->data = (char *)map + AESDRING_DATA;
+    if (ring->shared->magic != AESDRING_MAGIC || AESDRING_DATA + ring->shared->capacity > ring->mapped)
+    {
+        aesdring_close(ring);
+        errno = EINVAL;
+        return NULL;
+    }
+    return ring;
+}
+
+void aesdring_close(struct aesdring *ring)
+{
+    if (ring == NULL)
+        return;
+    munmap(ring->shared, ring->mapped);
+    free(ring);
+}
+
+/**
+ * Reserve space for a record of len payload bytes at ring position *pos,
+ * with *pad bytes of pad record in front when it would run past the end of
+ * the data area
+ * @return false when the ring is full
+ */
+static bool reserve(struct aesdring_shared *shared, size_t len, uint64_t *pos, uint64_t *pad)
+{
+    uint64_t cap = shared->capacity;
+    uint64_t need = AESDRING_SPACE(len);
+    uint64_t tail = atomic_load_explicit(&shared->tail, memory_order_relaxed);
+    for (;;)
+    {
+        uint64_t off = tail & (cap - 1);
+        *pad = (off + need > cap) ? cap - off : 0;
+        if (tail + *pad + need - atomic_load_explicit(&shared->head, memory_order_acquire) > cap)
+            return false;
+        if (atomic_compare_exchange_weak_explicit(&shared->tail, &tail, tail + *pad + need, memory_order_relaxed,
+                                                  memory_order_relaxed))
+        {
+            *pos = tail;
+            return true;
+        }
+    }
+}
+
+static void commit(struct aesdring *ring, uint64_t pos, uint32_t len, uint32_t flags, const void *buf)
+{
+    struct aesdring_record *rec =
+        (struct aesdring_record *)(ring->data + (pos & (ring->shared->capacity - 1)));
+    rec->len = len;
+    rec->flags = flags;
+    if (buf)
+        memcpy(rec + 1, buf, len);
+    atomic_store_explicit(&rec->pos, pos, memory_order_release);
+}
+
+// Wake the server if it parked, ordered after the commit so one of the two sees the other
+static void wakeserver(struct aesdring_shared *shared)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&shared->parked, memory_order_relaxed) && atomic_exchange(&shared->parked, 0))
+        futex(&shared->parked, FUTEX_WAKE, 1, NULL);
+}
+
+int aesdring_tryappend(struct aesdring *ring, const void *buf, size_t len)
+{
+    struct aesdring_shared *shared = ring->shared;
+    if (len == 0 || len > shared->max_packet)
+    {
+        errno = len ? EMSGSIZE : EINVAL;
+        return -1;
+    }
+    if (atomic_load_explicit(&shared->stopped, memory_order_acquire))
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    uint64_t pos, pad;
+    if (!reserve(shared, len, &pos, &pad))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (pad)
+        commit(ring, pos, pad, AESDRING_PAD, NULL);
+    commit(ring, pos + pad, len, 0, buf);
+    wakeserver(shared);
+    return 0;
+}
+
+int aesdring_append(struct aesdring *ring, const void *buf, size_t len)
+{
+    struct aesdring_shared *shared = ring->shared;
+    for (;;)
+    {
+        unsigned gen = atomic_load(&shared->headgen);
+        int rc = aesdring_tryappend(ring, buf, len);
+        if (rc == 0 || errno != EAGAIN)
+            return rc;
+
+        // Full. Say so before looking again, the server then bumps headgen once it makes room
+        atomic_store(&shared->waiting, 1);
+        rc = aesdring_tryappend(ring, buf, len);
+        if (rc == 0 || errno != EAGAIN)
+            return rc;
+        const struct timespec nap = {.tv_sec = 0, .tv_nsec = AESDRING_WAIT_NS};
+        futex(&shared->headgen, FUTEX_WAIT, gen, &nap);
+    }
+}
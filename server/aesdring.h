@@ -0,0 +1,94 @@
+/*
+ * aesdring.h
+ *
+ *  @brief Shared memory ring through which local processes append packets
+ *  to the aesdsocket log without a system call per packet
+ *
+ * aesdsocket -M creates the ring as a POSIX shared memory object. The
+ * first page holds struct aesdring_shared, the data area of capacity bytes
+ * follows it. Producers reserve space by moving tail forward with a
+ * compare and swap, copy their packet in and commit it by storing its
+ * position in the record header last. The server appends committed
+ * records in ring order and moves head past them once they are in the log.
+ *
+ * A record is one packet: the server adds the newline when the payload
+ * does not end in one, and never reads commands out of it. Packets from the
+ * ring reach the log in the order producers reserved their records. The
+ * server appends them in batches, each batch one append, so they land
+ * between the appends of socket clients and never inside one.
+ *
+ * Nobody makes a system call while the ring is neither idle nor full: the
+ * server parks on a futex once it finds the ring empty and is only woken by
+ * the producer that commits next, a producer only waits on a futex while
+ * the ring is full. A producer that dies between reserving and committing
+ * stalls the ring for every other producer.
+ *
+ * Once the server stops taking records, because it is shutting down or
+ * found a record no producer could have written, it sets stopped and wakes
+ * the producers waiting for space. Appends fail from then on.
+ */
+
+#ifndef AESDRING_H
+#define AESDRING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AESDRING_MAGIC 0x31676e7264736561ull // "aesdrng1"
+// Where the data area starts in the mapping
+#define AESDRING_DATA 4096
+// Records start on this boundary and their length is rounded up to it
+#define AESDRING_ALIGN 16
+#define AESDRING_PAD 1u // a record filling the end of the data area, skipped by the server
+
+struct aesdring_shared
+{
+    uint64_t magic;
+    uint64_t capacity;                        // bytes of data area, a power of two
+    uint64_t max_packet;                      // longest payload a record may carry
+    _Alignas(64) atomic_uint_fast64_t tail;   // reserved up to here by producers
+    _Alignas(64) atomic_uint_fast64_t head;   // appended to the log up to here by the server
+    atomic_uint headgen;                      // futex, bumped when head moves while producers wait
+    atomic_uint waiting;                      // producers are waiting for space
+    _Alignas(64) atomic_uint parked;          // futex, the server found the ring empty and sleeps
+    atomic_uint stopped;                      // the server takes no more records
+};
+
+struct aesdring_record
+{
+    atomic_uint_fast64_t pos; // the record's ring position once committed, anything else before
+    uint32_t len;             // payload bytes, or the bytes skipped for AESDRING_PAD
+    uint32_t flags;
+};
+
+// Ring bytes taken by a record of len payload bytes
+#define AESDRING_SPACE(len) \
+    ((sizeof(struct aesdring_record) + (len) + AESDRING_ALIGN - 1) & ~(size_t)(AESDRING_ALIGN - 1))
+
+struct aesdring;
+
+/**
+ * Map the ring aesdsocket created under the shared memory name
+ * @return the ring, or NULL with errno set
+ */
+struct aesdring *aesdring_open(const char *name);
+
+/**
+ * Append one packet of len bytes, waiting while the ring is full
+ * @return 0 once the packet is committed, or -1 with errno set: EMSGSIZE
+ *  when len is above the ring's max_packet, EINVAL when it is 0, EPIPE once
+ *  the server stopped taking records
+ */
+int aesdring_append(struct aesdring *ring, const void *buf, size_t len);
+
+/**
+ * Append one packet of len bytes unless the ring is full
+ * @return 0 once the packet is committed, or -1 with errno set: EAGAIN
+ *  when the ring is full, as aesdring_append() otherwise
+ */
+int aesdring_tryappend(struct aesdring *ring, const void *buf, size_t len);
+
+void aesdring_close(struct aesdring *ring);
+
+#endif /* AESDRING_H */
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,126 +10,526 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <pthread.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
 #include <time.h>
+#include <limits.h>
+#include <endian.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdbool.h>
-#include "aesd_ioctl.h"
-
-#define PORT "9000" // Port to listen on
-#define ERROR (-1)
+#include "aesdsocket.h"
+#include "writer.h"
+#include "aesd-delim.h"
+#include "diaglog.h"
+#include "durable.h"
+#include "snapshot.h"
+#include "feed.h"
+#include "logindex.h"
+#include "store.h"
+#include "timer.h"
+#include "slab.h"
+#include "admit.h"
+#include "shmring.h"
+#include "stats.h"
+#include "trace.h"
 
 int running = 0;
 int servfd = ERROR;
-int logfd = ERROR;
-pthread_mutex_t log_mtx;
+static int localfd = ERROR;    // the Unix socket listener given with -U, if any
+static const char *local_path;
 
+// A connection served by its own thread, from accept until the thread is joined
 struct ConnInfo
 {
-    struct sockaddr_in their_addr;
+    struct ConnInfo *prev;
+    struct ConnInfo *next;
+    struct sockaddr_storage their_addr;
     int recvfd;
+    struct AdmitClient *client;
+    pthread_t thread;
 };
 
-struct Node
+static pthread_mutex_t conns_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conns_idle = PTHREAD_COND_INITIALIZER;
+static struct Slab conns_slab; // guarded by conns_mtx, as are conns and finished
+static struct ConnInfo *conns;
+static struct ConnInfo *finished; // handlers done with their connection, still to be joined
+
+static const struct Store *const stores[] = {&file_store, &chardev_store, &memory_store};
+
+// Only drops running, the loops see it as their wait returns EINTR and shut down from there
+void signalhandler(int signo)
 {
-    struct Node *next;
-    struct ConnInfo conn;
-    pthread_t thread;
-};
+    running = 0;
+}
+
+// Timer job appending a timestamp record to the log
+static void writetimestamp(void *arg)
+{
+    time_t now;
+    struct tm local_info;
+    const char *format_string = "timestamp:%a, %d %b %Y %H:%M:%S %z\n";
+    time(&now);
+    localtime_r(&now, &local_info);
+    char timestamp[200];
+    strftime(timestamp, sizeof(timestamp), format_string, &local_info);
+    DIAG(DIAG_DEBUG, "Appending %.*s", (int)strlen(timestamp) - 1, timestamp);
+    writelog(timestamp, strlen(timestamp));
+}
 
-int getdev()
+ssize_t sendlog(int sockfd, off_t *off, size_t count)
 {
-#if USE_AESD_CHAR_DEVICE
-    if (logfd == ERROR)
+    // Send no further than the end of the segment holding off, the next call goes on from there
+    off_t local, left;
+    struct Segment *seg;
+    int fd = logpin(*off, &local, &left, &seg);
+    if (fd != ERROR)
     {
-        logfd = open("/dev/aesdchar", O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-        if (logfd < 0)
+        if ((off_t)count > left)
+            count = left;
+        off_t from = local;
+        ssize_t sent = sendfile(sockfd, fd, &local, count);
+        logunpin(seg);
+        if (sent > 0)
+            *off += local - from;
+        if (sent >= 0 || (errno != EINVAL && errno != ENOSYS))
+            return sent;
+    }
+
+    // The log cannot be spliced from, bounce through a small fixed buffer instead
+    char buf[REPLY_CHUNK];
+    ssize_t got = logread(buf, (count < sizeof buf) ? count : sizeof buf, *off);
+    if (got <= 0)
+        return got;
+    ssize_t sent = send(sockfd, buf, got, MSG_NOSIGNAL);
+    if (sent > 0)
+        *off += sent;
+    return sent;
+}
+
+/**
+ * Find where packets first to first + count - 1 lie in the first size bytes
+ * of the log, from the packet index when there is one, scanning the
+ * snapshot or the log otherwise
+ */
+static void packetrange(const struct Snapshot *snap, off_t size, off_t first, off_t count,
+                        off_t *start, off_t *end)
+{
+    if (logindex_packets(size, first, count, start, end))
+        return;
+
+    off_t lo = snap ? snap->base : logstart();
+    *start = (first == 0) ? lo : size;
+    *end = size;
+    if (count == 0)
+    {
+        *end = *start;
+        return;
+    }
+
+    char block[REPLY_CHUNK];
+    off_t ended = 0; // packets whose newline has been seen
+    off_t off = lo;
+    while (off < size)
+    {
+        const char *data;
+        size_t len;
+        if (snap)
+        {
+            data = snap->data + (off - snap->base);
+            len = size - off;
+        }
+        else
         {
-            perror("failed to open file!");
-            exit(ERROR);
+            off_t left = size - off;
+            ssize_t got = logread(block, (left < REPLY_CHUNK) ? left : REPLY_CHUNK, off);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                return;
+            data = block;
+            len = got;
         }
+
+        size_t newlines[DELIM_BATCH];
+        size_t base = 0;
+        size_t found;
+        do
+        {
+            found = aesd_delim_scan(data + base, len - base, '\n', newlines, DELIM_BATCH);
+            for (size_t i = 0; i < found; i++)
+            {
+                off_t after = off + base + newlines[i] + 1;
+                ended++;
+                if (ended == first)
+                    *start = after;
+                if (ended - first == count)
+                {
+                    *end = after;
+                    return;
+                }
+            }
+            if (found)
+                base += newlines[found - 1] + 1;
+        } while (found == DELIM_BATCH);
+        off += len;
     }
-#endif
-    return logfd;
 }
 
-size_t writelog(const char *buf, size_t len)
+/**
+ * Resolve a requested range against the log up to offset size, starting no
+ * earlier than the oldest byte still kept
+ */
+static void resolverange(const struct Snapshot *snap, off_t size, enum RangeUnit range, off_t first,
+                         off_t count, const struct aesd_seekto *seekto, off_t *start, off_t *end)
 {
-    pthread_mutex_lock(&log_mtx);
-    len = write(getdev(), buf, len);
-    pthread_mutex_unlock(&log_mtx);
-    return len;
+    off_t lo = snap ? snap->base : logstart();
+    switch (range)
+    {
+    case RANGE_BYTES:
+        if (first < lo)
+            first = lo;
+        *start = (first < size) ? first : size;
+        *end = (count < size - *start) ? *start + count : size;
+        break;
+    case RANGE_PACKETS:
+        packetrange(snap, size, first, count, start, end);
+        break;
+    default:
+        *start = seekstart(seekto);
+        *end = size;
+        if (*start < lo)
+            *start = lo;
+        if (*start > *end)
+            *start = *end;
+        break;
+    }
 }
 
-size_t readlog(char *buf, size_t len)
+// Everything replystart() does but timing it
+static void resolvereply(struct ReplyCursor *cur, const struct Commands *cmds, unsigned count)
 {
-    pthread_mutex_lock(&log_mtx);
-    len = read(getdev(), buf, len);
-    pthread_mutex_unlock(&log_mtx);
-    return len;
+    cur->frames = cmds->frames;
+    cur->nframes = cmds->nframes;
+    cur->frame = 0;
+    cur->head_len = 0;
+
+    // Byte ranges stream from the log, so only the range is read
+    bool whole = false;
+    if (cmds->frames)
+    {
+        for (unsigned i = 0; i < cmds->nframes && !whole; i++)
+            whole = cmds->frames[i].range != RANGE_BYTES;
+    }
+    else
+        whole = cmds->range != RANGE_BYTES;
+    cur->snap = whole ? snapshot_get() : NULL;
+    off_t size = cur->snap ? cur->snap->base + (off_t)cur->snap->len : logsize();
+
+    if (cmds->frames)
+    {
+        // Every frame carries its own range, replymore() steps through them
+        for (unsigned i = 0; i < cmds->nframes; i++)
+        {
+            struct ReplyFrame *f = &cmds->frames[i];
+            resolverange(cur->snap, size, f->range, f->first, f->count, &f->seekto, &f->start, &f->end);
+            f->head.length = htole32(f->end - f->start);
+        }
+        cur->off = cur->start = cur->end = 0;
+        cur->repeat = 0;
+        return;
+    }
+
+    resolverange(cur->snap, size, cmds->range, cmds->range_first, cmds->range_count, &cmds->seekto,
+                 &cur->start, &cur->end);
+    cur->off = cur->start;
+    cur->repeat = (count > 0) ? count - 1 : 0;
 }
 
-void signalhandler(int signo)
+void replystart(struct ReplyCursor *cur, const struct Commands *cmds, unsigned count)
 {
-    printf("Caught signal, exiting\n");
-    syslog(LOG_INFO, "Caught signal, exiting");
+    // A seek made for the reply belongs to the request that asked for it
+    uint64_t current = trace_current;
+    trace_current = cur->trace_id = cmds->trace_id;
+    cur->started_ns = stat_now();
+    resolvereply(cur, cmds, count);
+    if (cur->trace_id)
+        trace_span(cur->trace_id, TRACE_RESOLVE, cur->started_ns, stat_now());
+    trace_current = current;
+}
 
-    if (servfd != ERROR)
-        close(servfd);
-    running = 0;
+void replyend(struct ReplyCursor *cur)
+{
+    if (cur->started_ns)
+    {
+        uint64_t done = stat_now();
+        stat_time(STAT_REPLY, done - cur->started_ns);
+        trace_span(cur->trace_id, TRACE_REPLY, cur->started_ns, done);
+    }
+    cur->started_ns = 0;
+    cur->trace_id = 0;
+    snapshot_put(cur->snap);
+    cur->snap = NULL;
+    cur->frames = NULL;
+    cur->nframes = 0;
+    cur->head_len = 0;
 }
 
-void timeouthandler(int signo)
+bool replymore(struct ReplyCursor *cur)
 {
-    time_t now;
-    struct tm *local_info;
-    const char *format_string = "timestamp:%a, %d %b %Y %H:%M:%S %z\n";
-    time(&now);
-    local_info = localtime(&now);
-    char timestamp[200];
-    strftime(timestamp, sizeof(timestamp), format_string, local_info);
-    printf("%s\n", timestamp);
-    writelog(timestamp, strlen(timestamp));
-    alarm(10);
+    if (cur->head_len || cur->off < cur->end)
+        return true;
+    if (cur->frames)
+    {
+        if (cur->frame == cur->nframes)
+            return false;
+        const struct ReplyFrame *f = &cur->frames[cur->frame++];
+        cur->head = (const char *)&f->head;
+        cur->head_len = sizeof f->head;
+        cur->off = f->start;
+        cur->end = f->end;
+        return true;
+    }
+    if (cur->repeat == 0 || cur->start >= cur->end)
+        return false;
+    cur->repeat--;
+    cur->off = cur->start;
+    return true;
 }
 
-void sendreply(int recvfd, const struct aesd_seekto *seekto)
+void replyadvance(struct ReplyCursor *cur, size_t n)
 {
-    if (logfd == ERROR)
-        return;
+    size_t head = (n < cur->head_len) ? n : cur->head_len;
+    cur->head += head;
+    cur->head_len -= head;
+    cur->off += n - head;
+}
 
-    pthread_mutex_lock(&log_mtx);
-    off_t fsize = lseek(logfd, 0, SEEK_END);
-    lseek(logfd, 0, SEEK_SET);
-    pthread_mutex_unlock(&log_mtx);
+// Everything replysend() does but counting it
+static ssize_t sendsome(int sockfd, struct ReplyCursor *cur)
+{
+    if (!replymore(cur))
+        return 0;
 
-    uint8_t *data = malloc(fsize);
-    if (data == NULL)
+    if (cur->head_len)
     {
-        perror("malloc");
-        return;
+        // Hold the header back until what follows it is queued as well
+        bool more = cur->off < cur->end || cur->frame < cur->nframes;
+        ssize_t sent = send(sockfd, cur->head, cur->head_len, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (sent > 0)
+            replyadvance(cur, sent);
+        return sent;
+    }
+
+    off_t left = cur->end - cur->off;
+    size_t count = (left < REPLY_CHUNK) ? left : REPLY_CHUNK;
+    if (cur->snap)
+    {
+        ssize_t sent = send(sockfd, cur->snap->data + (cur->off - cur->snap->base), count, MSG_NOSIGNAL);
+        if (sent > 0)
+            cur->off += sent;
+        return sent;
+    }
+
+    ssize_t sent = sendlog(sockfd, &cur->off, count);
+    // The log shrank underneath the reply, there is nothing more to send
+    if (sent == 0 && cur->frames)
+    {
+        // The frame header already promised the bytes, the connection can not go on
+        errno = EIO;
+        return ERROR;
+    }
+    if (sent == 0)
+    {
+        cur->off = cur->end;
+        cur->repeat = 0;
+    }
+    return sent;
+}
+
+ssize_t replysend(int sockfd, struct ReplyCursor *cur)
+{
+    uint64_t asked = cur->trace_id ? stat_now() : 0;
+    ssize_t sent = sendsome(sockfd, cur);
+    if (sent > 0)
+    {
+        stat_add(STAT_BYTES_OUT, sent);
+        if (cur->trace_id)
+            trace_span(cur->trace_id, TRACE_SEND, asked, stat_now());
     }
+    return sent;
+}
+
+void sendreply(int recvfd, const struct Commands *cmds, unsigned count)
+{
+    struct ReplyCursor cur;
+    replystart(&cur, cmds, count);
 
-    if (seekto->write_cmd || seekto->write_cmd_offset)
+    if (cur.frames)
+        DIAG(DIAG_DEBUG, "sending %u frames", cur.nframes);
+    else
+        DIAG(DIAG_DEBUG, "sending %u x %lld bytes", count, (long long)(cur.end - cur.off));
+    for (;;)
     {
-        ioctl(logfd, AESDCHAR_IOCSEEKTO, seekto);
+        ssize_t sent = replysend(recvfd, &cur);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+        {
+            if (sent < 0)
+                perror("sendfile");
+            break;
+        }
     }
+    replyend(&cur);
+}
 
-    fsize = readlog(data, fsize);
+/**
+ * Push the log from offset from to a subscribed connection, then every
+ * append as it is committed, until the peer hangs up or the server stops
+ */
+static void pushlog(int recvfd, off_t from)
+{
+    int efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (efd == ERROR)
+    {
+        perror("eventfd");
+        return;
+    }
+    int slot = feed_addwaker(efd);
+    if (slot == ERROR)
+    {
+        fprintf(stderr, "too many subscribers\n");
+        close(efd);
+        return;
+    }
 
-    size_t sent = send(recvfd, data, fsize, 0);
-    if (sent != fsize)
+    struct ReplyCursor cur = {.off = from, .end = from};
+    char discard[RECV_BUF_SIZE];
+    while (running)
     {
-        perror("send");
+        ssize_t sent = replysend(recvfd, &cur);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0)
+        {
+            perror("sendfile");
+            break;
+        }
+        if (sent > 0)
+            continue;
+
+        // Caught up. Arm before looking at the log so an append right after is not missed
+        feed_arm(slot);
+        off_t size = logsize();
+        if (size > cur.off)
+        {
+            cur.end = size;
+            continue;
+        }
+
+        // Wake up now and then to notice the server stopping
+        struct pollfd fds[2] = {{.fd = recvfd, .events = POLLIN}, {.fd = efd, .events = POLLIN}};
+        if (poll(fds, 2, 1000) == ERROR && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            eventfd_t count;
+            eventfd_read(efd, &count);
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            // What a subscriber sends is ignored, it only matters when it hangs up
+            ssize_t got = recv(recvfd, discard, sizeof discard, MSG_DONTWAIT);
+            if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR))
+                break;
+        }
     }
+
+    feed_delwaker(slot);
+    close(efd);
+}
+
+// Close a connection and take it off the live list, with conns_mtx held
+static void conn_unlink(struct ConnInfo *info)
+{
+    // Closed under the lock so shutdown never reaches a descriptor number reused since
+    close(info->recvfd);
+    if (info->prev)
+        info->prev->next = info->next;
     else
+        conns = info->next;
+    if (info->next)
+        info->next->prev = info->prev;
+    if (conns == NULL)
+        pthread_cond_signal(&conns_idle);
+}
+
+/**
+ * Close a thread's connection and leave its ConnInfo for reap(). The thread
+ * still runs its thread-local destructors after this, which log and count
+ * through diaglog, stats and trace, so it is joined before those stop.
+ */
+static void conn_done(struct ConnInfo *info)
+{
+    conn_leave(info->client);
+    pthread_mutex_lock(&conns_mtx);
+    conn_unlink(info);
+    info->next = finished;
+    finished = info;
+    pthread_mutex_unlock(&conns_mtx);
+}
+
+/**
+ * Join the handler threads done with their connections and put their
+ * ConnInfo back in the slab
+ */
+static void reap(void)
+{
+    pthread_mutex_lock(&conns_mtx);
+    struct ConnInfo *done = finished;
+    finished = NULL;
+    pthread_mutex_unlock(&conns_mtx);
+
+    while (done)
     {
-        printf("sending: ");
-        for (int i = 0; i < fsize; i++)
-            printf("%c", data[i]);
+        struct ConnInfo *next = done->next;
+        pthread_join(done->thread, NULL);
+        pthread_mutex_lock(&conns_mtx);
+        slab_free(&conns_slab, done);
+        pthread_mutex_unlock(&conns_mtx);
+        done = next;
     }
+}
 
-    free(data);
+/**
+ * Wait before the next read while the client is over its rate or the writer
+ * is behind, data left in the socket holds the client back
+ * @return false if the connection was shut down meanwhile
+ */
+static bool holdreads(int recvfd, struct AdmitClient *client)
+{
+    unsigned ms = rate_pause(client);
+    if (ms)
+    {
+        // No events asked for, a hangup or shutdown still ends the wait
+        struct pollfd pfd = {.fd = recvfd, .events = 0};
+        if (poll(&pfd, 1, ms) > 0 && (pfd.revents & (POLLHUP | POLLERR)))
+            return false;
+    }
+    if (writer_running() && backlog_pause(writer_queued()))
+        writer_drain(admit_backlog);
+    return true;
 }
 
 void *handle(void *arg)
@@ -139,55 +540,42 @@ void *handle(void *arg)
 
     struct ConnInfo *info = (struct ConnInfo *)arg;
     int recvfd = info->recvfd;
-    struct sockaddr_in their_addr = info->their_addr;
     int bytes_received;
     char client_ip[INET6_ADDRSTRLEN];
-    char buf[1024];
+    char buf[RECV_BUF_SIZE];
+    struct LogBatch batch = {0};
+    struct PacketBuf pkt = {0};
 
-    // Convert client IP to string
-    if (inet_ntop(AF_INET, &their_addr.sin_addr, client_ip, sizeof(client_ip)) == NULL)
-    {
-        perror("inet_ntop");
-        return NULL;
-    }
+    peername(&info->their_addr, client_ip, sizeof client_ip);
 
-    printf("Accepted connection from %s\n", client_ip);
-    syslog(LOG_INFO, "Accepted connection from %s", client_ip);
+    DIAG(DIAG_INFO, "Accepted connection from %s", client_ip);
 
-    while (running)
+    while (running && holdreads(recvfd, info->client))
     {
         bytes_received = recv(recvfd, buf, sizeof buf, 0);
         if (bytes_received > 0)
         {
-            bool completed = false;
-            printf("\nServer received[%d]: ", bytes_received);
-            for (int i = 0; i < bytes_received; i++)
+            struct Commands cmds;
+            int completed = handlechunk(&pkt, buf, bytes_received, &cmds, &batch);
+            batch_flush(&batch);
+            if (completed == ERROR)
+                break;
+            rate_charge(info->client, bytes_received, completed);
+            if (completed > 0)
             {
-                printf("%c", buf[i]);
-                if ('\n' == buf[i])
+                // Pipelined packets are answered together once all of them are in the log
+                if (!batch_wait(&batch))
                 {
-                    completed = true;
+                    DIAG(DIAG_WARN, "Appends from %s missed the log, closing the connection", client_ip);
+                    break;
                 }
+                sendreply(recvfd, &cmds, completed);
             }
-
-            static const char ioctl_cmd[] = "AESDCHAR_IOCSEEKTO:";
-            static const size_t ioctl_cmd_len = sizeof(ioctl_cmd) - 1u;
-            struct aesd_seekto seekto = {.write_cmd = 0, .write_cmd_offset = 0};
-
-            if ((bytes_received > ioctl_cmd_len) &&
-                (memcmp(ioctl_cmd, buf, ioctl_cmd_len) == 0))
-            {
-                sscanf(buf, "AESDCHAR_IOCSEEKTO:%u,%u", &seekto.write_cmd, &seekto.write_cmd_offset);
-                printf("got ioctl seek command - write_cmd %u write_cmd_offset %u\n", seekto.write_cmd, seekto.write_cmd_offset);
-            }
-            else
-            {
-                writelog(buf, bytes_received);
-            }
-
-            if (completed)
+            if (cmds.subscribe != ERROR)
             {
-                sendreply(recvfd, &seekto);
+                // The connection only receives from now on
+                pushlog(recvfd, cmds.subscribe);
+                break;
             }
         }
         else
@@ -196,80 +584,399 @@ void *handle(void *arg)
         }
     }
 
-    printf("Closed connection from %s\n", client_ip);
-    syslog(LOG_INFO, "Closed connection from %s", client_ip);
-    close(recvfd);
+    DIAG(DIAG_INFO, "Closed connection from %s", client_ip);
+    batch_free(&batch);
+    packet_free(&pkt);
+    conn_done(info);
     return NULL;
 }
 
-int main(int argc, const char **argv)
+static void usage(const char *prog)
 {
-    struct addrinfo hints, *res;
-    struct sockaddr_in their_addr;
-    socklen_t addr_size;
+    fprintf(stderr, "usage: %s [-d] [-m thread|epoll|uring] [-r reactors] [-U path]\n"
+                    "       [-M name[:bytes]] [-w max-batch[:max-delay-us]]\n"
+                    "       [-v error|warn|info|debug|trace] [-s sample]\n"
+                    "       [-S segment-bytes[:segment-secs]] [-K keep-bytes[:keep-packets]]\n"
+                    "       [-D none|interval[:ms]|ack] [-b file|chardev|memory[:bytes]] [-T ms]\n"
+                    "       [-c max-connections] [-C max-per-client] [-l backlog]\n"
+                    "       [-R bytes[:packets]] [-Q bytes] [-P bytes] [-A admin-socket]\n"
+                    "       [-t sample[:path]]\n", prog);
+    fprintf(stderr, "  -d  run as a daemon\n");
+    fprintf(stderr, "  -m  connection model: a thread per connection (default), epoll event loops\n");
+    fprintf(stderr, "      or io_uring event loops, which fall back to epoll when io_uring is unavailable\n");
+    fprintf(stderr, "  -r  number of event loops, each pinned to a CPU with its own listener\n");
+    fprintf(stderr, "  -U  also accept connections on a Unix stream socket at path, for clients on\n");
+    fprintf(stderr, "      the same host; they are served exactly as TCP ones\n");
+    fprintf(stderr, "  -M  create a shared memory ring of bytes (4 MB by default) under name that\n");
+    fprintf(stderr, "      local producers append packets to with aesdring.h, see ringbench.c\n");
+    fprintf(stderr, "  -c  close new connections at once while max-connections are open, 0 for no\n");
+    fprintf(stderr, "      limit; by default the descriptor limit, raised to its hard limit, less 64\n");
+    fprintf(stderr, "  -C  the same for the connections of one client, no limit by default; a client\n");
+    fprintf(stderr, "      is a peer address, and every connection on the -U socket is one client\n");
+    fprintf(stderr, "  -l  accept queue of the listeners, 10 for threads and SOMAXCONN for event loops\n");
+    fprintf(stderr, "      by default\n");
+    fprintf(stderr, "  -R  limit every client to bytes and packets per second, 0 for either is no\n");
+    fprintf(stderr, "      limit; the connections of a client over its rate stop reading until it\n");
+    fprintf(stderr, "      is back\n");
+    fprintf(stderr, "  -Q  stop reading from connections while more than bytes of appends wait for\n");
+    fprintf(stderr, "      the log, 4 MB by default; partial packets over it together go to the log\n");
+    fprintf(stderr, "      unfinished as their connections read more\n");
+    fprintf(stderr, "  -P  longest packet kept until its newline, 1 MB by default; the start of a\n");
+    fprintf(stderr, "      longer one goes to the log unfinished, a longer binary frame closes the\n");
+    fprintf(stderr, "      connection\n");
+    fprintf(stderr, "  -A  serve counters and latency histograms to clients sending \"stats\" on the\n");
+    fprintf(stderr, "      Unix socket at admin-socket, and the trace to those sending \"trace\";\n");
+    fprintf(stderr, "      SIGUSR1 prints the counters whether given or not\n");
+    fprintf(stderr, "  -t  trace one in every sample requests through each stage, and write the\n");
+    fprintf(stderr, "      latest as Chrome trace event JSON to path (/var/tmp/aesdsocket-trace.json)\n");
+    fprintf(stderr, "      on exit\n");
+    fprintf(stderr, "  -w  hand appends to a group commit writer thread that gathers up to max-batch\n");
+    fprintf(stderr, "      bytes per writev(), waiting up to max-delay-us for a batch to fill\n");
+    fprintf(stderr, "  -v  diagnostic log level, info by default\n");
+    fprintf(stderr, "  -s  log the start of one in every sample received chunks at debug level\n");
+    fprintf(stderr, "  -b  where the log is kept: " STORE_FILE_PATH ", /dev/aesdchar or a ring of\n");
+    fprintf(stderr, "      bytes in memory (1 MB by default); %s unless given\n",
+            USE_AESD_CHAR_DEVICE ? "chardev" : "file");
+    fprintf(stderr, "  -T  append a timestamp record every ms milliseconds, 10000 by default, 0 for\n");
+    fprintf(stderr, "      none; the chardev backend never gets them\n");
+    fprintf(stderr, "  -S  keep the log as segment files in " STORE_SEGMENT_DIR ", starting a new one\n");
+    fprintf(stderr, "      once the current one holds segment-bytes or is segment-secs old\n");
+    fprintf(stderr, "  -K  drop the oldest segments while the rest still hold keep-bytes, or\n");
+    fprintf(stderr, "      keep-packets packets; 0 for either leaves it unbounded\n");
+    fprintf(stderr, "  -D  durability: sync the log only at exit (none, the default), every ms\n");
+    fprintf(stderr, "      milliseconds (interval, 100 by default), or before replying to the\n");
+    fprintf(stderr, "      packets appended (ack), with appends in flight together sharing a sync\n");
+}
+
+// Close the listeners, removing the Unix socket's file
+static void closelisteners(void)
+{
+    if (servfd != ERROR)
+        close(servfd);
+    if (localfd != ERROR)
+    {
+        close(localfd);
+        unlink(local_path);
+    }
+    localfd = ERROR;
+}
+
+/**
+ * Accept one connection on listenfd and start its handler thread, or close
+ * it straight away when it is refused
+ */
+static void acceptconn(int listenfd)
+{
+    struct sockaddr_storage their_addr;
+    socklen_t addr_size = sizeof their_addr;
+    int recvfd = accept(listenfd, (struct sockaddr *)&their_addr, &addr_size);
+    if (recvfd == ERROR)
+    {
+        if (running)
+            perror("accept");
+        return;
+    }
+    struct AdmitClient *client = conn_admit(&their_addr);
+    if (client == NULL)
+    {
+        DIAG(DIAG_INFO, "Refused a connection, a connection limit is reached");
+        close(recvfd);
+        return;
+    }
 
+    pthread_mutex_lock(&conns_mtx);
+    struct ConnInfo *info = slab_alloc(&conns_slab);
+    if (info)
+    {
+        info->recvfd = recvfd;
+        info->their_addr = their_addr;
+        info->client = client;
+        info->next = conns;
+        if (conns)
+            conns->prev = info;
+        conns = info;
+    }
+    pthread_mutex_unlock(&conns_mtx);
+    if (info == NULL)
+    {
+        perror("malloc");
+        close(recvfd);
+        conn_leave(client);
+        return;
+    }
+
+    // Only this thread reaps, so info->thread is set before anyone joins it
+    int err = pthread_create(&info->thread, NULL, handle, info);
+    if (err != 0)
+    {
+        errno = err;
+        perror("pthread_create");
+        pthread_mutex_lock(&conns_mtx);
+        conn_unlink(info);
+        slab_free(&conns_slab, info);
+        pthread_mutex_unlock(&conns_mtx);
+        conn_leave(client);
+    }
+}
+
+int main(int argc, char **argv)
+{
     int run_as_daemon = 0;
-    if (argc > 1 && strcmp(argv[1], "-d") == 0)
+    bool use_epoll = false;
+    bool use_uring = false;
+    int nreactors = 1;
+    int backlog = 0;
+    size_t writer_batch = 0;
+    unsigned writer_delay = 0;
+    int durability = DURABLE_NONE;
+    unsigned sync_interval = 100;
+    unsigned timestamp_ms = 10000;
+    const char *admin_path = NULL;
+    struct StoreConfig storecfg = {0};
+    // The build picks the default backend, -b any other
+    const struct Store *store = USE_AESD_CHAR_DEVICE ? &chardev_store : &file_store;
+    int opt;
+    while ((opt = getopt(argc, argv, "dm:r:U:M:c:C:l:R:Q:P:A:t:w:v:s:S:K:D:b:T:")) != -1)
     {
-        run_as_daemon = 1;
-        printf("demon mode requested\n");
+        switch (opt)
+        {
+        case 'd':
+            run_as_daemon = 1;
+            printf("demon mode requested\n");
+            break;
+        case 'm':
+            if (strcmp(optarg, "epoll") == 0)
+                use_epoll = true;
+            else if (strcmp(optarg, "uring") == 0)
+                use_epoll = use_uring = true;
+            else if (strcmp(optarg, "thread") != 0)
+            {
+                usage(argv[0]);
+                return ERROR;
+            }
+            break;
+        case 'r':
+            nreactors = atoi(optarg);
+            if (nreactors < 1)
+            {
+                usage(argv[0]);
+                return ERROR;
+            }
+            break;
+        case 'U':
+            local_path = optarg;
+            break;
+        case 'M':
+            if (shmring_parse(optarg) == ERROR)
+            {
+                usage(argv[0]);
+                return ERROR;
+            }
+            break;
+        case 'c':
+        {
+            char *end;
+            admit_conns = strtoul(optarg, &end, 0);
+            if (*end != '\0')
+            {
+                usage(argv[0]);
+                return ERROR;
+            }
+        }
+        break;
+        case 'C':
+        {
+            char *end;
+            admit_client_conns = strtoul(optarg, &end, 0);
+            if (*end != '\0')
+            {
+                usage(argv[0]);
+                return ERROR;
+            }
+        }
+        break;
+        case 'l':
+            backlog = atoi(optarg);
+            if (backlog < 1)
+            {
+                usage(argv[0]);
+                return ERROR;
+            }
+            break;
+        case 'R':
+            if (admit_parserate(optarg) == ERROR)
+            {
+                usage(argv[0]);
+                return ERROR;
+            }
+            break;
+        case 'Q':
+        {
+            char *end;
+            admit_backlog = strtoull(optarg, &end, 0);
+            if (*end != '\0')
+            {
+                usage(argv[0]);
+                return ERROR;
+            }
+        }
+        break;
+        case 'P':
+        {
+            char *end;
+            admit_packet = strtoull(optarg, &end, 0);
+            if (*end != '\0' || admit_packet == 0)
+            {
+                usage(argv[0]);
+                return ERROR;
+            }
+        }
+        break;
+        case 'A':
+            admin_path = optarg;
+            break;
+        case 't':
+            if (trace_parse(optarg) == ERROR)
+            {
+                usage(argv[0]);
+                return ERROR;
+            }
+            break;
+        case 'w':
+        {
+            char *end;
+            writer_batch = strtoul(optarg, &end, 0);
+            if (*end == ':')
+                writer_delay = strtoul(end + 1, &end, 0);
+            if (writer_batch == 0 || *end != '\0')
+            {
+                usage(argv[0]);
+                return ERROR;
+            }
+        }
+        break;
+        case 'v':
+            diag_level = diag_parselevel(optarg);
+            if (diag_level == ERROR)
+            {
+                usage(argv[0]);
+                return ERROR;
+            }
+            break;
+        case 's':
+            diag_sample = strtoul(optarg, NULL, 0);
+            break;
+        case 'D':
+            durability = durable_parse(optarg, &sync_interval);
+            if (durability == ERROR)
+            {
+                usage(argv[0]);
+                return ERROR;
+            }
+            break;
+        case 'T':
+        {
+            char *end;
+            timestamp_ms = strtoul(optarg, &end, 0);
+            if (*end != '\0')
+            {
+                usage(argv[0]);
+                return ERROR;
+            }
+        }
+        break;
+        case 'b':
+        {
+            char *colon = strchr(optarg, ':');
+            size_t namelen = colon ? (size_t)(colon - optarg) : strlen(optarg);
+            store = NULL;
+            for (size_t i = 0; i < sizeof stores / sizeof *stores; i++)
+            {
+                if (strlen(stores[i]->name) == namelen && strncmp(stores[i]->name, optarg, namelen) == 0)
+                    store = stores[i];
+            }
+            if (store == NULL)
+            {
+                usage(argv[0]);
+                return ERROR;
+            }
+            storecfg.arg = colon ? colon + 1 : NULL;
+        }
+        break;
+        case 'S':
+        {
+            char *end;
+            storecfg.seg_bytes = strtoull(optarg, &end, 0);
+            if (*end == ':')
+                storecfg.seg_secs = strtoul(end + 1, &end, 0);
+            if (storecfg.seg_bytes <= 0 || *end != '\0')
+            {
+                usage(argv[0]);
+                return ERROR;
+            }
+        }
+        break;
+        case 'K':
+        {
+            char *end;
+            storecfg.keep_bytes = strtoull(optarg, &end, 0);
+            if (*end == ':')
+                storecfg.keep_packets = strtoull(end + 1, &end, 0);
+            if (storecfg.keep_bytes < 0 || storecfg.keep_packets < 0 || *end != '\0')
+            {
+                usage(argv[0]);
+                return ERROR;
+            }
+        }
+        break;
+        default:
+            usage(argv[0]);
+            return ERROR;
+        }
     }
 
     openlog("aesdsocket", LOG_PID | LOG_CONS, LOG_USER);
     signal(SIGINT, signalhandler);
     signal(SIGTERM, signalhandler);
+    // A client closing mid reply must only fail that send, not end the server
+    signal(SIGPIPE, SIG_IGN);
+    // Taken by the stats thread from a signalfd, every thread started later inherits the block
+    stats_blocksignal();
 
-    if (pthread_mutex_init(&log_mtx, NULL) != 0)
+    if ((storecfg.seg_bytes || storecfg.seg_secs) && store != &file_store)
     {
-        perror("mutex");
+        fprintf(stderr, "-S needs the file backend, %s bounds the log itself\n", store->name);
         return ERROR;
     }
-
-    // Prepare hints
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;     // IPv4 or IPv6
-    hints.ai_socktype = SOCK_STREAM; // TCP
-    hints.ai_flags = AI_PASSIVE;     // Use my IP
-
-    if (getaddrinfo(NULL, PORT, &hints, &res) != 0)
+    if (durability != DURABLE_NONE && store->sync == NULL)
     {
-        perror("getaddrinfo");
+        fprintf(stderr, "-D needs a backend on disk, %s keeps the log in memory\n", store->name);
         return ERROR;
     }
-
-    servfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (servfd == ERROR)
+    if ((storecfg.keep_bytes || storecfg.keep_packets) && storecfg.seg_bytes == 0)
     {
-        perror("socket");
+        fprintf(stderr, "-K drops whole segments and needs -S\n");
         return ERROR;
     }
 
-    if (bind(servfd, res->ai_addr, res->ai_addrlen) == ERROR)
-    {
-        perror("bind");
-        close(servfd);
+    // The event loop is meant to take connection storms, give it the system maximum queue
+    if (backlog == 0)
+        backlog = use_epoll ? SOMAXCONN : 10;
+    servfd = openlistener(backlog, nreactors > 1);
+    if (servfd == ERROR)
         return ERROR;
-    }
-
-    freeaddrinfo(res);
-
-    if (listen(servfd, 10) == ERROR)
+    if (local_path && (localfd = openlocal(local_path, backlog)) == ERROR)
     {
-        perror("listen");
-        close(servfd);
+        closelisteners();
         return ERROR;
     }
 
-#if USE_AESD_CHAR_DEVICE == 0
-    system("mkdir -p /var/tmp/");
-    logfd = open("/var/tmp/aesdsocketdata", O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-    if (logfd < 0)
+    if (logopen(store, &storecfg) == ERROR)
     {
-        perror("failed to open file!");
-        close(servfd);
+        closelisteners();
         return ERROR;
     }
-#endif
+    DIAG(DIAG_INFO, "log kept by the %s backend", store->name);
 
     if (run_as_daemon)
     {
@@ -293,49 +1000,112 @@ int main(int argc, const char **argv)
 
     printf("pid : %d\n", getpid());
 
-#if USE_AESD_CHAR_DEVICE == 0
-    alarm(10);
-    signal(SIGALRM, timeouthandler);
-#endif
-
-    struct Node *head = NULL;
+    // Started after the fork, threads do not survive it
+    if (diag_start() == ERROR)
+    {
+        closelisteners();
+        return ERROR;
+    }
+    if (durable_start(durability, sync_interval) == ERROR)
+    {
+        timer_stop();
+        diag_stop();
+        closelisteners();
+        return ERROR;
+    }
+    if (writer_batch && writer_start(writer_batch, writer_delay) == ERROR)
+    {
+        timer_stop();
+        durable_stop();
+        diag_stop();
+        closelisteners();
+        return ERROR;
+    }
+    // The driver's log holds client packets only
+    if ((store != &chardev_store && timestamp_ms && timer_add(timestamp_ms, writetimestamp, NULL) == ERROR) ||
+        admit_start() == ERROR || timer_start() == ERROR || stats_start(admin_path) == ERROR ||
+        shmring_start() == ERROR)
+    {
+        stats_stop();
+        timer_stop();
+        writer_stop();
+        durable_stop();
+        diag_stop();
+        closelisteners();
+        return ERROR;
+    }
 
     running = 1;
+    bool caught = true;
+    if (use_epoll)
+    {
+        caught = reactor_run(servfd, localfd, backlog, nreactors, use_uring) == 0;
+        running = 0;
+    }
+
+    // Handler threads are joined as new connections come in and at shutdown
+    slab_init(&conns_slab, sizeof(struct ConnInfo));
+
+    // The stop signals only get in while ppoll() waits, so one arriving just
+    // before it still cuts the wait short; handler threads inherit the block
+    sigset_t blocked, waitmask;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &blocked, &waitmask);
+
+    // poll() skips a negative descriptor, so without -U only the TCP listener is watched
+    struct pollfd listeners[2] = {{.fd = servfd, .events = POLLIN}, {.fd = localfd, .events = POLLIN}};
     while (running)
     {
-        printf("Server: waiting for connections...\n");
+        DIAG(DIAG_DEBUG, "Server: waiting for connections...");
 
-        addr_size = sizeof their_addr;
-        int recvfd = accept(servfd, (struct sockaddr *)&their_addr, &addr_size);
-        if (recvfd == ERROR)
+        if (ppoll(listeners, 2, NULL, &waitmask) == ERROR)
         {
-            perror("accept");
+            if (errno != EINTR)
+                perror("ppoll");
+            continue;
         }
-        else
+        // Handlers that finished meanwhile give their stacks back before new ones start
+        reap();
+        for (int i = 0; i < 2 && running; i++)
         {
-            struct Node *node = malloc(sizeof(struct Node));
-            node->next = head;
-            node->conn.recvfd = recvfd;
-            node->conn.their_addr = their_addr;
-            pthread_create(&node->thread, NULL, handle, &node->conn);
-            head = node;
+            if (listeners[i].revents & POLLIN)
+                acceptconn(listeners[i].fd);
         }
     }
 
-    while (head != NULL)
+    if (caught)
     {
-        pthread_join(head->thread, NULL);
-        struct Node *next = head->next;
-        free(head);
-        head = next;
+        printf("Caught signal, exiting\n");
+        syslog(LOG_INFO, "Caught signal, exiting");
     }
 
-    close(servfd);
-#if USE_AESD_CHAR_DEVICE == 0
-    fsync(logfd);
-    close(logfd);
-#endif
-    pthread_mutex_destroy(&log_mtx);
+    // Wake the handlers still waiting on their clients and let all of them finish
+    pthread_mutex_lock(&conns_mtx);
+    for (struct ConnInfo *info = conns; info; info = info->next)
+        shutdown(info->recvfd, SHUT_RDWR);
+    while (conns != NULL)
+        pthread_cond_wait(&conns_idle, &conns_mtx);
+    pthread_mutex_unlock(&conns_mtx);
+    // Their thread-local destructors have run once they are joined
+    reap();
+    slab_destroy(&conns_slab);
+
+    // The closes just logged may fill this thread's ring, the summaries below need room
+    diag_sync();
+
+    shmring_stop();
+    stats_stop();
+    trace_stop();
+    timer_stop();
+    writer_stop();
+    durable_stop();
+    admit_stop();
+    snapshot_clear();
+    diag_stop();
+    closelisteners();
+    logclose();
 
     return 0;
 }
@@ -0,0 +1,360 @@
+/*
+ * aesdsocket.h
+ *
+ *  @brief State and helpers shared between the aesdsocket connection handlers
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "aesd_ioctl.h"
+#include "aesdproto.h"
+
+#define ERROR (-1)
+
+// Packet ends looked up per delimiter scan
+#define DELIM_BATCH 64
+
+// Size of the buffer each recv() is performed into
+#define RECV_BUF_SIZE 1024
+
+// Replies are streamed in chunks of at most this many bytes, which is also the
+// most a connection ever stages in userspace for one
+#define REPLY_CHUNK (64 * 1024)
+
+extern int running;
+extern int servfd;
+// Serializes appends to the log
+extern pthread_mutex_t log_mtx;
+
+struct WriterReq;
+struct Snapshot;
+struct Store;
+struct StoreConfig;
+
+/**
+ * Appends staged by one connection or event loop so they reach the log as a
+ * single append. The chunks of a batch land contiguously and in the order
+ * they were received; batches from different owners interleave whole. A
+ * store that makes every write an entry of its own gets one write per
+ * packet instead, gathered into as few writev() calls as allowed.
+ */
+struct LogBatch
+{
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t *ends;           // where each staged packet ends, only kept for such a store
+    unsigned nends;
+    unsigned endcap;
+    struct WriterReq *last; // latest flush still owned by the writer thread, if any
+    bool failed;            // a flush since the last batch_wait() or batch_claim() missed the log
+};
+
+/**
+ * Open backend and keep the log there until logclose()
+ * @return 0 on success, ERROR with the reason printed
+ */
+int logopen(const struct Store *backend, const struct StoreConfig *cfg);
+
+/**
+ * Sync what the backend can and release it
+ */
+void logclose(void);
+
+/**
+ * @return true when the backend makes every write an entry of its own, so
+ *  packets must never share a write
+ */
+bool logentries(void);
+
+size_t writelog(const char *buf, size_t len);
+
+/**
+ * Gathered write of iov to the log under log_mtx
+ */
+ssize_t writelogv(const struct iovec *iov, int iovcnt);
+
+/**
+ * Note that an append reached the log: advances the log generation and wakes
+ * subscribers. Lock free.
+ */
+void logcommitted(void);
+
+/**
+ * @return the log generation, the number of appends committed so far
+ */
+uint64_t loggeneration(void);
+
+/**
+ * fdatasync() whatever holds the log
+ * @return 0 on success, ERROR with errno set
+ */
+int logsync(void);
+
+/**
+ * @return a descriptor io_uring may queue appends to with offset -1, or
+ *  ERROR when appends have to go through writelog()
+ */
+int logappendfd(void);
+
+/**
+ * Stage len bytes for the next batch_flush()
+ * @return false if the batch could not grow, the caller must write directly
+ */
+bool batch_append(struct LogBatch *batch, const char *buf, size_t len);
+
+/**
+ * Hand everything staged in batch to the log
+ */
+void batch_flush(struct LogBatch *batch);
+
+/**
+ * Write everything staged in batch to the log under log_mtx, bypassing the
+ * writer thread, and empty it
+ * @return false if not all of it made it to the log
+ */
+bool batch_write(struct LogBatch *batch);
+
+/**
+ * Block until the writer is done with everything flushed from batch
+ * @return false if any of it failed to reach the log, the replies that
+ *  depend on it must not go out
+ */
+bool batch_wait(struct LogBatch *batch);
+
+/**
+ * Hand over what the flushes of batch so far depend on, for a caller that
+ * waits on them itself, and start over
+ * @param failed is set if one of those flushes already failed
+ * @return the writer reference covering the rest, NULL when none is in flight
+ */
+struct WriterReq *batch_claim(struct LogBatch *batch, bool *failed);
+
+/**
+ * Flush batch and release everything it holds
+ */
+void batch_free(struct LogBatch *batch);
+
+// Unit of a range read
+enum RangeUnit
+{
+    RANGE_NONE,    // no range asked for, replies run from the seekto start to the end of the log
+    RANGE_BYTES,   // AESDSOCKET_READ:<offset>[,<length>]
+    RANGE_PACKETS, // AESDSOCKET_READPKT:<index>[,<count>], packets counted from 0
+};
+
+/**
+ * The reply to one binary mode request: its header followed by a range of the log
+ */
+struct ReplyFrame
+{
+    struct aesd_frame head;    // length is filled in once the range is resolved
+    enum RangeUnit range;
+    off_t first;
+    off_t count;
+    struct aesd_seekto seekto; // where a RANGE_NONE range starts
+    off_t start;               // the resolved range
+    off_t end;
+};
+
+/**
+ * Progress of a reply. Replies are sent from a snapshot of the log shared
+ * with every other reply at the same generation; when the log is too large
+ * for one they stream from the log itself and the connection only keeps this
+ * cursor, so per connection memory does not depend on the log size.
+ */
+struct ReplyCursor
+{
+    off_t off;             // next log byte to send
+    off_t start;           // where every copy of the reply starts
+    off_t end;             // log size when the reply was requested
+    unsigned repeat;       // copies still due after this one, one per pipelined packet
+    struct Snapshot *snap; // what the reply is sent from, NULL to stream from the log
+    const struct ReplyFrame *frames; // binary mode replies, sent one after the other
+    unsigned nframes;
+    unsigned frame;        // next frame to start
+    const char *head;      // frame header bytes still to send ahead of the range
+    size_t head_len;
+    uint64_t started_ns;   // when replystart() resolved the reply, 0 outside one
+    uint64_t trace_id;     // the sampled request the reply answers, 0 when not traced
+};
+
+enum Protocol
+{
+    PROTO_NEW,    // too few bytes received to tell
+    PROTO_TEXT,   // newline delimited packets
+    PROTO_BINARY, // struct aesd_frame framed requests, negotiated with AESD_BINARY_HELLO
+};
+
+/**
+ * Bytes a connection received after its last complete packet. Only whole
+ * packets are ever staged for the log, so a packet split over several
+ * recv() calls can not interleave with packets of other connections.
+ */
+struct PacketBuf
+{
+    char *buf;
+    size_t len;
+    size_t cap;
+    enum Protocol proto;
+    struct ReplyFrame *frames; // replies due for the last chunk in binary mode
+    unsigned nframes;
+    unsigned framecap;
+    bool spilled; // the start of the packet in progress went to the log unfinished
+};
+
+/**
+ * Commands found among the packets of one received chunk. Command packets
+ * are not written to the log.
+ */
+struct Commands
+{
+    struct aesd_seekto seekto; // AESDCHAR_IOCSEEKTO, applies to all replies due for the chunk
+    enum RangeUnit range;      // a range read, takes over from seekto for all replies due
+    off_t range_first;
+    off_t range_count;         // to the end of the log when not given
+    off_t subscribe;           // FEED_SUBSCRIBE_CMD log offset to push from, ERROR when not asked for
+    struct ReplyFrame *frames; // binary mode: one reply per request, replaces the above
+    unsigned nframes;
+    uint64_t trace_id;         // the chunk's request ID when it is traced, 0 otherwise
+};
+
+/**
+ * Apply one received chunk to the log following the aesdsocket line protocol,
+ * or the binary framing when the connection opened with AESD_BINARY_HELLO.
+ * The chunk may finish a packet held in pkt and carry any number of further
+ * packets; each completed packet is staged whole, a trailing partial packet
+ * is kept in pkt until its newline, or the rest of its frame, arrives.
+ * @param cmds is reset and then filled in from the command packets completed
+ * @param batch collects the appends until the caller flushes it
+ * @return the number of completed packets that are due a reply, or ERROR if
+ *  the partial packet could not be kept. Replies due before a subscribe are
+ *  sent before the connection turns into a subscriber.
+ */
+int handlechunk(struct PacketBuf *pkt, const char *buf, size_t len, struct Commands *cmds, struct LogBatch *batch);
+
+/**
+ * Drop a partial packet, it never reaches the log
+ */
+void packet_free(struct PacketBuf *pkt);
+
+/**
+ * Resolve where a reply starts, applying the AESDCHAR_IOCSEEKTO request if one was made
+ * @return the log offset of the first byte to send
+ */
+off_t seekstart(const struct aesd_seekto *seekto);
+
+/**
+ * @return the log offset of the oldest byte still kept, 0 unless segment
+ *  retention dropped the start of the log
+ */
+off_t logstart(void);
+
+/**
+ * @return the current size of the log, which is where a reply ends. Offsets
+ *  keep counting from the first byte ever written, retention or not.
+ */
+off_t logsize(void);
+
+struct Segment;
+
+/**
+ * Find the descriptor holding log offset off and keep it open until logunpin()
+ * @param local is set to the offset to read from in that descriptor
+ * @param left is set to the bytes that can be read there before moving on
+ * @param seg is set to what logunpin() releases
+ * @return the descriptor, or ERROR when off is no longer kept or not written yet
+ */
+int logpin(off_t off, off_t *local, off_t *left, struct Segment **seg);
+
+void logunpin(struct Segment *seg);
+
+/**
+ * pread() from the log at offset off, stopping at a segment end
+ * @return the number of bytes read, 0 past either end of the log, or -1 with errno set
+ */
+ssize_t logread(void *buf, size_t len, off_t off);
+
+/**
+ * Send up to count log bytes starting at *off straight from the log to sockfd,
+ * without copying them through userspace when the log supports it.
+ * @param off is advanced past the bytes sent
+ * @return the number of bytes sent, 0 at the end of the log or when off is no
+ *  longer kept, or -1 with errno set (EAGAIN when a non-blocking socket is full)
+ */
+ssize_t sendlog(int sockfd, off_t *off, size_t count);
+
+/**
+ * Point cur at the log range a reply carries
+ * @param cmds selects the range, the whole log from the seekto start unless
+ *  a range read was asked for
+ * @param count is the number of packets answered, each gets its own copy of
+ *  the range and the copies go out back to back
+ */
+void replystart(struct ReplyCursor *cur, const struct Commands *cmds, unsigned count);
+
+/**
+ * @return true while the reply has bytes left, rewinding cur for the next copy
+ *  or moving it to the next frame once the current one is sent. A pending
+ *  frame header in cur->head goes out ahead of the log range.
+ */
+bool replymore(struct ReplyCursor *cur);
+
+/**
+ * Account for n bytes of the reply sent, header bytes first
+ */
+void replyadvance(struct ReplyCursor *cur, size_t n);
+
+/**
+ * Release what the reply holds, once it is sent or abandoned
+ */
+void replyend(struct ReplyCursor *cur);
+
+/**
+ * Send the next chunk of at most REPLY_CHUNK bytes of the reply
+ * @return the number of bytes sent, 0 once the reply is complete,
+ *  or -1 with errno set (EAGAIN when a non-blocking socket is full, EIO when
+ *  the log shrank under a binary reply whose header promised more)
+ */
+ssize_t replysend(int sockfd, struct ReplyCursor *cur);
+
+/**
+ * Create a socket listening on the aesdsocket port
+ * @param reuseport allows several sockets to bind the port so the kernel spreads connections across them
+ * @return the listening socket or ERROR
+ */
+int openlistener(int backlog, bool reuseport);
+
+/**
+ * Create a Unix stream socket listening at path, replacing a socket file an
+ * earlier run left there
+ * @return the listening socket or ERROR
+ */
+int openlocal(const char *path, int backlog);
+
+/**
+ * Describe a peer for the logs: its IP address, or "local" for a Unix socket
+ * client
+ */
+void peername(const struct sockaddr_storage *addr, char *name, size_t len);
+
+/**
+ * Serve connections from nreactors epoll event loops until running drops.
+ * The first loop runs on the calling thread and accepts on listenfd, every
+ * other loop gets its own thread and SO_REUSEPORT listener. With more than
+ * one loop each thread is pinned to its own CPU.
+ * @param localfd is a Unix socket listener every loop accepts on as well, ERROR for none
+ * @param backlog is the accept queue of the listeners the other loops open
+ * @param use_uring drives the loops with io_uring instead of epoll where the kernel allows it
+ */
+int reactor_run(int listenfd, int localfd, int backlog, int nreactors, bool use_uring);
+
+#endif /* AESDSOCKET_H */
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Compare loopback TCP with the Unix socket listener (-U) for a client on the
+# same host. For each connection model runs the same acknowledged appends once
+# over each transport. Run from the server directory after make bench. Extra
+# arguments are passed to aesdbench, e.g. -c 1 for the latency of a single
+# appender, or -c 64 for throughput.
+
+modes=${MODES:-"thread epoll uring"}
+sock=${SOCKET:-/tmp/aesdsocket.sock}
+
+for mode in $modes; do
+    for transport in tcp unix; do
+        rm -f /var/tmp/aesdsocketdata /var/tmp/aesdsocketdata.idx
+        ./aesdsocket -m "$mode" -b "${BACKEND:-file}" -U "$sock" > /dev/null 2>&1 &
+        pid=$!
+        sleep 1
+        printf "%-6s %-4s " "$mode" "$transport"
+        if [ "$transport" = unix ]; then
+            ./aesdbench -a -u "$sock" -d "${SECONDS_PER_RUN:-5}" "$@"
+        else
+            ./aesdbench -a -d "${SECONDS_PER_RUN:-5}" "$@"
+        fi
+        kill -TERM "$pid"
+        wait "$pid"
+    done
+done
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Compare aesdsocket connection models under the same acknowledged append
+# load. For each model prints the load generator result and the CPU time the
+# server spent, which is where the saved system calls show up. Run from the
+# server directory after make bench. BACKENDS picks the storage backends to run
+# each model against, e.g. "file memory chardev". Extra arguments are passed to
+# aesdbench.
+
+modes=${MODES:-"thread epoll uring"}
+backends=${BACKENDS:-"file"}
+
+for backend in $backends; do
+    for mode in $modes; do
+        rm -f /var/tmp/aesdsocketdata /var/tmp/aesdsocketdata.idx
+        ./aesdsocket -m "$mode" -b "$backend" > /dev/null 2>&1 &
+        pid=$!
+        sleep 1
+        printf "%-7s %-6s " "$backend" "$mode"
+        ./aesdbench -a -d "${SECONDS_PER_RUN:-5}" "$@"
+        # utime and stime in clock ticks, fields 14 and 15 of /proc/pid/stat
+        awk -v hz="$(getconf CLK_TCK)" '{ printf "       server user %.2fs sys %.2fs\n", $14 / hz, $15 / hz }' "/proc/$pid/stat"
+        kill -TERM "$pid"
+        wait "$pid"
+    done
+done
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Measure aesdsocket acknowledged append throughput with 1, 2, 4 ... event loops
+# up to the CPU count (or the first argument). Run from the server directory
+# after make bench.
+# Half of the CPUs are left to the load generator.
+
+max=${1:-$(nproc)}
+seconds=${SECONDS_PER_RUN:-5}
+conns=${CONNECTIONS:-256}
+threads=${THREADS:-$(( $(nproc) / 2 > 0 ? $(nproc) / 2 : 1 ))}
+
+r=1
+while [ "$r" -le "$max" ]; do
+    rm -f /var/tmp/aesdsocketdata /var/tmp/aesdsocketdata.idx
+    ./aesdsocket -m epoll -r "$r" > /dev/null 2>&1 &
+    pid=$!
+    sleep 1
+    printf "reactors %d: " "$r"
+    ./aesdbench -a -c "$conns" -t "$threads" -d "$seconds" -s "${SIZE:-256}"
+    kill -TERM "$pid"
+    wait "$pid"
+    r=$((r * 2))
+done
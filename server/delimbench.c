@@ -0,0 +1,134 @@
+/**
+ * @file delimbench.c
+ * @brief Microbenchmark for the shared packet delimiter scanner
+ *
+ * Fills a buffer with newline terminated packets of one size and times how
+ * fast each aesd_delim_scan() implementation finds every packet end in it,
+ * next to a plain byte loop and a memchr() loop. Packet sizes run from 64 B
+ * to 1 MB. Prints the throughput of each implementation per packet size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "aesd-delim.h"
+
+#define ERROR (-1)
+#define BUF_SIZE (4 * 1024 * 1024)
+#define POS_BATCH 64
+
+typedef size_t (*scan_fn)(const char *buf, size_t len, char delim, size_t *pos, size_t max);
+
+struct Impl
+{
+    const char *name;
+    scan_fn scan;
+};
+
+static size_t scan_memchr(const char *buf, size_t len, char delim, size_t *pos, size_t max)
+{
+    size_t n = 0;
+    const char *p = buf;
+    while (n < max && (p = memchr(p, delim, buf + len - p)) != NULL)
+        pos[n++] = p++ - buf;
+    return n;
+}
+
+static const struct Impl impls[] = {
+    {"byte", aesd_delim_scan_byte},
+    {"memchr", scan_memchr},
+    {"word", aesd_delim_scan_word},
+    {"sse2", aesd_delim_scan_sse2},
+    {"avx2", aesd_delim_scan_avx2},
+    {"auto", aesd_delim_scan},
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Find every delimiter in buf the way handlechunk() does, a batch of positions at a time
+static size_t scanall(scan_fn scan, const char *buf, size_t len)
+{
+    size_t pos[POS_BATCH];
+    size_t start = 0, total = 0, found;
+    do
+    {
+        found = scan(buf + start, len - start, '\n', pos, POS_BATCH);
+        if (found)
+            start += pos[found - 1] + 1;
+        total += found;
+    } while (found == POS_BATCH);
+    return total;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-t seconds-per-case]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = 0.2;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            seconds = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return ERROR;
+        }
+    }
+
+    char *buf = malloc(BUF_SIZE);
+    if (buf == NULL)
+    {
+        perror("malloc");
+        return ERROR;
+    }
+
+    printf("%-8s", "packet");
+    for (size_t k = 0; k < sizeof impls / sizeof impls[0]; k++)
+        printf("%10s", impls[k].name);
+    printf("   (GB/s)\n");
+
+    for (size_t size = 64; size <= 1024 * 1024; size *= 4)
+    {
+        // Printable filler with a newline closing every packet
+        for (size_t i = 0; i < BUF_SIZE; i++)
+            buf[i] = ((i + 1) % size == 0) ? '\n' : 'a' + i % 26;
+        const size_t expect = BUF_SIZE / size;
+
+        printf("%-8zu", size);
+        for (size_t k = 0; k < sizeof impls / sizeof impls[0]; k++)
+        {
+            size_t rounds = 0;
+            double start = now(), elapsed;
+            do
+            {
+                if (scanall(impls[k].scan, buf, BUF_SIZE) != expect)
+                {
+                    fprintf(stderr, "%s found the wrong number of packets\n", impls[k].name);
+                    free(buf);
+                    return ERROR;
+                }
+                rounds++;
+                elapsed = now() - start;
+            } while (elapsed < seconds);
+            printf("%10.2f", (double)rounds * BUF_SIZE / elapsed / 1e9);
+        }
+        printf("\n");
+    }
+
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,108 @@
+/**
+ * @file devstore.c
+ * @brief The aesdsocket log kept by the aesdchar driver in /dev/aesdchar
+ *
+ * The driver bounds the log itself and resolves seeks with its own ioctl.
+ * Every write() it gets is one entry of its history, which is what
+ * AESDCHAR_IOCSEEKTO counts in, so packets are written one per entry.
+ * Writes, lseek() and the ioctl all move the one shared file position, so
+ * they are serialized by log_mtx.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include "aesdsocket.h"
+#include "store.h"
+
+#define DEV_PATH "/dev/aesdchar"
+
+static int devfd = ERROR;
+
+static int dev_open(const struct StoreConfig *cfg)
+{
+    devfd = open(DEV_PATH, O_RDWR | O_CLOEXEC);
+    if (devfd < 0)
+    {
+        perror("failed to open " DEV_PATH);
+        return ERROR;
+    }
+    return 0;
+}
+
+static void dev_close(void)
+{
+    if (devfd != ERROR)
+        close(devfd);
+    devfd = ERROR;
+}
+
+static ssize_t dev_append(const struct iovec *iov, int iovcnt)
+{
+    return writev(devfd, iov, iovcnt);
+}
+
+static off_t dev_start(void)
+{
+    return 0;
+}
+
+static off_t dev_size(void)
+{
+    pthread_mutex_lock(&log_mtx);
+    off_t size = lseek(devfd, 0, SEEK_END);
+    pthread_mutex_unlock(&log_mtx);
+    return (size < 0) ? 0 : size;
+}
+
+static ssize_t dev_read(void *buf, size_t len, off_t off)
+{
+    return pread(devfd, buf, len, off);
+}
+
+static int dev_pin(off_t off, off_t *local, off_t *left, struct Segment **seg)
+{
+    *seg = NULL;
+    *local = off;
+    *left = LLONG_MAX;
+    return devfd;
+}
+
+static void dev_unpin(struct Segment *seg)
+{
+}
+
+static off_t dev_seek(const struct aesd_seekto *seekto)
+{
+    off_t pos = ERROR;
+    pthread_mutex_lock(&log_mtx);
+    if (ioctl(devfd, AESDCHAR_IOCSEEKTO, seekto) == 0)
+        pos = lseek(devfd, 0, SEEK_CUR);
+    pthread_mutex_unlock(&log_mtx);
+    return pos;
+}
+
+static int dev_appendfd(void)
+{
+    // Not opened O_APPEND: a write lands at the shared file position, which only log_mtx guards
+    return ERROR;
+}
+
+const struct Store chardev_store = {
+    .name = "chardev",
+    .entry_per_write = true,
+    .open = dev_open,
+    .close = dev_close,
+    .append = dev_append,
+    .start = dev_start,
+    .size = dev_size,
+    .read = dev_read,
+    .pin = dev_pin,
+    .unpin = dev_unpin,
+    .seek = dev_seek,
+    .sync = NULL,
+    .appendfd = dev_appendfd,
+};
@@ -0,0 +1,324 @@
+/**
+ * @file diaglog.c
+ * @brief Leveled diagnostic logging that stays off the aesdsocket hot path
+ *
+ * Every thread that logs gets its own single-producer single-consumer ring
+ * of fixed size records, so recording a message is a vsnprintf() into the
+ * next free slot and an atomic store, without locks or system calls. One
+ * flusher thread drains all rings to stdout, and to syslog for DIAG_INFO and
+ * above. It naps between drains so bursts are written in one go, and parks
+ * on a futex once every ring is empty; only the first message after that
+ * has to wake it.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "aesdsocket.h"
+#include "diaglog.h"
+
+// Messages a thread can have in flight before new ones are dropped
+#define DIAG_SLOTS 32
+// Longest message kept, longer ones are cut
+#define DIAG_TEXT 120
+// Payload bytes shown by a sampled dump
+#define DIAG_PAYLOAD_SHOWN 48
+// How long the flusher lets messages gather between drains
+#define DIAG_NAP_NS (50 * 1000 * 1000)
+
+struct DiagRecord
+{
+    int level;
+    int len;
+    char text[DIAG_TEXT];
+};
+
+struct DiagRing
+{
+    struct DiagRing *next; // guarded by rings_mtx
+    atomic_size_t head;    // next slot the flusher reads
+    atomic_size_t tail;    // next slot the owner writes
+    atomic_ulong dropped;
+    atomic_int dead; // the owner exited, free the ring once it is drained
+    struct DiagRecord slots[DIAG_SLOTS];
+};
+
+int diag_level = DIAG_INFO;
+unsigned diag_sample;
+
+static struct DiagRing *rings;
+static pthread_mutex_t rings_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread struct DiagRing *myring;
+
+static pthread_t thread;
+static atomic_int started;
+static atomic_int stopping;
+static atomic_int parked;
+
+static const char *const level_names[] = {"error", "warn", "info", "debug", "trace"};
+static const int level_priority[] = {LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG, LOG_DEBUG};
+
+static long futex(atomic_int *addr, int op, int val, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static void emit(int level, const char *text, int len)
+{
+    fwrite(text, 1, len, stdout);
+    fputc('\n', stdout);
+    if (level <= DIAG_INFO)
+        syslog(level_priority[level], "%.*s", len, text);
+}
+
+// The owner exited, its ring is freed once the flusher has drained it
+static void retire(void *arg)
+{
+    struct DiagRing *ring = arg;
+    atomic_store(&ring->dead, 1);
+}
+
+static struct DiagRing *getring(void)
+{
+    if (myring)
+        return myring;
+
+    struct DiagRing *ring = calloc(1, sizeof(struct DiagRing));
+    if (ring == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&rings_mtx);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mtx);
+
+    pthread_setspecific(ring_key, ring);
+    myring = ring;
+    return ring;
+}
+
+static void unpark(void)
+{
+    if (atomic_load(&parked) && atomic_exchange(&parked, 0))
+        futex(&parked, FUTEX_WAKE_PRIVATE, 1, NULL);
+}
+
+static int drainring(struct DiagRing *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    int drained = 0;
+
+    for (; head != tail; head++, drained++)
+    {
+        const struct DiagRecord *rec = &ring->slots[head % DIAG_SLOTS];
+        emit(rec->level, rec->text, rec->len);
+    }
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+
+    unsigned long dropped = atomic_exchange(&ring->dropped, 0);
+    if (dropped)
+        printf("diaglog: dropped %lu messages\n", dropped);
+    return drained;
+}
+
+// Drain every ring once and free those whose owner is gone
+static int drainall(void)
+{
+    int drained = 0;
+
+    pthread_mutex_lock(&rings_mtx);
+    struct DiagRing **link = &rings;
+    while (*link)
+    {
+        struct DiagRing *ring = *link;
+        // Read dead first, whatever the owner logged before exiting is then visible
+        bool dead = atomic_load(&ring->dead);
+        drained += drainring(ring);
+        if (dead)
+        {
+            *link = ring->next;
+            free(ring);
+        }
+        else
+            link = &ring->next;
+    }
+    pthread_mutex_unlock(&rings_mtx);
+
+    if (drained)
+        fflush(stdout);
+    return drained;
+}
+
+static bool anypending(void)
+{
+    bool pending = false;
+    pthread_mutex_lock(&rings_mtx);
+    for (struct DiagRing *ring = rings; ring && !pending; ring = ring->next)
+        pending = atomic_load(&ring->head) != atomic_load(&ring->tail);
+    pthread_mutex_unlock(&rings_mtx);
+    return pending;
+}
+
+static void *flusher_thread(void *arg)
+{
+    const struct timespec nap = {.tv_sec = 0, .tv_nsec = DIAG_NAP_NS};
+
+    while (!atomic_load(&stopping))
+    {
+        if (drainall())
+        {
+            nanosleep(&nap, NULL);
+            continue;
+        }
+
+        // Nothing came in during the last nap, sleep until someone logs
+        atomic_store(&parked, 1);
+        if (!anypending() && !atomic_load(&stopping))
+            futex(&parked, FUTEX_WAIT_PRIVATE, 1, NULL);
+        atomic_store(&parked, 0);
+    }
+
+    drainall();
+    return NULL;
+}
+
+int diag_start(void)
+{
+    if (pthread_key_create(&ring_key, retire) != 0)
+    {
+        perror("pthread_key_create");
+        return ERROR;
+    }
+
+    // Signal handlers must not land on the flusher
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int err = pthread_create(&thread, NULL, flusher_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0)
+    {
+        errno = err;
+        perror("pthread_create");
+        pthread_key_delete(ring_key);
+        return ERROR;
+    }
+    atomic_store(&started, 1);
+    return 0;
+}
+
+void diag_sync(void)
+{
+    const struct timespec nap = {.tv_sec = 0, .tv_nsec = DIAG_NAP_NS / 50};
+    if (!atomic_load(&started))
+        return;
+    while (anypending())
+    {
+        unpark();
+        nanosleep(&nap, NULL);
+    }
+}
+
+void diag_stop(void)
+{
+    if (!atomic_exchange(&started, 0))
+        return;
+
+    atomic_store(&stopping, 1);
+    atomic_store(&parked, 0);
+    futex(&parked, FUTEX_WAKE_PRIVATE, 1, NULL);
+    pthread_join(thread, NULL);
+
+    // Every other logging thread is gone, what is left belongs to this one
+    while (rings)
+    {
+        struct DiagRing *next = rings->next;
+        free(rings);
+        rings = next;
+    }
+    myring = NULL;
+    pthread_setspecific(ring_key, NULL);
+    pthread_key_delete(ring_key);
+}
+
+int diag_parselevel(const char *name)
+{
+    for (int level = DIAG_ERROR; level <= DIAG_TRACE; level++)
+    {
+        if (strcmp(name, level_names[level]) == 0)
+            return level;
+    }
+    return ERROR;
+}
+
+void diag_log(int level, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+
+    struct DiagRing *ring = atomic_load_explicit(&started, memory_order_relaxed) ? getring() : NULL;
+    if (ring == NULL)
+    {
+        char text[DIAG_TEXT];
+        int len = vsnprintf(text, sizeof text, fmt, ap);
+        va_end(ap);
+        if (len >= 0)
+            emit(level, text, (len < (int)sizeof text) ? len : (int)sizeof text - 1);
+        return;
+    }
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == DIAG_SLOTS)
+    {
+        va_end(ap);
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct DiagRecord *rec = &ring->slots[tail % DIAG_SLOTS];
+    int len = vsnprintf(rec->text, sizeof rec->text, fmt, ap);
+    va_end(ap);
+    rec->level = level;
+    rec->len = (len < 0) ? 0 : (len < (int)sizeof rec->text) ? len : (int)sizeof rec->text - 1;
+    // Full barrier, so either the flusher sees this record or we see it parked
+    atomic_store(&ring->tail, tail + 1);
+    unpark();
+}
+
+void diag_payload(const char *what, const char *buf, size_t len)
+{
+    static __thread unsigned seen;
+    if (seen++ % diag_sample != 0)
+        return;
+
+    // Escape the shown bytes so the dump stays on one line
+    char shown[2 * DIAG_PAYLOAD_SHOWN + 1];
+    size_t out = 0;
+    for (size_t i = 0; i < len && i < DIAG_PAYLOAD_SHOWN; i++)
+    {
+        unsigned char c = buf[i];
+        if (c == '\n')
+        {
+            shown[out++] = '\\';
+            shown[out++] = 'n';
+        }
+        else
+            shown[out++] = (c >= ' ' && c < 0x7f) ? c : '.';
+    }
+    shown[out] = '\0';
+
+    diag_log(DIAG_DEBUG, "%s[%zu]: %s%s", what, len, shown, (len > DIAG_PAYLOAD_SHOWN) ? "..." : "");
+}
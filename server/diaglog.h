@@ -0,0 +1,90 @@
+/*
+ * diaglog.h
+ *
+ *  @brief Leveled diagnostic logging that stays off the aesdsocket hot path
+ */
+
+#ifndef DIAGLOG_H
+#define DIAGLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum DiagLevel
+{
+    DIAG_ERROR,
+    DIAG_WARN,
+    DIAG_INFO,  // connection lifecycle, also sent to syslog like everything above it
+    DIAG_DEBUG, // per packet and per reply events
+    DIAG_TRACE,
+};
+
+// Levels above this are compiled out entirely
+#ifndef DIAG_MAX_LEVEL
+#define DIAG_MAX_LEVEL DIAG_TRACE
+#endif
+
+// Most verbose level recorded, set once at startup
+extern int diag_level;
+// Dump one in every diag_sample received payloads, 0 dumps none
+extern unsigned diag_sample;
+
+/**
+ * Record a printf style message at level. A disabled level costs a single
+ * comparison and its arguments are never evaluated.
+ */
+#define DIAG(level, ...)                                              \
+    do                                                                \
+    {                                                                 \
+        if ((level) <= DIAG_MAX_LEVEL && (level) <= diag_level)       \
+            diag_log((level), __VA_ARGS__);                           \
+    } while (0)
+
+/**
+ * Record the start of a received payload when payload sampling is on and
+ * debug messages are enabled, the level it is recorded at
+ * @param what names the payload in the message
+ */
+#define DIAG_PAYLOAD(what, buf, len)                                  \
+    do                                                                \
+    {                                                                 \
+        if (DIAG_DEBUG <= DIAG_MAX_LEVEL && DIAG_DEBUG <= diag_level  \
+            && diag_sample)                                           \
+            diag_payload((what), (buf), (len));                       \
+    } while (0)
+
+/**
+ * Start the flusher thread. Until it runs, and after it stopped, messages
+ * are written out synchronously by the thread logging them.
+ * @return 0 on success, ERROR if the thread could not be started
+ */
+int diag_start(void);
+
+/**
+ * Wait until the flusher has written out everything recorded so far, so the
+ * next burst from this thread finds its ring empty instead of dropping
+ */
+void diag_sync(void);
+
+/**
+ * Write out everything recorded so far and stop the flusher thread. Must run
+ * after every other thread that logs has been joined.
+ */
+void diag_stop(void);
+
+/**
+ * Parse a level name (error, warn, info, debug, trace)
+ * @return the level, or ERROR for an unknown name
+ */
+int diag_parselevel(const char *name);
+
+/**
+ * Copy a message into the calling thread's ring. Only ever blocks the first
+ * time a thread logs, when its ring is registered. A full ring drops the
+ * message and counts it.
+ */
+void diag_log(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void diag_payload(const char *what, const char *buf, size_t len);
+
+#endif /* DIAGLOG_H */
@@ -0,0 +1,149 @@
+/**
+ * @file durable.c
+ * @brief When appends to the aesdsocket log are forced to disk
+ *
+ * Progress is tracked in log generations: a sync that starts once
+ * generation g is committed makes everything up to g durable. Only one sync
+ * runs at a time. Whoever needs a newer generation than the last sync
+ * covered starts the next one, everybody arriving meanwhile waits and is
+ * covered by it or the one after, so concurrent acks and the writer thread
+ * share syncs instead of queueing one each.
+ *
+ * A failed sync leaves the generations it was to cover not durable for
+ * good: after an fdatasync() error the kernel may have dropped the dirty
+ * pages, and a retry could succeed without writing them. Waiters for those
+ * generations fail instead of retrying.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "aesdsocket.h"
+#include "diaglog.h"
+#include "durable.h"
+#include "timer.h"
+
+static pthread_mutex_t sync_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_done = PTHREAD_COND_INITIALIZER;
+static bool syncing;         // guarded by sync_mtx, as is everything below
+static uint64_t synced_gen;  // newest generation known to be on disk
+static uint64_t failed_gen;  // newest generation a failed sync was to cover
+static unsigned long syncs;
+static unsigned long waits;  // durable_wait() calls that had to wait for a sync
+
+static enum Durability policy = DURABLE_NONE;
+
+int durable_parse(const char *arg, unsigned *interval_ms)
+{
+    if (strcmp(arg, "none") == 0)
+        return DURABLE_NONE;
+    if (strcmp(arg, "ack") == 0)
+        return DURABLE_ACK;
+    if (strncmp(arg, "interval", 8) != 0)
+        return ERROR;
+    if (arg[8] == '\0')
+        return DURABLE_INTERVAL;
+    if (arg[8] != ':')
+        return ERROR;
+
+    char *end;
+    unsigned long ms = strtoul(arg + 9, &end, 0);
+    if (ms == 0 || *end != '\0')
+        return ERROR;
+    *interval_ms = ms;
+    return DURABLE_INTERVAL;
+}
+
+bool durable_wait(uint64_t gen)
+{
+    bool ok = true;
+    pthread_mutex_lock(&sync_mtx);
+    if (synced_gen < gen)
+        waits++;
+    while (synced_gen < gen)
+    {
+        if (gen <= failed_gen)
+        {
+            ok = false;
+            break;
+        }
+        if (syncing)
+        {
+            pthread_cond_wait(&sync_done, &sync_mtx);
+            continue;
+        }
+
+        // Everything committed up to here is in the page cache, the sync covers it
+        syncing = true;
+        uint64_t target = loggeneration();
+        pthread_mutex_unlock(&sync_mtx);
+        int rc = logsync();
+        int err = errno;
+        pthread_mutex_lock(&sync_mtx);
+        syncing = false;
+        syncs++;
+        if (rc == ERROR)
+        {
+            errno = err;
+            perror("fdatasync");
+            if (target > failed_gen)
+                failed_gen = target;
+        }
+        else if (target > synced_gen)
+            synced_gen = target;
+        pthread_cond_broadcast(&sync_done);
+    }
+    pthread_mutex_unlock(&sync_mtx);
+    return ok;
+}
+
+void durable_synced(uint64_t gen)
+{
+    pthread_mutex_lock(&sync_mtx);
+    syncs++;
+    waits++;
+    if (gen > synced_gen)
+        synced_gen = gen;
+    pthread_cond_broadcast(&sync_done);
+    pthread_mutex_unlock(&sync_mtx);
+}
+
+void durable_failed(uint64_t gen)
+{
+    pthread_mutex_lock(&sync_mtx);
+    syncs++;
+    waits++;
+    if (gen > failed_gen)
+        failed_gen = gen;
+    pthread_cond_broadcast(&sync_done);
+    pthread_mutex_unlock(&sync_mtx);
+}
+
+// Timer job of the interval policy
+static void interval_sync(void *arg)
+{
+    durable_wait(loggeneration());
+}
+
+int durable_start(enum Durability mode, unsigned interval_ms)
+{
+    policy = mode;
+    if (policy == DURABLE_INTERVAL && timer_add(interval_ms, interval_sync, NULL) == ERROR)
+        return ERROR;
+    return 0;
+}
+
+void durable_stop(void)
+{
+    if (policy != DURABLE_NONE)
+        DIAG(DIAG_INFO, "durable: %lu syncs for %lu waits over %llu log writes", syncs, waits,
+             (unsigned long long)loggeneration());
+    policy = DURABLE_NONE;
+}
+
+bool durable_acks(void)
+{
+    return policy == DURABLE_ACK;
+}
@@ -0,0 +1,64 @@
+/*
+ * durable.h
+ *
+ *  @brief When appends to the aesdsocket log are forced to disk
+ */
+
+#ifndef DURABLE_H
+#define DURABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum Durability
+{
+    DURABLE_NONE,     // the log is synced at shutdown only
+    DURABLE_INTERVAL, // a timer job syncs whatever was appended every interval
+    DURABLE_ACK,      // a reply goes out only once the appends it answers are synced
+};
+
+/**
+ * Parse a -D argument: none, interval[:ms] or ack
+ * @param interval_ms is set to the interval, left alone when none is given
+ * @return the policy, or ERROR when arg names none
+ */
+int durable_parse(const char *arg, unsigned *interval_ms);
+
+/**
+ * Apply policy, adding the timer job of DURABLE_INTERVAL
+ * @return 0 on success, ERROR if the job could not be added
+ */
+int durable_start(enum Durability policy, unsigned interval_ms);
+
+/**
+ * Log how much the syncs were shared, called once the timer is stopped
+ */
+void durable_stop(void);
+
+/**
+ * @return true when replies have to wait for durable_wait()
+ */
+bool durable_acks(void);
+
+/**
+ * Block until the log is synced up to log generation gen. Callers that
+ * arrive while a sync is running wait for it and share the next one, so a
+ * single fdatasync() covers every append in flight when it starts.
+ * @return false when a sync meant to cover gen failed: the appends up to it
+ *  may never reach the disk and must not be acknowledged
+ */
+bool durable_wait(uint64_t gen);
+
+/**
+ * Record a sync issued elsewhere, an io_uring fdatasync, that covers the
+ * log up to generation gen
+ */
+void durable_synced(uint64_t gen);
+
+/**
+ * Record a sync issued elsewhere that failed, durable_wait() then fails
+ * for generations up to gen
+ */
+void durable_failed(uint64_t gen);
+
+#endif /* DURABLE_H */
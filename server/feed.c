@@ -0,0 +1,79 @@
+/**
+ * @file feed.c
+ * @brief Wakeups for connections subscribed to the aesdsocket log
+ *
+ * Subscribers are not sent anything from here. Each event loop, or each
+ * subscribed connection thread, owns one eventfd that an append signals; it
+ * then pushes the new log range to all of its subscribers straight from the
+ * log, so every subscriber shares the page cache copy of the new data.
+ */
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include "aesdsocket.h"
+#include "feed.h"
+
+// Most eventfds registered at once: every event loop plus every subscribed connection thread
+#define FEED_WAKERS 1024
+
+struct FeedWaker
+{
+    atomic_int fd;    // the eventfd plus one, 0 while the slot is free
+    atomic_int armed;
+    atomic_int busy;  // publishers currently looking at the slot
+};
+
+static struct FeedWaker wakers[FEED_WAKERS];
+static atomic_int nslots; // slots ever used, publishers look no further
+
+int feed_addwaker(int eventfd)
+{
+    for (int slot = 0; slot < FEED_WAKERS; slot++)
+    {
+        int expect = 0;
+        if (atomic_compare_exchange_strong(&wakers[slot].fd, &expect, eventfd + 1))
+        {
+            int seen = atomic_load(&nslots);
+            while (seen <= slot && !atomic_compare_exchange_weak(&nslots, &seen, slot + 1))
+                ;
+            return slot;
+        }
+    }
+    return ERROR;
+}
+
+void feed_delwaker(int slot)
+{
+    if (slot < 0)
+        return;
+
+    atomic_store(&wakers[slot].armed, 0);
+    atomic_store(&wakers[slot].fd, 0);
+    // A publisher that picked the descriptor up before it was cleared still writes to it
+    while (atomic_load(&wakers[slot].busy))
+        sched_yield();
+}
+
+void feed_arm(int slot)
+{
+    if (slot >= 0)
+        atomic_store(&wakers[slot].armed, 1);
+}
+
+void feed_publish(void)
+{
+    int used = atomic_load(&nslots);
+    for (int slot = 0; slot < used; slot++)
+    {
+        struct FeedWaker *w = &wakers[slot];
+        if (!atomic_load(&w->armed))
+            continue;
+
+        atomic_fetch_add(&w->busy, 1);
+        int fd = atomic_load(&w->fd);
+        if (fd && atomic_exchange(&w->armed, 0))
+            eventfd_write(fd - 1, 1);
+        atomic_fetch_sub(&w->busy, 1);
+    }
+}
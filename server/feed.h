@@ -0,0 +1,38 @@
+/*
+ * feed.h
+ *
+ *  @brief Wakeups for connections subscribed to the aesdsocket log
+ */
+
+#ifndef FEED_H
+#define FEED_H
+
+// A packet of this prefix followed by a log offset turns the connection into a subscriber
+#define FEED_SUBSCRIBE_CMD "AESDSOCKET_SUBSCRIBE:"
+
+/**
+ * Register an eventfd to be signalled after the next append to the log once
+ * it is armed. Whoever serves subscribers holds one.
+ * @return a slot for feed_arm() and feed_delwaker(), or ERROR when all are taken
+ */
+int feed_addwaker(int eventfd);
+
+/**
+ * Unregister slot. Once this returns the eventfd is not touched any more and may be closed.
+ */
+void feed_delwaker(int slot);
+
+/**
+ * Have the eventfd of slot signalled after the next append. Arm before
+ * looking at the log size, so an append that lands after the look is never missed.
+ */
+void feed_arm(int slot);
+
+/**
+ * Signal every armed eventfd, called for each append that reached the log.
+ * Takes no lock, only atomics on the slots and eventfd_write(), so appends
+ * from any thread can call it without waiting on a subscriber's loop.
+ */
+void feed_publish(void);
+
+#endif /* FEED_H */
@@ -0,0 +1,129 @@
+/**
+ * @file filestore.c
+ * @brief The aesdsocket log as a regular file, or as segment files with -S
+ *
+ * A single file is opened O_APPEND so every write lands at the end however
+ * replies move the file offset. Segments are handled by seglog.c. Either
+ * way the packet index stands in for the driver's seek ioctl and keeps a
+ * sidecar next to the log.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "aesdsocket.h"
+#include "logindex.h"
+#include "seglog.h"
+#include "store.h"
+
+static int logfd = ERROR;
+
+static int file_open(const struct StoreConfig *cfg)
+{
+    system("mkdir -p /var/tmp/");
+    if (cfg->seg_bytes)
+    {
+        if (seglog_open(STORE_SEGMENT_DIR, cfg->seg_bytes, cfg->seg_secs, cfg->keep_bytes, cfg->keep_packets) ==
+            ERROR)
+            return ERROR;
+        logindex_open(STORE_SEGMENT_DIR "/index");
+        return 0;
+    }
+
+    logfd = open(STORE_FILE_PATH, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (logfd < 0)
+    {
+        perror("failed to open file!");
+        return ERROR;
+    }
+    logindex_open(STORE_FILE_PATH ".idx");
+    return 0;
+}
+
+static void file_close(void)
+{
+    logindex_close();
+    if (seglog_enabled())
+        seglog_close();
+    else if (logfd != ERROR)
+    {
+        fsync(logfd);
+        close(logfd);
+        logfd = ERROR;
+    }
+}
+
+static ssize_t file_append(const struct iovec *iov, int iovcnt)
+{
+    return seglog_enabled() ? seglog_append(iov, iovcnt) : writev(logfd, iov, iovcnt);
+}
+
+static off_t file_start(void)
+{
+    return seglog_enabled() ? seglog_start() : 0;
+}
+
+static off_t file_size(void)
+{
+    if (seglog_enabled())
+        return seglog_end();
+
+    struct stat st;
+    return (fstat(logfd, &st) == ERROR) ? 0 : st.st_size;
+}
+
+static int file_pin(off_t off, off_t *local, off_t *left, struct Segment **seg)
+{
+    if (!seglog_enabled())
+    {
+        *seg = NULL;
+        *local = off;
+        *left = LLONG_MAX;
+        return logfd;
+    }
+
+    int fd;
+    *seg = seglog_pin(off, &fd, local, left);
+    return *seg ? fd : ERROR;
+}
+
+static ssize_t file_read(void *buf, size_t len, off_t off)
+{
+    off_t local, left;
+    struct Segment *seg;
+    int fd = file_pin(off, &local, &left, &seg);
+    if (fd == ERROR)
+        return 0;
+    ssize_t got = pread(fd, buf, ((off_t)len < left) ? (off_t)len : left, local);
+    seglog_unpin(seg);
+    return got;
+}
+
+static int file_sync(void)
+{
+    return seglog_enabled() ? seglog_sync() : fdatasync(logfd);
+}
+
+static int file_appendfd(void)
+{
+    // A roll changes the file appends go to, they have to go through seglog_append()
+    return seglog_enabled() ? ERROR : logfd;
+}
+
+const struct Store file_store = {
+    .name = "file",
+    .open = file_open,
+    .close = file_close,
+    .append = file_append,
+    .start = file_start,
+    .size = file_size,
+    .read = file_read,
+    .pin = file_pin,
+    .unpin = seglog_unpin,
+    .seek = logindex_seek,
+    .sync = file_sync,
+    .appendfd = file_appendfd,
+};
@@ -0,0 +1,110 @@
+/**
+ * @file listen.c
+ * @brief The sockets aesdsocket accepts connections on
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "aesdsocket.h"
+
+#define PORT "9000" // Port to listen on
+
+int openlistener(int backlog, bool reuseport)
+{
+    struct addrinfo hints, *res;
+
+    // Prepare hints
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;     // IPv4 or IPv6
+    hints.ai_socktype = SOCK_STREAM; // TCP
+    hints.ai_flags = AI_PASSIVE;     // Use my IP
+
+    if (getaddrinfo(NULL, PORT, &hints, &res) != 0)
+    {
+        perror("getaddrinfo");
+        return ERROR;
+    }
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd == ERROR)
+    {
+        perror("socket");
+        freeaddrinfo(res);
+        return ERROR;
+    }
+
+    int on = 1;
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) == ERROR)
+    {
+        perror("setsockopt");
+        freeaddrinfo(res);
+        close(fd);
+        return ERROR;
+    }
+
+    if (bind(fd, res->ai_addr, res->ai_addrlen) == ERROR)
+    {
+        perror("bind");
+        freeaddrinfo(res);
+        close(fd);
+        return ERROR;
+    }
+
+    freeaddrinfo(res);
+
+    if (listen(fd, backlog) == ERROR)
+    {
+        perror("listen");
+        close(fd);
+        return ERROR;
+    }
+    return fd;
+}
+
+int openlocal(const char *path, int backlog)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof addr.sun_path)
+    {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return ERROR;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == ERROR)
+    {
+        perror("socket");
+        return ERROR;
+    }
+    // A socket file left behind by an earlier run would fail the bind
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof addr) == ERROR || listen(fd, backlog) == ERROR)
+    {
+        perror(path);
+        close(fd);
+        return ERROR;
+    }
+    return fd;
+}
+
+void peername(const struct sockaddr_storage *addr, char *name, size_t len)
+{
+    const void *ip = NULL;
+    if (addr->ss_family == AF_INET)
+        ip = &((const struct sockaddr_in *)addr)->sin_addr;
+    else if (addr->ss_family == AF_INET6)
+        ip = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+    else if (addr->ss_family == AF_UNIX)
+    {
+        snprintf(name, len, "local");
+        return;
+    }
+    if (ip == NULL || inet_ntop(addr->ss_family, ip, name, len) == NULL)
+        snprintf(name, len, "?");
+}
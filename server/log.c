@@ -0,0 +1,138 @@
+/**
+ * @file log.c
+ * @brief The aesdsocket log as every server model reaches it
+ *
+ * One storage backend, picked at startup, holds the log. Appends from all
+ * connections and from the writer thread are serialized by log_mtx here,
+ * and every append committed advances the log generation that snapshots,
+ * subscribers and the durability policy key on.
+ */
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "aesdsocket.h"
+#include "feed.h"
+#include "store.h"
+#include "stats.h"
+#include "trace.h"
+
+pthread_mutex_t log_mtx;
+static const struct Store *store;
+static atomic_uint_fast64_t log_generation;
+
+int logopen(const struct Store *backend, const struct StoreConfig *cfg)
+{
+    if (pthread_mutex_init(&log_mtx, NULL) != 0)
+    {
+        perror("mutex");
+        return ERROR;
+    }
+    // Opening may read back what the log already holds, through the helpers below
+    store = backend;
+    if (store->open(cfg) == ERROR)
+    {
+        store = NULL;
+        pthread_mutex_destroy(&log_mtx);
+        return ERROR;
+    }
+    return 0;
+}
+
+void logclose(void)
+{
+    store->close();
+    store = NULL;
+    pthread_mutex_destroy(&log_mtx);
+}
+
+bool logentries(void)
+{
+    return store->entry_per_write;
+}
+
+size_t writelog(const char *buf, size_t len)
+{
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+    return writelogv(&iov, 1);
+}
+
+ssize_t writelogv(const struct iovec *iov, int iovcnt)
+{
+    uint64_t asked = stat_now();
+    pthread_mutex_lock(&log_mtx);
+    uint64_t locked = stat_now();
+    ssize_t len = store->append(iov, iovcnt);
+    logcommitted();
+    pthread_mutex_unlock(&log_mtx);
+    uint64_t done = stat_now();
+    stat_time(STAT_LOCKWAIT, locked - asked);
+    stat_time(STAT_APPEND, done - locked);
+    trace_span(trace_current, TRACE_LOCKWAIT, asked, locked);
+    trace_span(trace_current, TRACE_APPEND, locked, done);
+    return len;
+}
+
+void logcommitted(void)
+{
+    atomic_fetch_add(&log_generation, 1);
+    feed_publish();
+}
+
+uint64_t loggeneration(void)
+{
+    return atomic_load(&log_generation);
+}
+
+int logsync(void)
+{
+    return store->sync();
+}
+
+int logappendfd(void)
+{
+    return store->appendfd();
+}
+
+off_t seekstart(const struct aesd_seekto *seekto)
+{
+    off_t start = 0;
+    if (seekto->write_cmd || seekto->write_cmd_offset)
+    {
+        uint64_t asked = stat_now();
+        start = store->seek(seekto);
+        uint64_t done = stat_now();
+        stat_time(STAT_SEEK, done - asked);
+        trace_span(trace_current, TRACE_SEEK, asked, done);
+    }
+    return (start < 0) ? 0 : start;
+}
+
+off_t logstart(void)
+{
+    return store->start();
+}
+
+off_t logsize(void)
+{
+    return store->size();
+}
+
+ssize_t logread(void *buf, size_t len, off_t off)
+{
+    return store->read(buf, len, off);
+}
+
+int logpin(off_t off, off_t *local, off_t *left, struct Segment **seg)
+{
+    *seg = NULL;
+    if (store->pin == NULL)
+        return ERROR;
+    return store->pin(off, local, left, seg);
+}
+
+void logunpin(struct Segment *seg)
+{
+    if (store->unpin)
+        store->unpin(seg);
+}
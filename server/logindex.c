@@ -0,0 +1,409 @@
+/**
+ * @file logindex.c
+ * @brief Packet offsets of the file backed aesdsocket log
+ *
+ * The index holds the offset just past the newline of every complete packet
+ * in the log, so finding packet n is an array lookup. It is brought up to
+ * date lazily: a lookup first scans whatever was appended since the last
+ * one, no matter which thread, writer or ring wrote it. New entries go to a
+ * sidecar file as 64 bit little endian offsets, behind a header recording
+ * how much of the log they were taken from and a checksum of the bytes
+ * ending the last of them. On start the sidecar is loaded and checked
+ * against the log, and only the log past its last entry is scanned; one
+ * that belongs to another log, or a log since truncated or rewritten, is
+ * dropped and the index rebuilt.
+ *
+ * Packets count from the oldest one retention kept. Entries of dropped
+ * segments stay until enough of them piled up, then the array and the
+ * sidecar are rewritten without them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "aesdsocket.h"
+#include "aesd-delim.h"
+#include "diaglog.h"
+#include "logindex.h"
+
+// Log bytes read per scan step, also the most sidecar entries written at once
+#define INDEX_BLOCK (64 * 1024)
+// Packet ends looked up per delimiter scan
+#define INDEX_BATCH 64
+// Dropped entries that are kept around before the index is compacted
+#define INDEX_COMPACT 4096
+// Log bytes ending the last entry that the sidecar checksum covers
+#define INDEX_TAIL 64
+#define INDEX_MAGIC 0x3178646964736561ull // "aesdidx1"
+
+// Leads the sidecar, every field little endian
+struct IndexHeader
+{
+    uint64_t magic;
+    uint64_t size;  // log bytes scanned for the entries
+    uint64_t count; // entries following the header
+    uint64_t tail;  // checksum of the INDEX_TAIL log bytes ending the last entry
+};
+
+static pthread_mutex_t index_mtx = PTHREAD_MUTEX_INITIALIZER;
+static bool ready;
+static int sidefd = ERROR;
+static char sidepath[PATH_MAX];
+static off_t *ends;      // ends[i] is the offset just past packet i
+static size_t nends;
+static size_t capends;
+static size_t persisted; // entries already in the sidecar
+static off_t scanned;    // log bytes looked at so far
+static off_t described;  // scanned as the sidecar header has it
+static char block[INDEX_BLOCK]; // guarded by index_mtx
+
+static bool addend(off_t end)
+{
+    if (nends == capends)
+    {
+        size_t grown_cap = capends ? 2 * capends : INDEX_BLOCK / sizeof *ends;
+        off_t *grown = realloc(ends, grown_cap * sizeof *grown);
+        if (grown == NULL)
+        {
+            perror("realloc");
+            return false;
+        }
+        ends = grown;
+        capends = grown_cap;
+    }
+    ends[nends++] = end;
+    return true;
+}
+
+static void reset(void)
+{
+    nends = 0;
+    persisted = 0;
+    scanned = 0;
+    described = ERROR;
+    if (sidefd != ERROR && ftruncate(sidefd, 0) == ERROR)
+        perror("ftruncate");
+}
+
+/**
+ * FNV-1a over the log bytes ending at log offset end, up to INDEX_TAIL of them
+ * @return false when they can not all be read, retention dropped some
+ */
+static bool tailsum(off_t end, uint64_t *sum)
+{
+    char tail[INDEX_TAIL];
+    off_t from = (end > INDEX_TAIL) ? end - INDEX_TAIL : 0;
+    size_t len = end - from;
+    for (size_t got = 0; got < len;)
+    {
+        ssize_t n = logread(tail + got, len - got, from + got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        got += n;
+    }
+
+    *sum = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++)
+        *sum = (*sum ^ (unsigned char)tail[i]) * 0x100000001b3ull;
+    return true;
+}
+
+// Stop feeding a sidecar that could not be written, the next start drops it
+static void sidefail(const char *what)
+{
+    perror(what);
+    close(sidefd);
+    sidefd = ERROR;
+}
+
+// Write the entries found since the last call to the sidecar, then the header describing them
+static void persist(void)
+{
+    uint64_t *le = (uint64_t *)block;
+    while (sidefd != ERROR && persisted < nends)
+    {
+        size_t n = nends - persisted;
+        if (n > INDEX_BLOCK / sizeof *le)
+            n = INDEX_BLOCK / sizeof *le;
+        for (size_t i = 0; i < n; i++)
+            le[i] = htole64(ends[persisted + i]);
+        off_t at = sizeof(struct IndexHeader) + persisted * sizeof *le;
+        if (pwrite(sidefd, le, n * sizeof *le, at) != (ssize_t)(n * sizeof *le))
+        {
+            sidefail("write index");
+            return;
+        }
+        persisted += n;
+    }
+    if (sidefd == ERROR || described == scanned)
+        return;
+
+    struct IndexHeader head = {
+        .magic = htole64(INDEX_MAGIC),
+        .size = htole64(scanned),
+        .count = htole64(nends),
+    };
+    uint64_t sum = 0;
+    if (nends && !tailsum(ends[nends - 1], &sum))
+        return;
+    head.tail = htole64(sum);
+    // Written after the entries, a crash in between leaves entries the header does not count
+    if (pwrite(sidefd, &head, sizeof head, 0) != sizeof head)
+    {
+        sidefail("write index");
+        return;
+    }
+    described = scanned;
+}
+
+// The first entry of a packet that ends after log offset lo
+static size_t firstkept(off_t lo)
+{
+    size_t first = 0, hi = nends;
+    while (first < hi)
+    {
+        size_t mid = first + (hi - first) / 2;
+        if (ends[mid] <= lo)
+            first = mid + 1;
+        else
+            hi = mid;
+    }
+    return first;
+}
+
+// Forget the entries of packets retention dropped, rewriting the sidecar without them
+static void compact(size_t dropped)
+{
+    memmove(ends, ends + dropped, (nends - dropped) * sizeof *ends);
+    nends -= dropped;
+    if (sidefd == ERROR)
+    {
+        persisted = 0;
+        return;
+    }
+
+    // Write the new sidecar aside and rename it over, a crash leaves one or the other
+    char tmppath[PATH_MAX + 4];
+    snprintf(tmppath, sizeof tmppath, "%s.tmp", sidepath);
+    int oldfd = sidefd;
+    sidefd = open(tmppath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (sidefd == ERROR)
+        perror("failed to open index!");
+    persisted = 0;
+    described = ERROR;
+    persist();
+    if (sidefd != ERROR && rename(tmppath, sidepath) == ERROR)
+    {
+        perror("rename index");
+        close(sidefd);
+        sidefd = ERROR;
+    }
+    if (sidefd == ERROR)
+        unlink(tmppath);
+    close(oldfd);
+    DIAG(DIAG_DEBUG, "log index: compacted, %zu packets kept", nends);
+}
+
+// Index what was appended to the log since the last call
+static void catchup(void)
+{
+    off_t size = logsize();
+    // The log was truncated or replaced underneath
+    if (size < scanned)
+        reset();
+    // Bytes retention dropped before they were looked at are skipped
+    off_t lo = logstart();
+    if (scanned < lo)
+        scanned = lo;
+
+    while (scanned < size)
+    {
+        off_t left = size - scanned;
+        ssize_t got = logread(block, (left < INDEX_BLOCK) ? left : INDEX_BLOCK, scanned);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+
+        size_t newlines[INDEX_BATCH];
+        size_t base = 0;
+        size_t found;
+        do
+        {
+            found = aesd_delim_scan(block + base, got - base, '\n', newlines, INDEX_BATCH);
+            for (size_t i = 0; i < found; i++)
+            {
+                if (!addend(scanned + base + newlines[i] + 1))
+                    return;
+            }
+            if (found)
+                base += newlines[found - 1] + 1;
+        } while (found == INDEX_BATCH);
+        scanned += got;
+    }
+    persist();
+
+    size_t dropped = firstkept(lo);
+    if (dropped >= INDEX_COMPACT && dropped >= nends / 2)
+        compact(dropped);
+}
+
+// Take over the sidecar if it matches the log, the scan then resumes after its last entry
+static void load(void)
+{
+    struct stat side;
+    if (fstat(sidefd, &side) == ERROR)
+        return;
+    // A new sidecar, there is nothing to check
+    if (side.st_size == 0)
+        return;
+    off_t size = logsize();
+
+    // The log only ever grows, one shorter than the sidecar describes was truncated or replaced
+    struct IndexHeader head;
+    if (pread(sidefd, &head, sizeof head, 0) != sizeof head || le64toh(head.magic) != INDEX_MAGIC ||
+        (off_t)le64toh(head.size) > size)
+        goto mismatch;
+    off_t described_size = le64toh(head.size);
+    size_t n = le64toh(head.count);
+    if (n > (side.st_size - sizeof head) / sizeof(uint64_t))
+        goto mismatch;
+
+    uint64_t *le = (uint64_t *)block;
+    off_t prev = 0;
+    for (size_t done = 0; done < n;)
+    {
+        size_t want = n - done;
+        if (want > INDEX_BLOCK / sizeof *le)
+            want = INDEX_BLOCK / sizeof *le;
+        ssize_t got = pread(sidefd, le, want * sizeof *le, sizeof head + done * sizeof *le);
+        if (got < (ssize_t)(want * sizeof *le))
+            goto mismatch;
+        for (size_t i = 0; i < want; i++)
+        {
+            off_t end = le64toh(le[i]);
+            if (end <= prev || end > described_size || !addend(end))
+                goto mismatch;
+            prev = end;
+        }
+        done += want;
+    }
+
+    // The bytes ending the last entry must be the ones it was taken from,
+    // which catches a log rewritten to the same size or longer
+    uint64_t sum = 0;
+    if (nends && (!tailsum(ends[nends - 1], &sum) || sum != le64toh(head.tail)))
+        goto mismatch;
+
+    // Drop entries written after the header last was
+    off_t keep = sizeof head + n * sizeof(uint64_t);
+    if (side.st_size != keep && ftruncate(sidefd, keep) == ERROR)
+        perror("ftruncate");
+    persisted = nends;
+    scanned = nends ? ends[nends - 1] : 0;
+    return;
+
+mismatch:
+    DIAG(DIAG_WARN, "log index: sidecar does not match the log, rebuilding it");
+    reset();
+}
+
+int logindex_open(const char *path)
+{
+    pthread_mutex_lock(&index_mtx);
+    ready = true;
+    described = ERROR;
+    if (path)
+    {
+        snprintf(sidepath, sizeof sidepath, "%s", path);
+        sidefd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (sidefd == ERROR)
+            perror("failed to open index!");
+        else
+            load();
+    }
+
+    size_t loaded = nends;
+    catchup();
+    DIAG(DIAG_INFO, "log index: %zu packets, %zu of them from the sidecar", nends, loaded);
+    pthread_mutex_unlock(&index_mtx);
+    return (path && sidefd == ERROR) ? ERROR : 0;
+}
+
+void logindex_close(void)
+{
+    pthread_mutex_lock(&index_mtx);
+    if (sidefd != ERROR)
+    {
+        fsync(sidefd);
+        close(sidefd);
+    }
+    sidefd = ERROR;
+    ready = false;
+    free(ends);
+    ends = NULL;
+    nends = capends = persisted = 0;
+    scanned = 0;
+    pthread_mutex_unlock(&index_mtx);
+}
+
+off_t logindex_seek(const struct aesd_seekto *seekto)
+{
+    off_t pos = ERROR;
+
+    pthread_mutex_lock(&index_mtx);
+    if (ready)
+    {
+        catchup();
+        off_t lo = logstart();
+        size_t idx = firstkept(lo) + seekto->write_cmd;
+        if (idx < nends)
+        {
+            off_t start = idx ? ends[idx - 1] : 0;
+            if (start < lo)
+                start = lo;
+            if (start + seekto->write_cmd_offset < ends[idx])
+                pos = start + seekto->write_cmd_offset;
+        }
+    }
+    pthread_mutex_unlock(&index_mtx);
+    return pos;
+}
+
+bool logindex_packets(off_t size, off_t first, off_t count, off_t *start, off_t *end)
+{
+    pthread_mutex_lock(&index_mtx);
+    if (!ready)
+    {
+        pthread_mutex_unlock(&index_mtx);
+        return false;
+    }
+    catchup();
+
+    // Only packets that end within size are counted, the index may run further
+    off_t lo = logstart();
+    size_t kept = firstkept(lo);
+    const off_t *pkt = ends + kept;
+    off_t n = firstkept(size) - kept;
+
+    if (first == 0)
+        *start = lo;
+    else
+        *start = (first <= n) ? pkt[first - 1] : size;
+    if (count == 0)
+        *end = *start;
+    else
+        *end = (count <= n - first) ? pkt[first + count - 1] : size;
+    pthread_mutex_unlock(&index_mtx);
+    return true;
+}
@@ -0,0 +1,45 @@
+/*
+ * logindex.h
+ *
+ *  @brief Packet offsets of the file backed aesdsocket log
+ */
+
+#ifndef LOGINDEX_H
+#define LOGINDEX_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "aesd_ioctl.h"
+
+/**
+ * Load the index of the log from the sidecar file at path, dropping it when
+ * it does not match the log, and index whatever the log holds beyond it.
+ * Entries found later are appended to the sidecar, a NULL path keeps the
+ * index in memory only. The log is read through logread(), so it has to be
+ * open already.
+ * @return 0 on success, ERROR if the sidecar can not be opened; the index
+ *  then lives in memory only
+ */
+int logindex_open(const char *path);
+
+/**
+ * Drop the in-memory index and close the sidecar
+ */
+void logindex_close(void);
+
+/**
+ * Resolve an AESDCHAR_IOCSEEKTO request the way the char driver does:
+ * write_cmd counts complete packets from the oldest one kept and
+ * write_cmd_offset must lie inside that packet
+ * @return the log offset, or ERROR when no such packet or offset exists
+ */
+off_t logindex_seek(const struct aesd_seekto *seekto);
+
+/**
+ * Find where packets first to first + count - 1, counted from the oldest
+ * packet kept, lie in the log up to offset size
+ * @return false when there is no index, the caller then scans the log
+ */
+bool logindex_packets(off_t size, off_t first, off_t count, off_t *start, off_t *end);
+
+#endif /* LOGINDEX_H */
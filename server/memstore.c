@@ -0,0 +1,144 @@
+/**
+ * @file memstore.c
+ * @brief The aesdsocket log in a fixed size in-memory ring
+ *
+ * Appends overwrite the oldest bytes once the ring is full, so the log
+ * keeps its newest capacity bytes and start() moves up behind them. Offsets
+ * stay absolute, byte off lives at ring[off % capacity]. Nothing survives a
+ * restart. The packet index, kept in memory only, resolves seeks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "aesdsocket.h"
+#include "logindex.h"
+#include "store.h"
+
+// Ring size when none is given with -b memory:bytes
+#define MEM_DEFAULT_CAPACITY (1024 * 1024)
+
+static pthread_mutex_t ring_mtx = PTHREAD_MUTEX_INITIALIZER;
+static char *ring;
+static size_t capacity;
+static off_t ring_start; // guarded by ring_mtx, as is ring_end
+static off_t ring_end;
+
+static int mem_open(const struct StoreConfig *cfg)
+{
+    capacity = MEM_DEFAULT_CAPACITY;
+    if (cfg->arg)
+    {
+        char *end;
+        capacity = strtoull(cfg->arg, &end, 0);
+        if (capacity == 0 || *end != '\0')
+        {
+            fprintf(stderr, "memory: bad ring size %s\n", cfg->arg);
+            return ERROR;
+        }
+    }
+
+    ring = malloc(capacity);
+    if (ring == NULL)
+    {
+        perror("malloc");
+        return ERROR;
+    }
+    ring_start = ring_end = 0;
+    logindex_open(NULL);
+    return 0;
+}
+
+static void mem_close(void)
+{
+    logindex_close();
+    free(ring);
+    ring = NULL;
+}
+
+// Copy len bytes at log offset off into or out of the ring, with ring_mtx held
+static void ringcopy(char *buf, size_t len, off_t off, bool in)
+{
+    while (len)
+    {
+        size_t at = off % capacity;
+        size_t part = (len < capacity - at) ? len : capacity - at;
+        if (in)
+            memcpy(ring + at, buf, part);
+        else
+            memcpy(buf, ring + at, part);
+        buf += part;
+        off += part;
+        len -= part;
+    }
+}
+
+static ssize_t mem_append(const struct iovec *iov, int iovcnt)
+{
+    ssize_t total = 0;
+    pthread_mutex_lock(&ring_mtx);
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const char *buf = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        // Only the tail of an append larger than the ring survives it
+        size_t skip = (len > capacity) ? len - capacity : 0;
+        ringcopy((char *)buf + skip, len - skip, ring_end + skip, true);
+        ring_end += len;
+        total += len;
+    }
+    if (ring_end - ring_start > (off_t)capacity)
+        ring_start = ring_end - capacity;
+    pthread_mutex_unlock(&ring_mtx);
+    return total;
+}
+
+static off_t mem_start(void)
+{
+    pthread_mutex_lock(&ring_mtx);
+    off_t start = ring_start;
+    pthread_mutex_unlock(&ring_mtx);
+    return start;
+}
+
+static off_t mem_size(void)
+{
+    pthread_mutex_lock(&ring_mtx);
+    off_t end = ring_end;
+    pthread_mutex_unlock(&ring_mtx);
+    return end;
+}
+
+static ssize_t mem_read(void *buf, size_t len, off_t off)
+{
+    pthread_mutex_lock(&ring_mtx);
+    ssize_t got = 0;
+    if (off >= ring_start && off < ring_end)
+    {
+        got = ((off_t)len < ring_end - off) ? (off_t)len : ring_end - off;
+        ringcopy(buf, got, off, false);
+    }
+    pthread_mutex_unlock(&ring_mtx);
+    return got;
+}
+
+static int mem_appendfd(void)
+{
+    return ERROR;
+}
+
+const struct Store memory_store = {
+    .name = "memory",
+    .open = mem_open,
+    .close = mem_close,
+    .append = mem_append,
+    .start = mem_start,
+    .size = mem_size,
+    .read = mem_read,
+    .pin = NULL,
+    .unpin = NULL,
+    .seek = logindex_seek,
+    .sync = NULL,
+    .appendfd = mem_appendfd,
+};
@@ -0,0 +1,575 @@
+/**
+ * @file packet.c
+ * @brief Splitting what aesdsocket connections send into packets for the log
+ *
+ * Each connection keeps the bytes after its last complete packet in a
+ * PacketBuf; completed packets are either commands, answered from the log,
+ * or data staged whole in the connection's LogBatch so that packets of
+ * different connections never interleave in the log.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <endian.h>
+#include <stddef.h>
+#include "aesdsocket.h"
+#include "admit.h"
+#include "aesd-delim.h"
+#include "diaglog.h"
+#include "durable.h"
+#include "feed.h"
+#include "stats.h"
+#include "trace.h"
+#include "writer.h"
+
+#define BATCH_IOV 64 // Packets per writev() for a store that makes each write an entry
+
+/**
+ * Make room for need bytes in a buffer that grows by doubling
+ * @return false if it could not grow, the buffer is left as it was
+ */
+static bool reserve(char **buf, size_t *cap, size_t need)
+{
+    if (need <= *cap)
+        return true;
+
+    size_t grown_cap = *cap ? *cap : RECV_BUF_SIZE;
+    while (grown_cap < need)
+        grown_cap *= 2;
+    char *grown = realloc(*buf, grown_cap);
+    if (grown == NULL)
+    {
+        perror("realloc");
+        return false;
+    }
+    *buf = grown;
+    *cap = grown_cap;
+    return true;
+}
+
+bool batch_append(struct LogBatch *batch, const char *buf, size_t len)
+{
+    if (logentries() && batch->nends == batch->endcap)
+    {
+        unsigned grown_cap = batch->endcap ? 2 * batch->endcap : DELIM_BATCH;
+        size_t *grown = realloc(batch->ends, grown_cap * sizeof *grown);
+        if (grown == NULL)
+        {
+            perror("realloc");
+            return false;
+        }
+        batch->ends = grown;
+        batch->endcap = grown_cap;
+    }
+    if (!reserve(&batch->buf, &batch->cap, batch->len + len))
+        return false;
+    memcpy(batch->buf + batch->len, buf, len);
+    batch->len += len;
+    if (logentries())
+        batch->ends[batch->nends++] = batch->len;
+    return true;
+}
+
+static void batch_track(struct LogBatch *batch, struct WriterReq *req)
+{
+    // The newest flush answers for the ones still in flight, a finished one is settled now
+    if (batch->last && !writer_done(batch->last))
+        writer_chain(req, batch->last);
+    else
+    {
+        batch->failed |= writer_failed(batch->last);
+        writer_release(batch->last);
+    }
+    batch->last = req;
+}
+
+/**
+ * Append len bytes through the group commit writer when it runs, directly
+ * otherwise, and note what the next batch_wait() depends on
+ */
+static void batch_push(struct LogBatch *batch, const char *buf, size_t len)
+{
+    struct WriterReq *req = writer_running() ? writer_append(buf, len) : NULL;
+    if (req)
+    {
+        batch_track(batch, req);
+        return;
+    }
+    if (writelog(buf, len) != len)
+        batch->failed = true;
+    else if (durable_acks() && !durable_wait(loggeneration()))
+        batch->failed = true;
+}
+
+bool batch_write(struct LogBatch *batch)
+{
+    bool ok = true;
+    if (batch->nends == 0)
+    {
+        if (batch->len)
+            ok = writelog(batch->buf, batch->len) == batch->len;
+        batch->len = 0;
+        return ok;
+    }
+
+    // One iovec per packet, the driver turns each into an entry of its own
+    struct iovec iov[BATCH_IOV];
+    size_t start = 0;
+    for (unsigned i = 0; i < batch->nends;)
+    {
+        int n = 0;
+        for (; n < BATCH_IOV && i < batch->nends; n++, i++)
+        {
+            iov[n].iov_base = batch->buf + start;
+            iov[n].iov_len = batch->ends[i] - start;
+            start = batch->ends[i];
+        }
+        size_t want = (char *)iov[n - 1].iov_base + iov[n - 1].iov_len - (char *)iov[0].iov_base;
+        if (writelogv(iov, n) != (ssize_t)want)
+            ok = false;
+    }
+    batch->len = 0;
+    batch->nends = 0;
+    return ok;
+}
+
+void batch_flush(struct LogBatch *batch)
+{
+    if (batch->len == 0)
+        return;
+    if (batch->nends == 0)
+        batch_push(batch, batch->buf, batch->len);
+    else if (writer_running())
+    {
+        // The writer keeps its requests apart, so each packet goes in as one
+        size_t start = 0;
+        for (unsigned i = 0; i < batch->nends; i++)
+        {
+            batch_push(batch, batch->buf + start, batch->ends[i] - start);
+            start = batch->ends[i];
+        }
+    }
+    else if (!batch_write(batch))
+        batch->failed = true;
+    batch->len = 0;
+    batch->nends = 0;
+}
+
+bool batch_wait(struct LogBatch *batch)
+{
+    writer_wait(batch->last);
+    bool failed;
+    struct WriterReq *last = batch_claim(batch, &failed);
+    failed |= writer_failed(last);
+    writer_release(last);
+    return !failed;
+}
+
+struct WriterReq *batch_claim(struct LogBatch *batch, bool *failed)
+{
+    struct WriterReq *last = batch->last;
+    *failed = batch->failed;
+    batch->last = NULL;
+    batch->failed = false;
+    return last;
+}
+
+void batch_free(struct LogBatch *batch)
+{
+    batch_flush(batch);
+    writer_release(batch->last);
+    free(batch->buf);
+    free(batch->ends);
+    memset(batch, 0, sizeof *batch);
+}
+
+/**
+ * Stage data for the log behind whatever the batch already holds
+ */
+static void stage(struct LogBatch *batch, const char *buf, size_t len)
+{
+    if (!batch_append(batch, buf, len))
+    {
+        // Could not stage it, write out what is staged first to keep the order
+        batch_flush(batch);
+        batch_push(batch, buf, len);
+    }
+}
+
+/**
+ * Parse the "<first>[,<count>]" arguments of a range read, without a count
+ * the range runs to the end of the log
+ */
+static void parserange(const char *args, enum RangeUnit unit, struct Commands *cmds)
+{
+    long long first = 0, count = LLONG_MAX;
+    sscanf(args, "%lld,%lld", &first, &count);
+    cmds->range = unit;
+    cmds->range_first = (first > 0) ? first : 0;
+    cmds->range_count = (count > 0) ? count : 0;
+    DIAG(DIAG_DEBUG, "got %s range command - first %lld count %lld",
+         (unit == RANGE_BYTES) ? "byte" : "packet", first, count);
+}
+
+/**
+ * Apply one complete packet, newline included
+ * @return true when the packet is due a reply, which all but a subscribe are
+ */
+static bool handlepacket(const char *buf, size_t len, struct Commands *cmds, struct LogBatch *batch)
+{
+    static const char ioctl_cmd[] = "AESDCHAR_IOCSEEKTO:";
+    static const size_t ioctl_cmd_len = sizeof(ioctl_cmd) - 1u;
+    static const char read_cmd[] = "AESDSOCKET_READ:";
+    static const size_t read_cmd_len = sizeof(read_cmd) - 1u;
+    static const char readpkt_cmd[] = "AESDSOCKET_READPKT:";
+    static const size_t readpkt_cmd_len = sizeof(readpkt_cmd) - 1u;
+    static const char subscribe_cmd[] = FEED_SUBSCRIBE_CMD;
+    static const size_t subscribe_cmd_len = sizeof(subscribe_cmd) - 1u;
+
+    // The packet is not terminated, commands are parsed from a bounded copy of it
+    char cmd[64];
+    size_t cmd_len = (len < sizeof cmd) ? len : sizeof cmd - 1;
+    memcpy(cmd, buf, cmd_len);
+    cmd[cmd_len] = '\0';
+
+    if ((len > ioctl_cmd_len) &&
+        (memcmp(ioctl_cmd, buf, ioctl_cmd_len) == 0))
+    {
+        sscanf(cmd, "AESDCHAR_IOCSEEKTO:%u,%u", &cmds->seekto.write_cmd, &cmds->seekto.write_cmd_offset);
+        DIAG(DIAG_DEBUG, "got ioctl seek command - write_cmd %u write_cmd_offset %u", cmds->seekto.write_cmd, cmds->seekto.write_cmd_offset);
+    }
+    else if ((len > read_cmd_len) &&
+             (memcmp(read_cmd, buf, read_cmd_len) == 0))
+    {
+        parserange(cmd + read_cmd_len, RANGE_BYTES, cmds);
+    }
+    else if ((len > readpkt_cmd_len) &&
+             (memcmp(readpkt_cmd, buf, readpkt_cmd_len) == 0))
+    {
+        parserange(cmd + readpkt_cmd_len, RANGE_PACKETS, cmds);
+    }
+    else if ((len > subscribe_cmd_len) &&
+             (memcmp(subscribe_cmd, buf, subscribe_cmd_len) == 0))
+    {
+        long long from = strtoll(cmd + subscribe_cmd_len, NULL, 10);
+        cmds->subscribe = (from > 0) ? from : 0;
+        DIAG(DIAG_DEBUG, "got subscribe command - from offset %lld", (long long)cmds->subscribe);
+        return false;
+    }
+    else
+        stage(batch, buf, len);
+    return true;
+}
+
+/**
+ * Apply the end of a packet. Once its start was spilled it is data
+ * whatever it begins with.
+ */
+static bool finishpacket(struct PacketBuf *pkt, const char *buf, size_t len, struct Commands *cmds,
+                         struct LogBatch *batch)
+{
+    if (!pkt->spilled)
+        return handlepacket(buf, len, cmds, batch);
+    pkt->spilled = false;
+    stage(batch, buf, len);
+    return true;
+}
+
+/**
+ * Send what a packet holds to the log unfinished, as every chunk went
+ * before packets were reassembled, the rest follows as it arrives
+ */
+static void spill(struct PacketBuf *pkt, struct LogBatch *batch)
+{
+    DIAG(DIAG_DEBUG, "spilling %zu bytes of a packet without its newline", pkt->len);
+    stage(batch, pkt->buf, pkt->len);
+    pkt->len = 0;
+    pkt->spilled = true;
+    // Do not keep a buffer sized for the longest packet around
+    if (pkt->cap > RECV_BUF_SIZE)
+    {
+        free(pkt->buf);
+        pkt->buf = NULL;
+        pkt->cap = 0;
+    }
+}
+
+/**
+ * Split a chunk of a text mode connection into newline delimited packets
+ */
+static int handletext(struct PacketBuf *pkt, const char *buf, size_t len, struct Commands *cmds, struct LogBatch *batch)
+{
+    int completed = 0;
+    size_t start = 0; // first byte of the packet the scan is in
+    size_t newlines[DELIM_BATCH];
+    size_t found;
+    do
+    {
+        found = aesd_delim_scan(buf + start, len - start, '\n', newlines, DELIM_BATCH);
+        size_t base = start;
+        for (size_t i = 0; i < found; i++)
+        {
+            size_t end = base + newlines[i] + 1;
+            if (pkt->len)
+            {
+                if (!reserve(&pkt->buf, &pkt->cap, pkt->len + (end - start)))
+                    return ERROR;
+                memcpy(pkt->buf + pkt->len, buf + start, end - start);
+                completed += finishpacket(pkt, pkt->buf, pkt->len + (end - start), cmds, batch);
+                pkt->len = 0;
+            }
+            else
+            {
+                completed += finishpacket(pkt, buf + start, end - start, cmds, batch);
+            }
+            start = end;
+        }
+    } while (found == DELIM_BATCH);
+
+    if (start < len)
+    {
+        // Keep the start of the next packet until the rest of it arrives
+        if (!reserve(&pkt->buf, &pkt->cap, pkt->len + (len - start)))
+            return ERROR;
+        memcpy(pkt->buf + pkt->len, buf + start, len - start);
+        pkt->len += len - start;
+        if (!partial_keep(pkt->len))
+            spill(pkt, batch);
+    }
+
+    return completed;
+}
+
+/**
+ * Queue the reply to a binary request
+ * @return the reply, to fill in, or NULL when it could not be queued
+ */
+static struct ReplyFrame *addframe(struct PacketBuf *pkt, const struct aesd_frame *req)
+{
+    if (pkt->nframes == pkt->framecap)
+    {
+        unsigned grown_cap = pkt->framecap ? 2 * pkt->framecap : DELIM_BATCH;
+        struct ReplyFrame *grown = realloc(pkt->frames, grown_cap * sizeof *grown);
+        if (grown == NULL)
+        {
+            perror("realloc");
+            return NULL;
+        }
+        pkt->frames = grown;
+        pkt->framecap = grown_cap;
+    }
+
+    struct ReplyFrame *f = &pkt->frames[pkt->nframes++];
+    memset(f, 0, sizeof *f);
+    f->head.opcode = req->opcode | AESD_OP_REPLY;
+    f->head.seq = req->seq;
+    // Empty unless the request asks for a range
+    f->range = RANGE_BYTES;
+    return f;
+}
+
+static uint64_t getle64(const char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return le64toh(v);
+}
+
+static off_t clampoff(uint64_t v)
+{
+    return (v > LLONG_MAX) ? LLONG_MAX : (off_t)v;
+}
+
+/**
+ * Apply one complete binary request
+ * @return false when its reply could not be queued
+ */
+static bool handleframe(const struct aesd_frame *req, const char *payload, size_t len,
+                        struct PacketBuf *pkt, struct Commands *cmds, struct LogBatch *batch)
+{
+    DIAG(DIAG_DEBUG, "got frame - opcode %u seq %u length %zu", req->opcode, le32toh(req->seq), len);
+
+    struct ReplyFrame *f = addframe(pkt, req);
+    if (f == NULL)
+        return false;
+
+    switch (req->opcode)
+    {
+    case AESD_OP_APPEND:
+        stage(batch, payload, len);
+        break;
+    case AESD_OP_READ:
+    case AESD_OP_READPKT:
+        if (len < sizeof(struct aesd_frame_range))
+        {
+            f->head.status = EINVAL;
+            break;
+        }
+        f->range = (req->opcode == AESD_OP_READ) ? RANGE_BYTES : RANGE_PACKETS;
+        f->first = clampoff(getle64(payload + offsetof(struct aesd_frame_range, first)));
+        f->count = clampoff(getle64(payload + offsetof(struct aesd_frame_range, count)));
+        break;
+    case AESD_OP_SUBSCRIBE:
+        if (len < sizeof(uint64_t))
+        {
+            f->head.status = EINVAL;
+            break;
+        }
+        cmds->subscribe = clampoff(getle64(payload));
+        break;
+    case AESD_OP_SEEK:
+        if (len < sizeof(struct aesd_seekto))
+        {
+            f->head.status = EINVAL;
+            break;
+        }
+        f->range = RANGE_NONE;
+        memcpy(&f->seekto, payload, sizeof f->seekto);
+        f->seekto.write_cmd = le32toh(f->seekto.write_cmd);
+        f->seekto.write_cmd_offset = le32toh(f->seekto.write_cmd_offset);
+        break;
+    default:
+        f->head.status = EINVAL;
+        break;
+    }
+    return true;
+}
+
+/**
+ * Split a chunk of a binary mode connection into frames
+ */
+static int handleframes(struct PacketBuf *pkt, const char *buf, size_t len, struct Commands *cmds, struct LogBatch *batch)
+{
+    // A partial frame is completed in place, the rest of the chunk is parsed where it lies
+    const char *data = buf;
+    if (pkt->len)
+    {
+        if (!reserve(&pkt->buf, &pkt->cap, pkt->len + len))
+            return ERROR;
+        memcpy(pkt->buf + pkt->len, buf, len);
+        data = pkt->buf;
+        len += pkt->len;
+    }
+
+    int completed = 0;
+    size_t pos = 0;
+    struct aesd_frame req;
+    while (len - pos >= sizeof req)
+    {
+        memcpy(&req, data + pos, sizeof req);
+        size_t flen = le32toh(req.length);
+        if (frame_oversized(flen))
+        {
+            DIAG(DIAG_WARN, "frame of %zu bytes is over the %zu byte limit, closing the connection", flen,
+                 admit_packet);
+            return ERROR;
+        }
+        if (len - pos - sizeof req < flen)
+            break;
+        if (!handleframe(&req, data + pos + sizeof req, flen, pkt, cmds, batch))
+            return ERROR;
+        pos += sizeof req + flen;
+        completed++;
+    }
+
+    // Keep the start of the next frame until the rest of it arrives
+    if (data == pkt->buf)
+        memmove(pkt->buf, pkt->buf + pos, len - pos);
+    else if (pos < len)
+    {
+        if (!reserve(&pkt->buf, &pkt->cap, len - pos))
+            return ERROR;
+        memcpy(pkt->buf, data + pos, len - pos);
+    }
+    pkt->len = len - pos;
+    return completed;
+}
+
+// Everything handlechunk() does but counting it
+static int parsechunk(struct PacketBuf *pkt, const char *buf, size_t len, struct Commands *cmds, struct LogBatch *batch)
+{
+    static const char hello[] = AESD_BINARY_HELLO;
+    static const size_t hello_len = sizeof(hello) - 1u;
+
+    cmds->seekto.write_cmd = cmds->seekto.write_cmd_offset = 0;
+    cmds->range = RANGE_NONE;
+    cmds->subscribe = ERROR;
+    cmds->frames = NULL;
+    cmds->nframes = 0;
+    pkt->nframes = 0;
+
+    DIAG(DIAG_TRACE, "Server received %zu bytes", len);
+    DIAG_PAYLOAD("Server received", buf, len);
+
+    int completed = 0;
+    if (pkt->proto == PROTO_NEW)
+    {
+        // The first bytes of a connection pick the protocol, whatever precedes
+        // this chunk is a prefix of the hello and still sits in pkt
+        size_t have = pkt->len + len;
+        size_t cmp = (have < hello_len) ? have : hello_len;
+        bool match = memcmp(pkt->buf ? pkt->buf : "", hello, pkt->len) == 0 &&
+                     memcmp(buf, hello + pkt->len, cmp - pkt->len) == 0;
+        if (match && have < hello_len)
+        {
+            if (!reserve(&pkt->buf, &pkt->cap, have))
+                return ERROR;
+            memcpy(pkt->buf + pkt->len, buf, len);
+            pkt->len = have;
+            return 0;
+        }
+        if (match)
+        {
+            const struct aesd_frame req = {.opcode = AESD_OP_HELLO};
+            if (addframe(pkt, &req) == NULL)
+                return ERROR;
+            completed++;
+            buf += hello_len - pkt->len;
+            len -= hello_len - pkt->len;
+            pkt->len = 0;
+            pkt->proto = PROTO_BINARY;
+            DIAG(DIAG_DEBUG, "connection switched to binary frames");
+        }
+        else
+            pkt->proto = PROTO_TEXT;
+    }
+
+    int more = (pkt->proto == PROTO_BINARY) ? handleframes(pkt, buf, len, cmds, batch)
+                                            : handletext(pkt, buf, len, cmds, batch);
+    if (more == ERROR)
+        return ERROR;
+    if (pkt->proto == PROTO_BINARY)
+    {
+        cmds->frames = pkt->frames;
+        cmds->nframes = pkt->nframes;
+    }
+    return completed + more;
+}
+
+int handlechunk(struct PacketBuf *pkt, const char *buf, size_t len, struct Commands *cmds, struct LogBatch *batch)
+{
+    uint64_t id = trace_begin();
+    uint64_t received = stat_now();
+    size_t held = pkt->len;
+    int completed = parsechunk(pkt, buf, len, cmds, batch);
+    partial_add((ptrdiff_t)pkt->len - (ptrdiff_t)held);
+    uint64_t done = stat_now();
+    stat_time(STAT_RECV, done - received);
+    trace_span(id, TRACE_RECV, received, done);
+    cmds->trace_id = id;
+    stat_add(STAT_BYTES_IN, len);
+    if (completed > 0)
+        stat_add(STAT_PACKETS, completed);
+    return completed;
+}
+
+void packet_free(struct PacketBuf *pkt)
+{
+    partial_add(-(ptrdiff_t)pkt->len);
+    free(pkt->buf);
+    free(pkt->frames);
+    memset(pkt, 0, sizeof *pkt);
+}
@@ -0,0 +1,740 @@
+/**
+ * @file reactor.c
+ * @brief Event driven connection handling for aesdsocket
+ *
+ * Connections are served from event loops instead of threads: sockets are
+ * non-blocking and each connection is a small state machine driven by epoll
+ * readiness events, so an idle client costs a struct Conn instead of a thread
+ * stack. Several loops can run side by side, each owning its own listener.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "aesdsocket.h"
+#include "admit.h"
+#include "diaglog.h"
+#include "feed.h"
+#include "slab.h"
+#include "uring.h"
+#include "writer.h"
+
+#define MAX_EVENTS 64
+
+// Reply chunks a connection may send per wakeup before the loop moves on
+#define REPLY_BURST 4
+
+enum ConnState
+{
+    CONN_READING,  // waiting for the next chunk from the client
+    CONN_WAITING,  // a reply is due once the appends before it are in the log
+    CONN_REPLYING, // streaming a reply from the log, reads are paused until it is sent
+    CONN_SUBSCRIBED, // caught up with the log, waiting for appends to push
+    CONN_PAUSED,     // reads held off for the client's rate or the writer's backlog
+};
+
+struct Conn
+{
+    struct Conn *prev;
+    struct Conn *next;
+    struct Conn *wait_next;
+    struct Conn *sub_next;
+    struct Conn *pause_next;
+    int fd;
+    enum ConnState state;
+    bool subscribed; // the connection only receives appends from now on
+    struct Commands cmds;
+    unsigned replies;         // packets the next reply answers
+    struct WriterReq *commit; // the flush a waiting reply depends on
+    bool staged;              // the reply also depends on what the loop staged this pass
+    bool lost;                // some of what the reply depends on missed the log
+    struct ReplyCursor reply;
+    struct PacketBuf pkt;
+    struct AdmitClient *client;
+    uint64_t resume_ns; // when a paused connection reads again, 0 once the writer catches up
+    char client_ip[INET6_ADDRSTRLEN];
+};
+
+struct Reactor
+{
+    int id;
+    int listenfd;
+    int localfd; // the Unix socket listener every loop shares, ERROR when there is none
+    int epfd;
+    int cpu; // CPU the loop is pinned to, -1 when not pinned
+    bool use_uring;
+    pthread_t thread;
+    struct Slab slab; // every struct Conn of the loop comes from here
+    struct Conn *head;
+    struct Conn *waiting;
+    struct Conn *paused;
+    struct LogBatch batch;
+    int wakefd; // signalled by the writer thread when a flush completes and by appends while subscribed
+    int wakeslot;
+    struct Conn *subs;
+    int feedslot;
+    uint64_t feedgen; // log generation subscribers were last pushed up to
+    bool feedcheck;   // look at the log even if the generation did not move
+};
+
+// Written once at shutdown to wake every loop, it is never read so it stays readable
+static int stopfd = ERROR;
+static char stopmark;
+static char wakemark;
+static char localmark;
+
+static uint64_t nowns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int setnonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == ERROR)
+        return ERROR;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void closeconn(struct Reactor *r, struct Conn *conn)
+{
+    DIAG(DIAG_INFO, "Closed connection from %s", conn->client_ip);
+
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+
+    if (conn->state == CONN_WAITING)
+    {
+        // The connection may have left the list already if its reply failed
+        struct Conn **link = &r->waiting;
+        while (*link && *link != conn)
+            link = &(*link)->wait_next;
+        if (*link)
+            *link = conn->wait_next;
+        writer_release(conn->commit);
+    }
+    if (conn->state == CONN_PAUSED)
+    {
+        struct Conn **link = &r->paused;
+        while (*link != conn)
+            link = &(*link)->pause_next;
+        *link = conn->pause_next;
+    }
+    if (conn->subscribed)
+    {
+        struct Conn **link = &r->subs;
+        while (*link != conn)
+            link = &(*link)->sub_next;
+        *link = conn->sub_next;
+    }
+
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        r->head = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+
+    replyend(&conn->reply);
+    packet_free(&conn->pkt);
+    conn_leave(conn->client);
+    slab_free(&r->slab, conn);
+}
+
+static int watch(struct Reactor *r, struct Conn *conn, uint32_t events)
+{
+    struct epoll_event ev = {.events = events, .data.ptr = conn};
+    return epoll_ctl(r->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/**
+ * Turn conn into a subscriber that is pushed the log from offset from onwards
+ */
+static void subscribe(struct Reactor *r, struct Conn *conn, off_t from)
+{
+    conn->subscribed = true;
+    conn->reply.off = conn->reply.start = conn->reply.end = from;
+    conn->reply.repeat = 0;
+    conn->sub_next = r->subs;
+    r->subs = conn;
+    r->feedcheck = true;
+}
+
+/**
+ * Push up to REPLY_BURST chunks of the pending reply. If the socket fills up
+ * or the burst is used up the cursor stays put and the connection waits for
+ * the next writable event, so a slow or large reply never stalls the loop.
+ * @return false if the connection failed and must be closed
+ */
+static bool flushreply(struct Reactor *r, struct Conn *conn)
+{
+    for (int burst = 0; burst < REPLY_BURST;)
+    {
+        ssize_t sent = replysend(conn->fd, &conn->reply);
+        if (sent == 0)
+            break;
+        if (sent > 0)
+        {
+            burst++;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            perror("sendfile");
+            return false;
+        }
+        break;
+    }
+
+    if (replymore(&conn->reply))
+    {
+        if (conn->state != CONN_REPLYING)
+        {
+            conn->state = CONN_REPLYING;
+            watch(r, conn, EPOLLOUT);
+        }
+        return true;
+    }
+
+    replyend(&conn->reply);
+    // Replies due before a subscribe go out first
+    if (conn->cmds.subscribe != ERROR && !conn->subscribed)
+        subscribe(r, conn, conn->cmds.subscribe);
+    enum ConnState idle = conn->subscribed ? CONN_SUBSCRIBED : CONN_READING;
+    if (conn->state != idle)
+    {
+        // A subscriber misses the appends that came in while it was pushing
+        if (conn->subscribed)
+            r->feedcheck = true;
+        conn->state = idle;
+        watch(r, conn, EPOLLIN);
+    }
+    return true;
+}
+
+/**
+ * Push what was appended since the last look to every subscriber that is caught up
+ */
+static void pushsubs(struct Reactor *r)
+{
+    if (r->subs == NULL)
+        return;
+
+    // Arm before looking, an append from elsewhere after the look then wakes the loop
+    feed_arm(r->feedslot);
+    uint64_t gen = loggeneration();
+    if (gen == r->feedgen && !r->feedcheck)
+        return;
+    r->feedgen = gen;
+    r->feedcheck = false;
+
+    off_t size = logsize();
+    struct Conn *next;
+    for (struct Conn *conn = r->subs; conn; conn = next)
+    {
+        next = conn->sub_next;
+        if (conn->state != CONN_SUBSCRIBED || conn->reply.off >= size)
+            continue;
+        conn->reply.end = size;
+        if (!flushreply(r, conn))
+            closeconn(r, conn);
+    }
+}
+
+/**
+ * Stop watching conn for input while the client is over its rate or the
+ * writer is behind. The loop wakes up for it again in resumepaused().
+ * @return true if conn was paused
+ */
+static bool pausereads(struct Reactor *r, struct Conn *conn)
+{
+    unsigned ms = rate_pause(conn->client);
+    if (ms == 0 && !backlog_pause(writer_queued()))
+        return false;
+
+    conn->state = CONN_PAUSED;
+    conn->resume_ns = ms ? nowns() + ms * 1000000ull : 0;
+    conn->pause_next = r->paused;
+    r->paused = conn;
+    watch(r, conn, 0);
+    return true;
+}
+
+/**
+ * Go back to reading on the paused connections that are due
+ * @return the epoll timeout until the next one is due, -1 for none
+ */
+static int resumepaused(struct Reactor *r)
+{
+    int timeout = -1;
+    uint64_t now = nowns();
+    bool behind = writer_queued() > admit_backlog;
+    bool waitwriter = false;
+
+    struct Conn **link = &r->paused;
+    while (*link)
+    {
+        struct Conn *conn = *link;
+        if (conn->resume_ns ? conn->resume_ns > now : behind)
+        {
+            if (conn->resume_ns)
+            {
+                int ms = (conn->resume_ns - now + 999999) / 1000000;
+                if (timeout < 0 || ms < timeout)
+                    timeout = ms;
+            }
+            else
+                waitwriter = true;
+            link = &conn->pause_next;
+            continue;
+        }
+
+        *link = conn->pause_next;
+        conn->state = CONN_READING;
+        watch(r, conn, EPOLLIN);
+    }
+
+    // Have the writer wake us after its next batch, look again if it drained meanwhile
+    if (waitwriter)
+    {
+        writer_arm(r->wakeslot);
+        if (writer_queued() <= admit_backlog)
+            timeout = 0;
+    }
+    return timeout;
+}
+
+/**
+ * Consume one chunk from a readable connection.
+ * @return false if the peer went away or the connection failed
+ */
+static bool readconn(struct Reactor *r, struct Conn *conn, char *buf)
+{
+    if (!conn->subscribed && pausereads(r, conn))
+        return true;
+
+    ssize_t bytes_received = recv(conn->fd, buf, RECV_BUF_SIZE, 0);
+    if (bytes_received < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+    if (bytes_received == 0)
+        return false;
+    // What a subscriber sends is ignored, it only matters when it hangs up
+    if (conn->subscribed)
+        return true;
+
+    int completed = handlechunk(&conn->pkt, buf, bytes_received, &conn->cmds, &r->batch);
+    if (completed >= 0)
+        rate_charge(conn->client, bytes_received, completed);
+    if (completed == 0 && conn->cmds.subscribe != ERROR)
+    {
+        subscribe(r, conn, conn->cmds.subscribe);
+        conn->state = CONN_SUBSCRIBED;
+        return true;
+    }
+    if (completed <= 0)
+        return completed == 0;
+
+    // The reply has to include what this loop staged so far, which is
+    // flushed at the end of the pass. Reads stay paused until it is sent,
+    // packets pipelined behind it wait in the socket.
+    conn->replies = completed;
+    conn->state = CONN_WAITING;
+    conn->staged = true;
+    conn->commit = NULL;
+    conn->wait_next = r->waiting;
+    r->waiting = conn;
+    watch(r, conn, 0);
+    return true;
+}
+
+/**
+ * Flush what this pass staged and start every reply whose appends are in the log
+ */
+static void commitpass(struct Reactor *r)
+{
+    batch_flush(&r->batch);
+    bool lost;
+    struct WriterReq *pass = batch_claim(&r->batch, &lost);
+
+    struct Conn **link = &r->waiting;
+    while (*link)
+    {
+        struct Conn *conn = *link;
+        if (conn->staged)
+        {
+            conn->staged = false;
+            conn->commit = writer_hold(pass);
+            conn->lost = lost;
+        }
+        if (!writer_done(conn->commit))
+        {
+            link = &conn->wait_next;
+            continue;
+        }
+
+        *link = conn->wait_next;
+        conn->lost |= writer_failed(conn->commit);
+        writer_release(conn->commit);
+        conn->commit = NULL;
+        if (conn->lost)
+        {
+            // Replying would acknowledge appends that are not in the log
+            DIAG(DIAG_WARN, "Appends from %s missed the log, closing the connection", conn->client_ip);
+            closeconn(r, conn);
+            continue;
+        }
+        replystart(&conn->reply, &conn->cmds, conn->replies);
+        if (!flushreply(r, conn))
+            closeconn(r, conn);
+    }
+    writer_release(pass);
+
+    // Whatever is left waits on the writer, have it wake us. A flush that
+    // completed before arming is caught by the next pass over the list.
+    if (r->waiting)
+    {
+        writer_arm(r->wakeslot);
+        for (struct Conn *conn = r->waiting; conn; conn = conn->wait_next)
+        {
+            if (writer_done(conn->commit))
+            {
+                eventfd_write(r->wakefd, 1);
+                break;
+            }
+        }
+    }
+
+    pushsubs(r);
+}
+
+static void acceptconns(struct Reactor *r, int listenfd)
+{
+    for (;;)
+    {
+        struct sockaddr_storage their_addr;
+        socklen_t addr_size = sizeof their_addr;
+        int recvfd = accept4(listenfd, (struct sockaddr *)&their_addr, &addr_size,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (recvfd == ERROR)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+
+        struct AdmitClient *client = conn_admit(&their_addr);
+        if (client == NULL)
+        {
+            DIAG(DIAG_INFO, "Refused a connection, a connection limit is reached");
+            close(recvfd);
+            continue;
+        }
+        struct Conn *conn = slab_alloc(&r->slab);
+        if (conn == NULL)
+        {
+            perror("malloc");
+            close(recvfd);
+            conn_leave(client);
+            continue;
+        }
+        conn->fd = recvfd;
+        conn->state = CONN_READING;
+        conn->client = client;
+        peername(&their_addr, conn->client_ip, sizeof conn->client_ip);
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, recvfd, &ev) == ERROR)
+        {
+            perror("epoll_ctl");
+            close(recvfd);
+            slab_free(&r->slab, conn);
+            conn_leave(client);
+            continue;
+        }
+
+        conn->next = r->head;
+        if (r->head)
+            r->head->prev = conn;
+        r->head = conn;
+
+        DIAG(DIAG_INFO, "Accepted connection from %s", conn->client_ip);
+    }
+}
+
+// Pick the n-th CPU this process may run on, wrapping around the allowed set
+static int nthcpu(int n)
+{
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof set, &set) != 0 || CPU_COUNT(&set) == 0)
+        return -1;
+
+    n %= CPU_COUNT(&set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &set) && n-- == 0)
+            return cpu;
+    }
+    return -1;
+}
+
+static int reactor_setup(struct Reactor *r)
+{
+    if (setnonblocking(r->listenfd) == ERROR || (r->localfd != ERROR && setnonblocking(r->localfd) == ERROR))
+    {
+        perror("fcntl");
+        return ERROR;
+    }
+
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd == ERROR)
+    {
+        perror("epoll_create1");
+        return ERROR;
+    }
+
+    // The listening socket is the only entry registered without a connection
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listenfd, &ev) == ERROR)
+    {
+        perror("epoll_ctl");
+        close(r->epfd);
+        return ERROR;
+    }
+
+    // Every loop waits on the shared Unix listener, a connection only wakes one of them
+    struct epoll_event local = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &localmark};
+    if (r->localfd != ERROR && epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->localfd, &local) == ERROR)
+    {
+        perror("epoll_ctl");
+        close(r->epfd);
+        return ERROR;
+    }
+
+    ev.data.ptr = &stopmark;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, stopfd, &ev) == ERROR)
+    {
+        perror("epoll_ctl");
+        close(r->epfd);
+        return ERROR;
+    }
+
+    r->wakeslot = ERROR;
+    r->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ev.data.ptr = &wakemark;
+    if (r->wakefd == ERROR || epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev) == ERROR)
+    {
+        perror("eventfd");
+        if (r->wakefd != ERROR)
+            close(r->wakefd);
+        close(r->epfd);
+        return ERROR;
+    }
+    if (writer_running())
+        r->wakeslot = writer_addwaker(r->wakefd);
+    r->feedslot = feed_addwaker(r->wakefd);
+    if (r->feedslot == ERROR)
+        DIAG(DIAG_WARN, "reactor: no feed slot left, subscribers are only pushed on other events");
+    return 0;
+}
+
+// Give back what reactor_setup() took, once the loop is done or never ran
+static void reactor_release(struct Reactor *r)
+{
+    batch_free(&r->batch);
+    feed_delwaker(r->feedslot);
+    close(r->wakefd);
+    close(r->epfd);
+}
+
+/**
+ * Run one event loop until running drops.
+ * @param waitmask is the signal mask applied while the loop waits for events
+ */
+static void reactor_loop(struct Reactor *r, const sigset_t *waitmask)
+{
+    if (r->cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(r->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof set, &set) != 0)
+            fprintf(stderr, "reactor %d: failed to pin to cpu %d\n", r->id, r->cpu);
+    }
+
+    if (r->use_uring)
+    {
+        if (uring_loop(r->listenfd, r->localfd, stopfd, waitmask, &r->batch) == 0)
+            goto out;
+        fprintf(stderr, "reactor %d: io_uring unavailable, using epoll\n", r->id);
+        setnonblocking(r->listenfd);
+        if (r->localfd != ERROR)
+            setnonblocking(r->localfd);
+    }
+
+    slab_init(&r->slab, sizeof(struct Conn));
+    struct epoll_event events[MAX_EVENTS];
+    char buf[RECV_BUF_SIZE];
+
+    int timeout = -1;
+    while (running)
+    {
+        int n = epoll_pwait(r->epfd, events, MAX_EVENTS, timeout, waitmask);
+        if (n == ERROR)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            struct Conn *conn = events[i].data.ptr;
+            if (conn == NULL)
+            {
+                acceptconns(r, r->listenfd);
+                continue;
+            }
+            if (conn == (struct Conn *)&localmark)
+            {
+                acceptconns(r, r->localfd);
+                continue;
+            }
+            if (conn == (struct Conn *)&stopmark)
+                continue;
+            if (conn == (struct Conn *)&wakemark)
+            {
+                eventfd_t count;
+                eventfd_read(r->wakefd, &count);
+                continue;
+            }
+
+            bool ok;
+            if (conn->state == CONN_WAITING || conn->state == CONN_PAUSED)
+                ok = !(events[i].events & (EPOLLERR | EPOLLHUP));
+            else if (events[i].events & (EPOLLERR | EPOLLHUP))
+                ok = (events[i].events & EPOLLIN) && readconn(r, conn, buf);
+            else if (conn->state == CONN_REPLYING)
+                ok = flushreply(r, conn);
+            else
+                ok = readconn(r, conn, buf);
+
+            if (!ok)
+                closeconn(r, conn);
+        }
+
+        // Everything read during this pass goes to the log in one append, or
+        // one write per packet for a store that makes each write an entry
+        commitpass(r);
+        timeout = resumepaused(r);
+    }
+
+    while (r->head != NULL)
+        closeconn(r, r->head);
+    slab_destroy(&r->slab);
+
+out:
+    reactor_release(r);
+}
+
+static void *reactor_thread(void *arg)
+{
+    // Signals stay blocked for good here, the first loop takes them
+    reactor_loop(arg, NULL);
+    return NULL;
+}
+
+int reactor_run(int listenfd, int localfd, int backlog, int nreactors, bool use_uring)
+{
+    stopfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stopfd == ERROR)
+    {
+        perror("eventfd");
+        return ERROR;
+    }
+
+    struct Reactor *reactors = calloc(nreactors, sizeof(struct Reactor));
+    if (reactors == NULL)
+    {
+        perror("malloc");
+        close(stopfd);
+        return ERROR;
+    }
+
+    // Only let the stop signals in while the first loop is parked in
+    // epoll_pwait(), so no other call of the loops is cut short by them
+    sigset_t blocked, waitmask;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &blocked, &waitmask);
+
+    int started = 0;
+    for (int i = 0; i < nreactors; i++)
+    {
+        struct Reactor *r = &reactors[i];
+        r->id = i;
+        r->cpu = (nreactors > 1) ? nthcpu(i) : -1;
+        r->use_uring = use_uring;
+        r->localfd = localfd;
+        r->listenfd = (i == 0) ? listenfd : openlistener(backlog, true);
+        if (r->listenfd == ERROR || reactor_setup(r) == ERROR)
+        {
+            if (i > 0 && r->listenfd != ERROR)
+                close(r->listenfd);
+            break;
+        }
+        if (i > 0 && pthread_create(&r->thread, NULL, reactor_thread, r) != 0)
+        {
+            perror("pthread_create");
+            reactor_release(r);
+            close(r->listenfd);
+            break;
+        }
+        started++;
+    }
+
+    if (started == nreactors)
+    {
+        printf("serving with %d event loop(s)\n", nreactors);
+        reactor_loop(&reactors[0], &waitmask);
+    }
+    else
+    {
+        // The other started loops give theirs back as they see stopfd, the
+        // first one never ran
+        running = 0;
+        if (started > 0)
+            reactor_release(&reactors[0]);
+    }
+
+    eventfd_write(stopfd, 1);
+    for (int i = 1; i < started; i++)
+    {
+        pthread_join(reactors[i].thread, NULL);
+        close(reactors[i].listenfd);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &waitmask, NULL);
+    free(reactors);
+    close(stopfd);
+    return (started == nreactors) ? 0 : ERROR;
+}
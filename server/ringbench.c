@@ -0,0 +1,167 @@
+/**
+ * @file ringbench.c
+ * @brief Load generator for the aesdsocket shared memory ring
+ *
+ * Worker threads append newline terminated packets of a fixed size through
+ * the ring aesdsocket -M created, as fast as it takes them, for a fixed
+ * duration. Prints packets and megabytes per second, and how often a
+ * worker found the ring full and had to wait for the server. Compare with
+ * aesdbench -a -u, which appends the same packets over the Unix socket.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+#include "aesdring.h"
+
+#define ERROR (-1)
+
+struct Worker
+{
+    pthread_t thread;
+    int id;
+    struct aesdring *ring;
+    size_t size;
+    unsigned long long packets;
+    unsigned long long fulls; // appends that found the ring full
+    bool failed;
+};
+
+static atomic_int stop;
+static pthread_barrier_t ready;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker(void *arg)
+{
+    struct Worker *w = arg;
+    char *packet = malloc(w->size);
+    if (packet)
+    {
+        memset(packet, 'a' + w->id % 26, w->size - 1);
+        packet[w->size - 1] = '\n';
+    }
+    pthread_barrier_wait(&ready);
+    if (packet == NULL)
+    {
+        w->failed = true;
+        return NULL;
+    }
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed))
+    {
+        if (aesdring_tryappend(w->ring, packet, w->size) < 0)
+        {
+            if (errno != EAGAIN || aesdring_append(w->ring, packet, w->size) < 0)
+            {
+                perror("aesdring_append");
+                w->failed = true;
+                break;
+            }
+            w->fulls++;
+        }
+        w->packets++;
+    }
+    free(packet);
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n name] [-t threads] [-d seconds] [-s size]\n", prog);
+    fprintf(stderr, "  -n  shared memory name the server was given with -M, /aesdring by default\n");
+    fprintf(stderr, "  -s  packet size, newline included\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = "/aesdring";
+    int threads = 4;
+    int seconds = 5;
+    size_t size = 64;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:d:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            name = optarg;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 's':
+            size = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return ERROR;
+        }
+    }
+    if (threads < 1 || seconds < 1 || size < 1)
+    {
+        usage(argv[0]);
+        return ERROR;
+    }
+
+    struct aesdring *ring = aesdring_open(name);
+    if (ring == NULL)
+    {
+        perror(name);
+        return ERROR;
+    }
+    struct Worker *workers = calloc(threads, sizeof(struct Worker));
+    if (workers == NULL)
+    {
+        perror("malloc");
+        aesdring_close(ring);
+        return ERROR;
+    }
+
+    pthread_barrier_init(&ready, NULL, threads + 1);
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i].id = i;
+        workers[i].ring = ring;
+        workers[i].size = size;
+        pthread_create(&workers[i].thread, NULL, worker, &workers[i]);
+    }
+
+    pthread_barrier_wait(&ready);
+    double start = now();
+    sleep(seconds);
+    atomic_store(&stop, 1);
+
+    unsigned long long packets = 0, fulls = 0;
+    bool failed = false;
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        packets += workers[i].packets;
+        fulls += workers[i].fulls;
+        failed |= workers[i].failed;
+    }
+    double elapsed = now() - start;
+
+    printf("threads %d size %zu seconds %.2f packets/s %.0f MB/s %.2f full %llu\n", threads, size, elapsed,
+           packets / elapsed, packets * size / elapsed / 1e6, fulls);
+
+    free(workers);
+    aesdring_close(ring);
+    return failed ? ERROR : 0;
+}
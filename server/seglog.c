@@ -0,0 +1,455 @@
+/**
+ * @file seglog.c
+ * @brief Size and age bounded segment files holding the aesdsocket log
+ *
+ * The log is a run of segment files, each named after the log offset of
+ * its first byte, so offsets keep growing across segments and restarts.
+ * Appends go to the newest segment. Once it reaches the size or age limit
+ * a new one is started, and the oldest segments are unlinked for as long
+ * as the ones left still hold what the retention limits ask for. Disk use
+ * stays within the retention limit plus one segment, and a reply only
+ * touches the segments its range covers.
+ *
+ * A segment is reference counted. The table holds one reference and every
+ * pinned read holds another, so a segment dropped by retention keeps its
+ * file open until the last read from it is done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "aesdsocket.h"
+#include "aesd-delim.h"
+#include "diaglog.h"
+#include "seglog.h"
+
+#define SEG_SUFFIX ".seg"
+// Packet ends looked up per delimiter scan while counting packets
+#define SEG_BATCH 64
+// Bytes read per step while counting the packets of a segment found on start
+#define SEG_BLOCK (64 * 1024)
+
+struct Segment
+{
+    off_t base;
+    off_t len;     // guarded by segs_mtx
+    off_t packets; // newlines in the segment, counted only for packet retention
+    int fd;
+    int refs;      // the table's plus one per pin, guarded by segs_mtx
+    bool dirty;    // appended to since the last seglog_sync(), guarded by segs_mtx
+    time_t opened;
+};
+
+static pthread_mutex_t segs_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct Segment **segs; // oldest first, guarded by segs_mtx
+static size_t nsegs;
+static size_t capsegs;
+static off_t total_packets;
+static bool enabled;
+
+static char segdir[PATH_MAX - 32]; // leaves room for the segment file names
+static off_t max_bytes;
+static unsigned max_secs;
+static off_t keep_bytes;
+static off_t keep_packets;
+
+static void segpath(char *path, size_t size, off_t base)
+{
+    snprintf(path, size, "%s/%020lld" SEG_SUFFIX, segdir, (long long)base);
+}
+
+static size_t countnewlines(const char *buf, size_t len)
+{
+    size_t count = 0;
+    size_t newlines[SEG_BATCH];
+    size_t base = 0;
+    size_t found;
+    do
+    {
+        found = aesd_delim_scan(buf + base, len - base, '\n', newlines, SEG_BATCH);
+        count += found;
+        if (found)
+            base += newlines[found - 1] + 1;
+    } while (found == SEG_BATCH);
+    return count;
+}
+
+static off_t countfile(int fd)
+{
+    static char block[SEG_BLOCK];
+    off_t count = 0;
+    off_t off = 0;
+    ssize_t got;
+    while ((got = pread(fd, block, sizeof block, off)) > 0)
+    {
+        count += countnewlines(block, got);
+        off += got;
+    }
+    return count;
+}
+
+// Drop a reference, the last one closes the file. Called with segs_mtx held.
+static void segput(struct Segment *seg)
+{
+    if (--seg->refs == 0)
+    {
+        close(seg->fd);
+        free(seg);
+    }
+}
+
+// Add seg as the newest segment
+static bool segpush(struct Segment *seg)
+{
+    pthread_mutex_lock(&segs_mtx);
+    if (nsegs == capsegs)
+    {
+        size_t grown_cap = capsegs ? 2 * capsegs : 16;
+        struct Segment **grown = realloc(segs, grown_cap * sizeof *grown);
+        if (grown == NULL)
+        {
+            pthread_mutex_unlock(&segs_mtx);
+            perror("realloc");
+            return false;
+        }
+        segs = grown;
+        capsegs = grown_cap;
+    }
+    segs[nsegs++] = seg;
+    pthread_mutex_unlock(&segs_mtx);
+    return true;
+}
+
+static struct Segment *segopen(off_t base, bool create)
+{
+    char path[PATH_MAX];
+    segpath(path, sizeof path, base);
+
+    struct Segment *seg = calloc(1, sizeof(struct Segment));
+    if (seg == NULL)
+    {
+        perror("malloc");
+        return NULL;
+    }
+    seg->fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), S_IRUSR | S_IWUSR);
+    struct stat st;
+    if (seg->fd == ERROR || fstat(seg->fd, &st) == ERROR)
+    {
+        perror(path);
+        if (seg->fd != ERROR)
+            close(seg->fd);
+        free(seg);
+        return NULL;
+    }
+    seg->base = base;
+    seg->len = st.st_size;
+    seg->refs = 1;
+    seg->opened = time(NULL);
+    if (keep_packets)
+        seg->packets = countfile(seg->fd);
+    return seg;
+}
+
+// Whether the oldest segment can go and still leave what retention asks for
+static bool overkept(void)
+{
+    if (nsegs < 2)
+        return false;
+    const struct Segment *oldest = segs[0];
+    const struct Segment *newest = segs[nsegs - 1];
+    off_t bytes = newest->base + newest->len - oldest->base;
+    if (keep_bytes && bytes - oldest->len >= keep_bytes)
+        return true;
+    if (keep_packets && total_packets - oldest->packets >= keep_packets)
+        return true;
+    return false;
+}
+
+static void retain(void)
+{
+    pthread_mutex_lock(&segs_mtx);
+    while (overkept())
+    {
+        struct Segment *oldest = segs[0];
+        char path[PATH_MAX];
+        segpath(path, sizeof path, oldest->base);
+        if (unlink(path) == ERROR)
+            perror(path);
+        DIAG(DIAG_DEBUG, "seglog: dropped segment at %lld", (long long)oldest->base);
+
+        total_packets -= oldest->packets;
+        memmove(segs, segs + 1, --nsegs * sizeof *segs);
+        segput(oldest);
+    }
+    pthread_mutex_unlock(&segs_mtx);
+}
+
+static int cmpbase(const void *a, const void *b)
+{
+    off_t x = *(const off_t *)a, y = *(const off_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Collect the bases of the segments in segdir, sorted
+static off_t *listsegs(size_t *count)
+{
+    DIR *dir = opendir(segdir);
+    if (dir == NULL)
+    {
+        perror(segdir);
+        return NULL;
+    }
+
+    off_t *bases = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        char *end;
+        long long base = strtoll(ent->d_name, &end, 10);
+        if (end == ent->d_name || strcmp(end, SEG_SUFFIX) != 0 || base < 0)
+            continue;
+        if (n == cap)
+        {
+            cap = cap ? 2 * cap : 16;
+            off_t *grown = realloc(bases, cap * sizeof *grown);
+            if (grown == NULL)
+            {
+                perror("realloc");
+                free(bases);
+                closedir(dir);
+                return NULL;
+            }
+            bases = grown;
+        }
+        bases[n++] = base;
+    }
+    closedir(dir);
+
+    if (n)
+        qsort(bases, n, sizeof *bases, cmpbase);
+    *count = n;
+    return bases ? bases : calloc(1, sizeof *bases);
+}
+
+int seglog_open(const char *dir, off_t seg_bytes, unsigned seg_secs, off_t keep_b, off_t keep_p)
+{
+    snprintf(segdir, sizeof segdir, "%s", dir);
+    max_bytes = seg_bytes;
+    max_secs = seg_secs;
+    keep_bytes = keep_b;
+    keep_packets = keep_p;
+
+    if (mkdir(segdir, S_IRWXU) == ERROR && errno != EEXIST)
+    {
+        perror(segdir);
+        return ERROR;
+    }
+
+    size_t n;
+    off_t *bases = listsegs(&n);
+    if (bases == NULL)
+        return ERROR;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        struct Segment *seg = segopen(bases[i], false);
+        if (seg == NULL)
+            goto fail;
+
+        // Offsets have to run on from one segment to the next, start over after a gap
+        if (nsegs && segs[nsegs - 1]->base + segs[nsegs - 1]->len != seg->base)
+        {
+            fprintf(stderr, "seglog: segment %lld does not follow on, dropping the ones before it\n",
+                    (long long)seg->base);
+            pthread_mutex_lock(&segs_mtx);
+            while (nsegs)
+            {
+                char path[PATH_MAX];
+                segpath(path, sizeof path, segs[nsegs - 1]->base);
+                unlink(path);
+                segput(segs[--nsegs]);
+            }
+            total_packets = 0;
+            pthread_mutex_unlock(&segs_mtx);
+        }
+        total_packets += seg->packets;
+        if (!segpush(seg))
+        {
+            segput(seg);
+            goto fail;
+        }
+    }
+    free(bases);
+
+    if (nsegs == 0)
+    {
+        struct Segment *seg = segopen(0, true);
+        if (seg == NULL || !segpush(seg))
+            goto fail_open;
+    }
+    // The limits may have tightened since the last run
+    retain();
+
+    enabled = true;
+    DIAG(DIAG_INFO, "seglog: %zu segments holding %lld to %lld", nsegs, (long long)seglog_start(),
+         (long long)seglog_end());
+    return 0;
+
+fail:
+    free(bases);
+fail_open:
+    seglog_close();
+    return ERROR;
+}
+
+void seglog_close(void)
+{
+    pthread_mutex_lock(&segs_mtx);
+    while (nsegs)
+    {
+        struct Segment *seg = segs[--nsegs];
+        fsync(seg->fd);
+        segput(seg);
+    }
+    free(segs);
+    segs = NULL;
+    capsegs = 0;
+    total_packets = 0;
+    enabled = false;
+    pthread_mutex_unlock(&segs_mtx);
+}
+
+bool seglog_enabled(void)
+{
+    return enabled;
+}
+
+off_t seglog_start(void)
+{
+    pthread_mutex_lock(&segs_mtx);
+    off_t start = nsegs ? segs[0]->base : 0;
+    pthread_mutex_unlock(&segs_mtx);
+    return start;
+}
+
+off_t seglog_end(void)
+{
+    pthread_mutex_lock(&segs_mtx);
+    off_t end = nsegs ? segs[nsegs - 1]->base + segs[nsegs - 1]->len : 0;
+    pthread_mutex_unlock(&segs_mtx);
+    return end;
+}
+
+ssize_t seglog_append(const struct iovec *iov, int iovcnt)
+{
+    // Only the appender changes the newest segment, it needs no lock to find it
+    struct Segment *active = segs[nsegs - 1];
+    ssize_t len = writev(active->fd, iov, iovcnt);
+    if (len <= 0)
+        return len;
+
+    off_t packets = 0;
+    if (keep_packets)
+    {
+        size_t left = len;
+        for (int i = 0; i < iovcnt && left; i++)
+        {
+            size_t part = (iov[i].iov_len < left) ? iov[i].iov_len : left;
+            packets += countnewlines(iov[i].iov_base, part);
+            left -= part;
+        }
+    }
+
+    pthread_mutex_lock(&segs_mtx);
+    active->len += len;
+    active->dirty = true;
+    active->packets += packets;
+    total_packets += packets;
+    pthread_mutex_unlock(&segs_mtx);
+
+    if (active->len >= max_bytes || (max_secs && time(NULL) - active->opened >= max_secs))
+    {
+        struct Segment *seg = segopen(active->base + active->len, true);
+        if (seg && !segpush(seg))
+        {
+            pthread_mutex_lock(&segs_mtx);
+            segput(seg);
+            pthread_mutex_unlock(&segs_mtx);
+        }
+        else if (seg)
+            retain();
+        // Without a new segment the current one keeps growing, the next append tries again
+    }
+    return len;
+}
+
+int seglog_sync(void)
+{
+    int rc = 0;
+    for (;;)
+    {
+        // Segments are only appended to at the end, the dirty ones are the newest few
+        pthread_mutex_lock(&segs_mtx);
+        struct Segment *seg = NULL;
+        for (size_t i = nsegs; i-- > 0 && segs[i]->dirty;)
+            seg = segs[i];
+        if (seg)
+        {
+            // Cleared first, so an append racing the sync marks it again
+            seg->dirty = false;
+            seg->refs++;
+        }
+        pthread_mutex_unlock(&segs_mtx);
+        if (seg == NULL)
+            return rc;
+
+        if (fdatasync(seg->fd) == ERROR)
+            rc = ERROR;
+        seglog_unpin(seg);
+    }
+}
+
+struct Segment *seglog_pin(off_t off, int *fd, off_t *local, off_t *left)
+{
+    struct Segment *seg = NULL;
+
+    pthread_mutex_lock(&segs_mtx);
+    // The last segment starting at or before off
+    size_t lo = 0, hi = nsegs;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (segs[mid]->base <= off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0 && off < segs[lo - 1]->base + segs[lo - 1]->len)
+    {
+        seg = segs[lo - 1];
+        seg->refs++;
+        *fd = seg->fd;
+        *local = off - seg->base;
+        *left = seg->len - *local;
+    }
+    pthread_mutex_unlock(&segs_mtx);
+    return seg;
+}
+
+void seglog_unpin(struct Segment *seg)
+{
+    if (seg == NULL)
+        return;
+    pthread_mutex_lock(&segs_mtx);
+    segput(seg);
+    pthread_mutex_unlock(&segs_mtx);
+}
@@ -0,0 +1,78 @@
+/*
+ * seglog.h
+ *
+ *  @brief Size and age bounded segment files holding the aesdsocket log
+ */
+
+#ifndef SEGLOG_H
+#define SEGLOG_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * One segment file, named after the log offset of its first byte
+ */
+struct Segment;
+
+/**
+ * Keep the log as segment files in dir instead of one file, picking up the
+ * segments a previous run left there.
+ * @param seg_bytes is the size at which the segment being appended to is closed
+ * @param seg_secs is the age at which it is closed, 0 for no limit
+ * @param keep_bytes drops the oldest segments while the rest still hold at
+ *  least this many bytes, 0 for no limit
+ * @param keep_packets does the same by the number of packets, 0 for no limit
+ * @return 0 on success, ERROR if the directory or a segment can not be opened
+ */
+int seglog_open(const char *dir, off_t seg_bytes, unsigned seg_secs, off_t keep_bytes, off_t keep_packets);
+
+/**
+ * Close every segment, they stay on disk for the next run
+ */
+void seglog_close(void);
+
+/**
+ * @return true once seglog_open() succeeded
+ */
+bool seglog_enabled(void);
+
+/**
+ * @return the log offset of the oldest byte still kept
+ */
+off_t seglog_start(void);
+
+/**
+ * @return the log offset just past the newest byte
+ */
+off_t seglog_end(void);
+
+/**
+ * Append to the newest segment, closing it and dropping the oldest ones as
+ * the limits ask. The caller serializes appends.
+ * @return the number of bytes written or -1 with errno set
+ */
+ssize_t seglog_append(const struct iovec *iov, int iovcnt);
+
+/**
+ * fdatasync() every segment appended to since the last call, oldest first
+ * @return 0 on success, ERROR if any of them failed
+ */
+int seglog_sync(void);
+
+/**
+ * Find the segment holding log offset off and keep it open until
+ * seglog_unpin(), even if retention drops it meanwhile
+ * @param fd is set to the segment file to read from at *local
+ * @param left is set to the bytes the segment holds from there on
+ * @return the segment, or NULL when off is not kept or not written yet
+ */
+struct Segment *seglog_pin(off_t off, int *fd, off_t *local, off_t *left);
+
+/**
+ * Release a segment returned by seglog_pin(), NULL is ignored
+ */
+void seglog_unpin(struct Segment *seg);
+
+#endif /* SEGLOG_H */
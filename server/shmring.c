@@ -0,0 +1,280 @@
+/**
+ * @file shmring.c
+ * @brief The aesdsocket end of the shared memory ring local producers
+ * append through
+ *
+ * One thread takes committed records off the ring in order and appends up
+ * to SHMRING_BATCH of them to the log with a single writev(), then moves
+ * head past them so producers can reuse the space. It parks on a futex in
+ * the shared page once the ring is empty, producers wake it after their
+ * next commit. The ring lives in memory producers can write, so every
+ * record header is checked before its payload is used; a corrupt ring
+ * stops the ingest instead of the server. Producers are told through the
+ * stopped flag whenever the ingest ends.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "aesdsocket.h"
+#include "aesdring.h"
+#include "diaglog.h"
+#include "shmring.h"
+#include "stats.h"
+
+// Records appended with one writev(), each may need a newline of its own
+#define SHMRING_BATCH 64
+#define SHMRING_DEFAULT_BYTES (4 * 1024 * 1024)
+#define SHMRING_MIN_BYTES (64 * 1024)
+// How long the parked thread sleeps before it looks at the ring anyway
+#define SHMRING_NAP_S 1
+
+static const char *ring_name;
+static size_t capacity;
+static size_t max_packet;
+static struct aesdring_shared *shared;
+static char *data;
+static size_t mapped;
+static pthread_t thread;
+static atomic_int stopping;
+static bool started;
+
+static long futex(atomic_uint *addr, int op, unsigned val, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+int shmring_parse(const char *arg)
+{
+    const char *colon = strchr(arg, ':');
+    unsigned long long bytes = SHMRING_DEFAULT_BYTES;
+    if (colon)
+    {
+        char *end;
+        bytes = strtoull(colon + 1, &end, 0);
+        if (*end != '\0' || bytes == 0 || bytes > (1ull << 40))
+            return ERROR;
+    }
+    if (colon == arg)
+        return ERROR;
+
+    static char name[NAME_MAX];
+    size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+    if (len >= sizeof name - 1)
+        return ERROR;
+    // shm_open() names start with a slash, the one given may leave it out
+    snprintf(name, sizeof name, "%s%.*s", (arg[0] == '/') ? "" : "/", (int)len, arg);
+    ring_name = name;
+
+    capacity = SHMRING_MIN_BYTES;
+    while (capacity < bytes)
+        capacity <<= 1;
+    return 0;
+}
+
+// The record at ring position pos if it is committed, NULL otherwise
+static const struct aesdring_record *committed(uint64_t pos)
+{
+    const struct aesdring_record *rec = (const struct aesdring_record *)(data + (pos & (capacity - 1)));
+    return (atomic_load_explicit(&rec->pos, memory_order_acquire) == pos) ? rec : NULL;
+}
+
+/**
+ * Append the committed records from head on, up to SHMRING_BATCH of them,
+ * and hand their space back to the producers
+ * @return the number of records taken off the ring, pads included, or ERROR
+ *  for a record header no producer could have written
+ */
+static int drain(void)
+{
+    static const char newline = '\n';
+    struct iovec iov[2 * SHMRING_BATCH];
+    int iovcnt = 0;
+    int taken = 0;
+    size_t bytes = 0;
+    unsigned packets = 0;
+
+    uint64_t head = atomic_load_explicit(&shared->head, memory_order_relaxed);
+    uint64_t pos = head;
+    const struct aesdring_record *rec;
+    while (packets < SHMRING_BATCH && (rec = committed(pos)) != NULL)
+    {
+        uint64_t off = pos & (capacity - 1);
+        uint32_t len = rec->len;
+        if (rec->flags & AESDRING_PAD)
+        {
+            if (len != capacity - off)
+                return ERROR;
+            pos += len;
+            taken++;
+            continue;
+        }
+        if (len == 0 || len > max_packet || off + AESDRING_SPACE(len) > capacity)
+            return ERROR;
+
+        const char *payload = (const char *)(rec + 1);
+        iov[iovcnt++] = (struct iovec){.iov_base = (void *)payload, .iov_len = len};
+        // A record is a whole packet, it never runs into whatever is appended next
+        if (payload[len - 1] != '\n')
+            iov[iovcnt++] = (struct iovec){.iov_base = (void *)&newline, .iov_len = 1};
+        bytes += len;
+        packets++;
+        pos += AESDRING_SPACE(len);
+        taken++;
+    }
+
+    if (iovcnt && writelogv(iov, iovcnt) < 0)
+        perror("writev");
+    if (packets)
+    {
+        stat_add(STAT_BYTES_IN, bytes);
+        stat_add(STAT_PACKETS, packets);
+    }
+    if (pos == head)
+        return taken;
+
+    // The payloads are in the log, producers may overwrite them now
+    atomic_store_explicit(&shared->head, pos, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&shared->waiting, memory_order_relaxed) && atomic_exchange(&shared->waiting, 0))
+    {
+        atomic_fetch_add(&shared->headgen, 1);
+        futex(&shared->headgen, FUTEX_WAKE, INT_MAX, NULL);
+    }
+    return taken;
+}
+
+// Refuse further records and wake the producers waiting for space, they find the flag set
+static void stopproducers(void)
+{
+    atomic_store(&shared->stopped, 1);
+    atomic_fetch_add(&shared->headgen, 1);
+    futex(&shared->headgen, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+static void *ring_thread(void *arg)
+{
+    const struct timespec nap = {.tv_sec = SHMRING_NAP_S, .tv_nsec = 0};
+    while (!atomic_load(&stopping))
+    {
+        int taken = drain();
+        if (taken == ERROR)
+            break;
+        if (taken)
+            continue;
+
+        // Empty. Park before looking again so the next commit is sure to wake us
+        atomic_store(&shared->parked, 1);
+        if (committed(atomic_load(&shared->head)) == NULL && !atomic_load(&stopping))
+            futex(&shared->parked, FUTEX_WAIT, 1, &nap);
+        atomic_store(&shared->parked, 0);
+    }
+
+    // Whatever producers committed before the server stopped still goes to the log
+    int taken;
+    while ((taken = drain()) > 0)
+        ;
+    if (taken == ERROR)
+    {
+        stopproducers();
+        DIAG(DIAG_ERROR, "shmring: corrupt record at %llu in %s, ingest stopped",
+             (unsigned long long)atomic_load(&shared->head), ring_name);
+    }
+    return NULL;
+}
+
+static void unmap(void)
+{
+    if (shared)
+    {
+        munmap(shared, mapped);
+        shm_unlink(ring_name);
+    }
+    shared = NULL;
+}
+
+int shmring_start(void)
+{
+    if (ring_name == NULL)
+        return 0;
+
+    // A ring left behind by an earlier run may still have producers attached, they keep the old one
+    shm_unlink(ring_name);
+    int fd = shm_open(ring_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    mapped = AESDRING_DATA + capacity;
+    if (fd < 0 || ftruncate(fd, mapped) < 0)
+    {
+        perror(ring_name);
+        if (fd >= 0)
+        {
+            close(fd);
+            shm_unlink(ring_name);
+        }
+        return ERROR;
+    }
+    void *map = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap");
+        shm_unlink(ring_name);
+        return ERROR;
+    }
+    shared = map;
+    data = (char *)map + AESDRING_DATA;
+    shared->capacity = capacity;
+    max_packet = capacity / 2 - sizeof(struct aesdring_record);
+    shared->max_packet = max_packet;
+    // Position 0 must not look committed in a ring nobody wrote yet
+    ((struct aesdring_record *)data)->pos = UINT64_MAX;
+    atomic_store(&shared->tail, 0);
+    atomic_store(&shared->head, 0);
+    atomic_store(&stopping, 0);
+    // Producers check the magic, it goes in last
+    atomic_thread_fence(memory_order_release);
+    shared->magic = AESDRING_MAGIC;
+
+    // Keep signals on the threads that expect them
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int err = pthread_create(&thread, NULL, ring_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0)
+    {
+        errno = err;
+        perror("pthread_create");
+        unmap();
+        return ERROR;
+    }
+    started = true;
+    DIAG(DIAG_INFO, "shared memory ring %s of %zu bytes", ring_name, capacity);
+    return 0;
+}
+
+void shmring_stop(void)
+{
+    if (started)
+    {
+        // Producers stop first, the thread then appends whatever they committed
+        stopproducers();
+        atomic_store(&stopping, 1);
+        atomic_store(&shared->parked, 0);
+        futex(&shared->parked, FUTEX_WAKE, 1, NULL);
+        pthread_join(thread, NULL);
+        started = false;
+    }
+    unmap();
+}
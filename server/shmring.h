@@ -0,0 +1,30 @@
+/*
+ * shmring.h
+ *
+ *  @brief The aesdsocket end of the shared memory ring local producers
+ *  append through, see aesdring.h
+ */
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+/**
+ * Parse a -M argument: name[:bytes], bytes of data area rounded up to a
+ * power of two
+ * @return 0 on success, ERROR when arg is malformed
+ */
+int shmring_parse(const char *arg);
+
+/**
+ * Create the ring given with -M, if any, and start the thread appending
+ * what producers commit to it
+ * @return 0 on success, ERROR if the ring or the thread could not be set up
+ */
+int shmring_start(void);
+
+/**
+ * Append what is committed, stop the thread and remove the ring
+ */
+void shmring_stop(void);
+
+#endif /* SHMRING_H */
@@ -0,0 +1,82 @@
+/**
+ * @file slab.c
+ * @brief Pool of fixed size objects for per connection state
+ *
+ * A chunk is a header followed by perchunk objects. New chunks only come
+ * when the free list is empty, so after a burst the pool keeps its chunks
+ * and serves the next burst from them.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+#include "aesdsocket.h"
+#include "slab.h"
+
+// Aim for chunks of about this many bytes, at least one object each
+#define SLAB_CHUNK_BYTES (64 * 1024)
+#define SLAB_ALIGN alignof(max_align_t)
+
+struct SlabChunk
+{
+    struct SlabChunk *next;
+    alignas(SLAB_ALIGN) char objs[];
+};
+
+void slab_init(struct Slab *slab, size_t size)
+{
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+    slab->size = (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    slab->perchunk = (slab->size < SLAB_CHUNK_BYTES) ? SLAB_CHUNK_BYTES / slab->size : 1;
+    slab->free = NULL;
+    slab->chunks = NULL;
+    slab->live = 0;
+}
+
+// Add a chunk and put all of its objects on the free list
+static int grow(struct Slab *slab)
+{
+    struct SlabChunk *chunk = malloc(sizeof *chunk + slab->perchunk * slab->size);
+    if (chunk == NULL)
+        return ERROR;
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+    for (size_t i = slab->perchunk; i-- > 0;)
+    {
+        void *obj = chunk->objs + i * slab->size;
+        *(void **)obj = slab->free;
+        slab->free = obj;
+    }
+    return 0;
+}
+
+void *slab_alloc(struct Slab *slab)
+{
+    if (slab->free == NULL && grow(slab) == ERROR)
+        return NULL;
+    void *obj = slab->free;
+    slab->free = *(void **)obj;
+    slab->live++;
+    memset(obj, 0, slab->size);
+    return obj;
+}
+
+void slab_free(struct Slab *slab, void *obj)
+{
+    *(void **)obj = slab->free;
+    slab->free = obj;
+    slab->live--;
+}
+
+void slab_destroy(struct Slab *slab)
+{
+    while (slab->chunks)
+    {
+        struct SlabChunk *next = slab->chunks->next;
+        free(slab->chunks);
+        slab->chunks = next;
+    }
+    slab->free = NULL;
+    slab->live = 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * slab.h
+ *
+ *  @brief Pool of fixed size objects for per connection state
+ *
+ * Objects are carved from chunks allocated as the pool grows and go back to
+ * a free list when released, so a busy server reuses the same memory for
+ * every new connection instead of going through malloc() each time, and
+ * holds no more than its peak number of live objects. A slab is not locked,
+ * its owner serializes calls.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+struct SlabChunk;
+
+struct Slab
+{
+    size_t size;              // bytes per object, rounded up to keep every object aligned
+    size_t perchunk;          // objects carved from each chunk
+    void *free;               // released objects, linked through their first word
+    struct SlabChunk *chunks; // every chunk allocated, freed by slab_destroy()
+    size_t live;              // objects handed out and not released yet
+};
+
+/**
+ * Set up an empty pool of objects of size bytes, nothing is allocated yet
+ */
+void slab_init(struct Slab *slab, size_t size);
+
+/**
+ * @return a zeroed object, or NULL with errno set when memory ran out
+ */
+void *slab_alloc(struct Slab *slab);
+
+/**
+ * Give obj, which came from slab_alloc() on the same slab, back to the pool
+ */
+void slab_free(struct Slab *slab, void *obj);
+
+/**
+ * Free every chunk, objects still live included
+ */
+void slab_destroy(struct Slab *slab);
+
+#endif /* SLAB_H */
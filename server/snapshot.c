@@ -0,0 +1,102 @@
+/**
+ * @file snapshot.c
+ * @brief Shared, generation tagged in-memory copies of the aesdsocket log
+ *
+ * The log generation counts committed appends. The cache keeps the newest
+ * snapshot and hands out references to it for as long as the generation it
+ * was taken at is current, so the log is read once per generation however
+ * many replies are due.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "aesdsocket.h"
+#include "diaglog.h"
+#include "snapshot.h"
+
+static atomic_size_t live_bytes;
+static struct Snapshot *cached;
+static pthread_mutex_t cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static struct Snapshot *snapshot_read(uint64_t gen)
+{
+    off_t base = logstart();
+    off_t size = logsize() - base;
+    if (size > SNAPSHOT_MAX)
+        return NULL;
+    if (atomic_fetch_add(&live_bytes, size) + size > SNAPSHOT_BUDGET)
+    {
+        atomic_fetch_sub(&live_bytes, size);
+        return NULL;
+    }
+
+    struct Snapshot *snap = malloc(sizeof(struct Snapshot) + size);
+    if (snap == NULL)
+    {
+        perror("malloc");
+        atomic_fetch_sub(&live_bytes, size);
+        return NULL;
+    }
+
+    // The char device and segments hand out the log in pieces, read until it has nothing more
+    size_t len = 0;
+    while (len < (size_t)size)
+    {
+        ssize_t got = logread(snap->data + len, size - len, base + len);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        len += got;
+    }
+
+    atomic_init(&snap->refs, 1);
+    snap->gen = gen;
+    snap->base = base;
+    snap->len = len;
+    DIAG(DIAG_DEBUG, "snapshot of %zu bytes at generation %llu", len, (unsigned long long)gen);
+    // Account for what was read, the log may have shrunk under the read
+    atomic_fetch_sub(&live_bytes, size - len);
+    return snap;
+}
+
+struct Snapshot *snapshot_get(void)
+{
+    pthread_mutex_lock(&cache_mtx);
+
+    // The generation is read before the log, an append racing the read only
+    // makes the copy newer than its tag and the next caller reads again
+    uint64_t gen = loggeneration();
+    if (cached == NULL || cached->gen != gen)
+    {
+        snapshot_put(cached);
+        cached = snapshot_read(gen);
+    }
+
+    struct Snapshot *snap = cached;
+    if (snap)
+        atomic_fetch_add(&snap->refs, 1);
+
+    pthread_mutex_unlock(&cache_mtx);
+    return snap;
+}
+
+void snapshot_put(struct Snapshot *snap)
+{
+    if (snap && atomic_fetch_sub(&snap->refs, 1) == 1)
+    {
+        atomic_fetch_sub(&live_bytes, snap->len);
+        free(snap);
+    }
+}
+
+void snapshot_clear(void)
+{
+    pthread_mutex_lock(&cache_mtx);
+    snapshot_put(cached);
+    cached = NULL;
+    pthread_mutex_unlock(&cache_mtx);
+}
@@ -0,0 +1,54 @@
+/*
+ * snapshot.h
+ *
+ *  @brief Shared, generation tagged in-memory copies of the aesdsocket log
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Largest log that is copied into a snapshot, replies to larger logs stream from the log itself
+#define SNAPSHOT_MAX (1024 * 1024)
+// Most memory all live snapshots may take together, beyond it replies stream from the log
+#define SNAPSHOT_BUDGET (16 * 1024 * 1024)
+
+/**
+ * An immutable copy of the whole log, or of what retention kept of it.
+ * Replies hold a reference while they
+ * send from it; the cache holds one for the newest snapshot.
+ */
+struct Snapshot
+{
+    atomic_int refs;
+    uint64_t gen; // log generation the copy is at least as new as
+    off_t base;   // log offset of data[0]
+    size_t len;
+    char data[];
+};
+
+/**
+ * Get a snapshot that holds every append committed before the call. All
+ * callers between two appends share one snapshot and the log is read only
+ * once for them, the first caller reads while the others wait for it.
+ * @return a reference to drop with snapshot_put(), or NULL when the log is
+ *  too large to copy or the budget is used up, the caller then streams the
+ *  reply from the log
+ */
+struct Snapshot *snapshot_get(void);
+
+/**
+ * Drop a reference to snap, NULL is ignored
+ */
+void snapshot_put(struct Snapshot *snap);
+
+/**
+ * Drop the cached snapshot
+ */
+void snapshot_clear(void);
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,455 @@
+/**
+ * @file stats.c
+ * @brief Live counters and latency histograms of the aesdsocket hot path
+ *
+ * Histograms are log-linear: every power of two of nanoseconds is split in
+ * STAT_SUB linear buckets, so a recorded duration is off by at most 1/16th
+ * and recording is a count leading zeros and two adds. A shard is only ever
+ * written by its owner thread, with relaxed atomics so a scrape may read it
+ * meanwhile. When the owner exits its shard is folded into the totals of
+ * the threads gone before it, so counts never go backwards.
+ *
+ * One stats thread waits in poll() on a signalfd for SIGUSR1, the admin
+ * socket and an eventfd that stops it. An admin client sends the command
+ * "stats" on a line and gets the exposition back before the socket closes,
+ * or "trace" and gets the spans of sampled requests as Chrome trace JSON.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include "aesdsocket.h"
+#include "stats.h"
+#include "admit.h"
+#include "writer.h"
+#include "trace.h"
+
+// Linear buckets per power of two
+#define STAT_SUB_BITS 4
+#define STAT_SUB (1 << STAT_SUB_BITS)
+// Durations are clamped below 2^STAT_MAX_BITS ns, about 68 seconds
+#define STAT_MAX_BITS 36
+#define STAT_BUCKETS ((STAT_MAX_BITS - STAT_SUB_BITS + 1) * STAT_SUB)
+// The first octave given its own le bucket in the exposition, about a microsecond
+#define STAT_MIN_OCTAVE 10
+// How long an admin client may take to send its command
+#define STAT_ADMIN_TIMEOUT_MS 1000
+
+struct StatShard
+{
+    struct StatShard *next; // guarded by shards_mtx
+    atomic_uint_fast64_t counters[STAT_COUNTERS];
+    atomic_uint_fast64_t sums[STAT_HISTS]; // nanoseconds
+    atomic_uint_fast64_t buckets[STAT_HISTS][STAT_BUCKETS];
+};
+
+struct StatHistInfo
+{
+    const char *name;
+    const char *help;
+};
+
+static const struct StatHistInfo hists[STAT_HISTS] = {
+    [STAT_RECV] = {"aesd_recv_seconds", "Time to handle one received chunk"},
+    [STAT_LOCKWAIT] = {"aesd_log_lock_wait_seconds", "Time waiting for the log lock before an append"},
+    [STAT_APPEND] = {"aesd_append_seconds", "Time of one append to the log backend"},
+    [STAT_SEEK] = {"aesd_seek_seconds", "Time to resolve a seek command"},
+    [STAT_REPLY] = {"aesd_reply_seconds", "Time from a reply's start to its last byte sent"},
+};
+
+static const struct StatHistInfo counters[STAT_COUNTERS] = {
+    [STAT_BYTES_IN] = {"aesd_received_bytes_total", "Bytes received from clients"},
+    [STAT_BYTES_OUT] = {"aesd_sent_bytes_total", "Bytes of replies and subscriptions sent to clients"},
+    [STAT_PACKETS] = {"aesd_packets_total", "Packets and frames received complete"},
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static pthread_mutex_t shards_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct StatShard *shards; // guarded by shards_mtx, as is retired
+static struct StatShard retired;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static __thread struct StatShard *myshard;
+
+static int stopfd = ERROR;
+static int sigfd = ERROR;
+static int adminfd = ERROR;
+static const char *admin_path;
+static pthread_t thread;
+static bool started;
+
+static unsigned histindex(uint64_t ns)
+{
+    if (ns >= (1ull << STAT_MAX_BITS))
+        ns = (1ull << STAT_MAX_BITS) - 1;
+    if (ns < STAT_SUB)
+        return ns;
+    unsigned shift = 63 - __builtin_clzll(ns) - STAT_SUB_BITS;
+    return (shift + 1) * STAT_SUB + (unsigned)(ns >> shift) - STAT_SUB;
+}
+
+// Largest duration that lands in bucket i
+static uint64_t histupper(unsigned i)
+{
+    if (i < STAT_SUB)
+        return i;
+    unsigned shift = i / STAT_SUB - 1;
+    return ((uint64_t)(i % STAT_SUB + STAT_SUB + 1) << shift) - 1;
+}
+
+// Fold a shard into dst, with shards_mtx held
+static void fold(struct StatShard *dst, struct StatShard *src)
+{
+    for (int c = 0; c < STAT_COUNTERS; c++)
+        atomic_fetch_add_explicit(&dst->counters[c], atomic_load_explicit(&src->counters[c], memory_order_relaxed),
+                                  memory_order_relaxed);
+    for (int h = 0; h < STAT_HISTS; h++)
+    {
+        atomic_fetch_add_explicit(&dst->sums[h], atomic_load_explicit(&src->sums[h], memory_order_relaxed),
+                                  memory_order_relaxed);
+        for (int b = 0; b < STAT_BUCKETS; b++)
+            atomic_fetch_add_explicit(&dst->buckets[h][b],
+                                      atomic_load_explicit(&src->buckets[h][b], memory_order_relaxed),
+                                      memory_order_relaxed);
+    }
+}
+
+// The owner exited, keep what it counted and drop the shard
+static void retire(void *arg)
+{
+    struct StatShard *shard = arg;
+    pthread_mutex_lock(&shards_mtx);
+    struct StatShard **link = &shards;
+    while (*link != shard)
+        link = &(*link)->next;
+    *link = shard->next;
+    fold(&retired, shard);
+    pthread_mutex_unlock(&shards_mtx);
+    free(shard);
+}
+
+static void makekey(void)
+{
+    if (pthread_key_create(&shard_key, retire) != 0)
+        perror("pthread_key_create");
+}
+
+static struct StatShard *getshard(void)
+{
+    if (myshard)
+        return myshard;
+
+    struct StatShard *shard = calloc(1, sizeof(struct StatShard));
+    if (shard == NULL)
+        return NULL;
+
+    pthread_once(&key_once, makekey);
+    pthread_mutex_lock(&shards_mtx);
+    shard->next = shards;
+    shards = shard;
+    pthread_mutex_unlock(&shards_mtx);
+
+    pthread_setspecific(shard_key, shard);
+    myshard = shard;
+    return shard;
+}
+
+uint64_t stat_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Only the owner writes a shard, a plain load and store is enough
+static void bump(atomic_uint_fast64_t *v, uint64_t n)
+{
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void stat_add(enum StatCounter c, uint64_t n)
+{
+    struct StatShard *shard = getshard();
+    if (shard)
+        bump(&shard->counters[c], n);
+}
+
+void stat_time(enum StatHist h, uint64_t ns)
+{
+    struct StatShard *shard = getshard();
+    if (shard == NULL)
+        return;
+    bump(&shard->buckets[h][histindex(ns)], 1);
+    bump(&shard->sums[h], ns);
+}
+
+// Sum every shard, the ones alive and the ones retired
+static void collect(struct StatShard *total)
+{
+    memset(total, 0, sizeof *total);
+    pthread_mutex_lock(&shards_mtx);
+    fold(total, &retired);
+    for (struct StatShard *shard = shards; shard; shard = shard->next)
+        fold(total, shard);
+    pthread_mutex_unlock(&shards_mtx);
+}
+
+static double quantile(const atomic_uint_fast64_t *buckets, uint64_t count, double q)
+{
+    uint64_t rank = (uint64_t)(q * count);
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < STAT_BUCKETS; b++)
+    {
+        seen += buckets[b];
+        if (seen > rank)
+            return histupper(b) / 1e9;
+    }
+    return histupper(STAT_BUCKETS - 1) / 1e9;
+}
+
+static void exposehist(FILE *out, const struct StatHistInfo *info, const atomic_uint_fast64_t *buckets, uint64_t sum)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", info->name, info->help, info->name);
+
+    // The le bounds fall on octaves, where the linear buckets of the next one start
+    uint64_t count = 0;
+    unsigned b = 0;
+    for (unsigned octave = STAT_MIN_OCTAVE; octave <= STAT_MAX_BITS; octave++)
+    {
+        for (unsigned upto = histindex((1ull << octave) - 1); b <= upto; b++)
+            count += buckets[b];
+        fprintf(out, "%s_bucket{le=\"%.9g\"} %llu\n", info->name, (double)(1ull << octave) / 1e9,
+                (unsigned long long)count);
+    }
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", info->name, (unsigned long long)count);
+    fprintf(out, "%s_sum %.9f\n%s_count %llu\n", info->name, sum / 1e9, info->name, (unsigned long long)count);
+
+    fprintf(out, "# HELP %s_quantile Estimated quantiles of %s\n# TYPE %s_quantile gauge\n", info->name, info->name,
+            info->name);
+    for (size_t q = 0; q < sizeof quantiles / sizeof *quantiles; q++)
+        fprintf(out, "%s_quantile{quantile=\"%g\"} %.9g\n", info->name, quantiles[q],
+                count ? quantile(buckets, count, quantiles[q]) : 0.0);
+}
+
+static void exposegauge(FILE *out, const char *name, const char *type, const char *help, unsigned long long value)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name, value);
+}
+
+// Write the Prometheus text exposition of everything recorded so far
+static void expose(FILE *out)
+{
+    struct StatShard *total = malloc(sizeof *total);
+    if (total == NULL)
+        return;
+    collect(total);
+
+    for (int c = 0; c < STAT_COUNTERS; c++)
+        exposegauge(out, counters[c].name, "counter", counters[c].help, total->counters[c]);
+    for (int h = 0; h < STAT_HISTS; h++)
+        exposehist(out, &hists[h], total->buckets[h], total->sums[h]);
+    free(total);
+
+    struct AdmitStats admit;
+    admit_stats(&admit);
+    exposegauge(out, "aesd_connections", "gauge", "Connections open", admit.live);
+    exposegauge(out, "aesd_connections_refused_total", "counter", "Connections closed at accept for a cap",
+                admit.refused);
+    exposegauge(out, "aesd_clients", "gauge", "Peer addresses tracked for their connections or rate", admit.clients);
+    exposegauge(out, "aesd_throttled_total", "counter", "Times a client overran its rate", admit.throttled);
+    exposegauge(out, "aesd_backpressured_total", "counter",
+                "Times a connection stopped reading for the log backlog", admit.backpressured);
+    exposegauge(out, "aesd_oversized_packets_total", "counter",
+                "Partial packets spilled to the log unfinished, or binary frames refused, for their length",
+                admit.oversized);
+    exposegauge(out, "aesd_partial_bytes", "gauge", "Bytes held in packets still missing their end", admit.partial);
+    exposegauge(out, "aesd_writer_queued_bytes", "gauge", "Bytes of appends waiting for the writer thread",
+                writer_running() ? writer_queued() : 0);
+    exposegauge(out, "aesd_log_bytes", "gauge", "End offset of the log", logsize());
+}
+
+static void dump(void)
+{
+    expose(stdout);
+    fflush(stdout);
+}
+
+// Answer one admin client, which gets a bounded time to send its command
+static void serve(int fd)
+{
+    char cmd[64];
+    size_t got = 0;
+    while (got < sizeof cmd - 1 && memchr(cmd, '\n', got) == NULL)
+    {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, STAT_ADMIN_TIMEOUT_MS) <= 0)
+            return;
+        ssize_t n = recv(fd, cmd + got, sizeof cmd - 1 - got, MSG_DONTWAIT);
+        if (n == 0)
+            break;
+        if (n < 0 && errno != EAGAIN && errno != EINTR)
+            return;
+        if (n > 0)
+            got += n;
+    }
+    cmd[got] = '\0';
+    cmd[strcspn(cmd, "\r\n")] = '\0';
+
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (out == NULL)
+        return;
+    if (strcmp(cmd, "stats") == 0)
+        expose(out);
+    else if (strcmp(cmd, "trace") == 0)
+        trace_write(out);
+    else
+        fprintf(out, "error: unknown command \"%s\", try stats or trace\n", cmd);
+    fclose(out);
+
+    for (size_t sent = 0; sent < len;)
+    {
+        ssize_t n = send(fd, text + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    free(text);
+}
+
+static void *stats_thread(void *arg)
+{
+    struct pollfd fds[3] = {
+        {.fd = stopfd, .events = POLLIN},
+        {.fd = sigfd, .events = POLLIN},
+        {.fd = adminfd, .events = POLLIN}, // ignored by poll() while there is no admin socket
+    };
+    for (;;)
+    {
+        if (poll(fds, 3, -1) == ERROR)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return NULL;
+        }
+        if (fds[0].revents)
+            return NULL;
+        if (fds[1].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            if (read(sigfd, &info, sizeof info) == sizeof info)
+                dump();
+        }
+        if (fds[2].revents & POLLIN)
+        {
+            int fd = accept(adminfd, NULL, NULL);
+            if (fd != ERROR)
+            {
+                serve(fd);
+                close(fd);
+            }
+        }
+    }
+}
+
+static int openadmin(const char *path)
+{
+    int fd = openlocal(path, 4);
+    // Nonblocking, a client gone between poll() and accept() must not stall the thread
+    if (fd != ERROR && fcntl(fd, F_SETFL, O_NONBLOCK) == ERROR)
+    {
+        perror("fcntl");
+        close(fd);
+        unlink(path);
+        return ERROR;
+    }
+    return fd;
+}
+
+void stats_blocksignal(void)
+{
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+}
+
+// Close whatever stats_start() opened
+static void closeall(void)
+{
+    if (adminfd != ERROR)
+    {
+        close(adminfd);
+        unlink(admin_path);
+    }
+    if (sigfd != ERROR)
+        close(sigfd);
+    if (stopfd != ERROR)
+        close(stopfd);
+    adminfd = sigfd = stopfd = ERROR;
+}
+
+int stats_start(const char *path)
+{
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    stopfd = eventfd(0, EFD_CLOEXEC);
+    sigfd = signalfd(-1, &usr1, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (stopfd == ERROR || sigfd == ERROR)
+    {
+        perror("stats");
+        closeall();
+        return ERROR;
+    }
+    admin_path = path;
+    if (path && (adminfd = openadmin(path)) == ERROR)
+    {
+        closeall();
+        return ERROR;
+    }
+
+    // Keep signals on the threads that expect them
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int err = pthread_create(&thread, NULL, stats_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0)
+    {
+        errno = err;
+        perror("pthread_create");
+        closeall();
+        return ERROR;
+    }
+    started = true;
+    return 0;
+}
+
+void stats_stop(void)
+{
+    if (started)
+    {
+        eventfd_write(stopfd, 1);
+        pthread_join(thread, NULL);
+        started = false;
+    }
+    closeall();
+}
@@ -0,0 +1,70 @@
+/*
+ * stats.h
+ *
+ *  @brief Live counters and latency histograms of the aesdsocket hot path
+ *
+ * Every thread that records gets its own shard, so recording is a relaxed
+ * add to memory no other thread writes. A scrape sums the shards. The sums
+ * are written out in the Prometheus text exposition format to clients of
+ * the admin socket and to stdout on SIGUSR1.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum StatCounter
+{
+    STAT_BYTES_IN,  // bytes received from clients
+    STAT_BYTES_OUT, // reply and subscription bytes sent to clients
+    STAT_PACKETS,   // packets and frames completed
+    STAT_COUNTERS,
+};
+
+enum StatHist
+{
+    STAT_RECV,     // handling one received chunk
+    STAT_LOCKWAIT, // waiting for the log lock before an append
+    STAT_APPEND,   // one append to the log backend
+    STAT_SEEK,     // resolving a seek command, the driver ioctl on chardev
+    STAT_REPLY,    // a reply from its first byte resolved to its last sent
+    STAT_HISTS,
+};
+
+/**
+ * Add n to counter c of the calling thread
+ */
+void stat_add(enum StatCounter c, uint64_t n);
+
+/**
+ * Record a duration of ns nanoseconds in histogram h of the calling thread
+ */
+void stat_time(enum StatHist h, uint64_t ns);
+
+/**
+ * @return the monotonic clock in nanoseconds, the time base of stat_time()
+ */
+uint64_t stat_now(void);
+
+/**
+ * Block SIGUSR1 in the calling thread, to be called from main before any
+ * other thread is started so every thread inherits it. The stats thread
+ * takes the signal from a signalfd instead.
+ */
+void stats_blocksignal(void);
+
+/**
+ * Start the stats thread, which dumps the exposition on SIGUSR1 and serves
+ * it on the Unix socket at admin_path when that is not NULL
+ * @return 0 on success, ERROR if the socket or the thread could not be set up
+ */
+int stats_start(const char *admin_path);
+
+/**
+ * Stop the stats thread and remove the admin socket
+ */
+void stats_stop(void);
+
+#endif /* STATS_H */
@@ -0,0 +1,94 @@
+/*
+ * store.h
+ *
+ *  @brief Storage backends that can hold the aesdsocket log
+ *
+ * Every backend keeps the log as one run of bytes addressed by absolute
+ * offsets: start() is the oldest byte still kept and size() is one past the
+ * newest, both only ever grow. aesdsocket picks one backend at startup and
+ * reaches it only through the log helpers in aesdsocket.h.
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "aesd_ioctl.h"
+
+#define STORE_FILE_PATH "/var/tmp/aesdsocketdata"
+#define STORE_SEGMENT_DIR "/var/tmp/aesdsocketdata.d"
+
+struct Segment;
+
+struct StoreConfig
+{
+    const char *arg;     // what followed the backend name and a colon on the command line, or NULL
+    off_t seg_bytes;     // file: keep the log as segments of this size, 0 for a single file
+    unsigned seg_secs;   // file: and start a new segment at this age, 0 for no limit
+    off_t keep_bytes;    // file: segment retention, see seglog_open()
+    off_t keep_packets;
+};
+
+struct Store
+{
+    const char *name;
+    bool entry_per_write; // every write becomes one entry of the log, so packets never share a write
+
+    /**
+     * @return 0 on success, ERROR with the reason printed
+     */
+    int (*open)(const struct StoreConfig *cfg);
+
+    /**
+     * Sync what the backend can and release it
+     */
+    void (*close)(void);
+
+    /**
+     * Append iov at the end of the log, called with log_mtx held
+     * @return the number of bytes appended or -1 with errno set
+     */
+    ssize_t (*append)(const struct iovec *iov, int iovcnt);
+
+    off_t (*start)(void);
+    off_t (*size)(void);
+
+    /**
+     * pread() len bytes at log offset off
+     * @return the number of bytes read, which may stop short at a segment or
+     *  ring boundary, 0 outside [start(), size()), or -1 with errno set
+     */
+    ssize_t (*read)(void *buf, size_t len, off_t off);
+
+    /**
+     * Find a descriptor to read log offset off from, see logpin(). NULL when
+     * the log does not live in a file, readers then go through read().
+     */
+    int (*pin)(off_t off, off_t *local, off_t *left, struct Segment **seg);
+    void (*unpin)(struct Segment *seg);
+
+    /**
+     * Resolve an AESDCHAR_IOCSEEKTO request
+     * @return the log offset, or ERROR when no such packet or offset exists
+     */
+    off_t (*seek)(const struct aesd_seekto *seekto);
+
+    /**
+     * fdatasync() the log, NULL when the backend holds nothing on disk
+     */
+    int (*sync)(void);
+
+    /**
+     * @return a descriptor opened O_APPEND that io_uring may queue appends
+     *  to, or ERROR when appends have to go through append()
+     */
+    int (*appendfd)(void);
+};
+
+extern const struct Store file_store;
+extern const struct Store chardev_store;
+extern const struct Store memory_store;
+
+#endif /* STORE_H */
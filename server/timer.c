@@ -0,0 +1,170 @@
+/**
+ * @file timer.c
+ * @brief Periodic jobs run on one timer thread instead of from signal handlers
+ *
+ * Every job owns a timerfd and the thread sleeps in epoll_wait() on all of
+ * them plus an eventfd that stops it. Jobs run in an ordinary thread, so
+ * they may take locks and do I/O, and no blocking call anywhere else in the
+ * server is interrupted by a timer signal.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "aesdsocket.h"
+#include "timer.h"
+
+// Most jobs registered at once
+#define TIMER_JOBS 16
+
+struct TimerJob
+{
+    int fd;
+    timer_fn fn;
+    void *arg;
+};
+
+static pthread_mutex_t jobs_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct TimerJob jobs[TIMER_JOBS]; // guarded by jobs_mtx, as is everything below
+static int njobs;
+static int epfd = ERROR;
+static int stopfd = ERROR;
+static pthread_t thread;
+static bool started;
+
+// Create the epoll set and the stop eventfd on first use, called with jobs_mtx held
+static int setup(void)
+{
+    if (epfd != ERROR)
+        return 0;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    stopfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epfd == ERROR || stopfd == ERROR || epoll_ctl(epfd, EPOLL_CTL_ADD, stopfd, &ev) == ERROR)
+    {
+        perror("timer");
+        if (epfd != ERROR)
+            close(epfd);
+        if (stopfd != ERROR)
+            close(stopfd);
+        epfd = stopfd = ERROR;
+        return ERROR;
+    }
+    return 0;
+}
+
+int timer_add(unsigned interval_ms, timer_fn fn, void *arg)
+{
+    pthread_mutex_lock(&jobs_mtx);
+    if (setup() == ERROR || njobs == TIMER_JOBS)
+    {
+        if (njobs == TIMER_JOBS)
+            fprintf(stderr, "timer: too many jobs\n");
+        pthread_mutex_unlock(&jobs_mtx);
+        return ERROR;
+    }
+
+    struct TimerJob *job = &jobs[njobs];
+    job->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    struct itimerspec spec = {
+        .it_interval = {.tv_sec = interval_ms / 1000, .tv_nsec = (interval_ms % 1000) * 1000000L},
+    };
+    spec.it_value = spec.it_interval;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = job};
+    if (job->fd == ERROR || timerfd_settime(job->fd, 0, &spec, NULL) == ERROR ||
+        epoll_ctl(epfd, EPOLL_CTL_ADD, job->fd, &ev) == ERROR)
+    {
+        perror("timerfd");
+        if (job->fd != ERROR)
+            close(job->fd);
+        pthread_mutex_unlock(&jobs_mtx);
+        return ERROR;
+    }
+    job->fn = fn;
+    job->arg = arg;
+    njobs++;
+    pthread_mutex_unlock(&jobs_mtx);
+    return 0;
+}
+
+static void *timer_thread(void *arg)
+{
+    struct epoll_event evs[TIMER_JOBS + 1];
+    for (;;)
+    {
+        int n = epoll_wait(epfd, evs, TIMER_JOBS + 1, -1);
+        if (n == ERROR && errno != EINTR)
+        {
+            perror("epoll_wait");
+            return NULL;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            struct TimerJob *job = evs[i].data.ptr;
+            if (job == NULL)
+                return NULL;
+
+            // The expiration count is of no interest, a late job runs once
+            uint64_t expirations;
+            if (read(job->fd, &expirations, sizeof expirations) == sizeof expirations)
+                job->fn(job->arg);
+        }
+    }
+}
+
+int timer_start(void)
+{
+    pthread_mutex_lock(&jobs_mtx);
+    if (setup() == ERROR)
+    {
+        pthread_mutex_unlock(&jobs_mtx);
+        return ERROR;
+    }
+
+    // Keep signals on the threads that expect them
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int err = pthread_create(&thread, NULL, timer_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0)
+    {
+        pthread_mutex_unlock(&jobs_mtx);
+        errno = err;
+        perror("pthread_create");
+        return ERROR;
+    }
+    started = true;
+    pthread_mutex_unlock(&jobs_mtx);
+    return 0;
+}
+
+void timer_stop(void)
+{
+    pthread_mutex_lock(&jobs_mtx);
+    if (started)
+    {
+        eventfd_write(stopfd, 1);
+        pthread_mutex_unlock(&jobs_mtx);
+        pthread_join(thread, NULL);
+        pthread_mutex_lock(&jobs_mtx);
+        started = false;
+    }
+    for (int i = 0; i < njobs; i++)
+        close(jobs[i].fd);
+    njobs = 0;
+    if (epfd != ERROR)
+    {
+        close(epfd);
+        close(stopfd);
+        epfd = stopfd = ERROR;
+    }
+    pthread_mutex_unlock(&jobs_mtx);
+}
@@ -0,0 +1,31 @@
+/*
+ * timer.h
+ *
+ *  @brief Periodic jobs run on one timer thread instead of from signal handlers
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+typedef void (*timer_fn)(void *arg);
+
+/**
+ * Run fn(arg) every interval_ms milliseconds on the timer thread, starting
+ * interval_ms from now. Jobs may be added before or after timer_start().
+ * A job that runs late is run once, not once for every interval it missed.
+ * @return 0 on success, ERROR when the timer could not be set up
+ */
+int timer_add(unsigned interval_ms, timer_fn fn, void *arg);
+
+/**
+ * Start the timer thread
+ * @return 0 on success, ERROR if the thread could not be started
+ */
+int timer_start(void);
+
+/**
+ * Stop the timer thread, waiting for a job in progress, and drop every job
+ */
+void timer_stop(void);
+
+#endif /* TIMER_H */
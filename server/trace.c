@@ -0,0 +1,229 @@
+/**
+ * @file trace.c
+ * @brief Sampled per-request tracing exported as Chrome trace event JSON
+ *
+ * Every thread that records a span owns a ring of TRACE_SLOTS spans and
+ * overwrites the oldest once it is full, so a trace always shows the latest
+ * requests. Rings are written without locks: a slot carries a sequence
+ * number that is odd while its owner rewrites it, and a reader keeps a span
+ * only if the number was the same even value before and after reading it.
+ * A ring whose owner exited keeps its spans until another thread takes it
+ * over, so requests of closed connections stay in the trace.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include "aesdsocket.h"
+#include "trace.h"
+
+// Spans a ring keeps
+#define TRACE_SLOTS 1024
+// Rings there may be at once, threads beyond that many record nothing
+#define TRACE_RINGS 256
+#define TRACE_DEFAULT_PATH "/var/tmp/aesdsocket-trace.json"
+
+struct TraceSlot
+{
+    atomic_uint_fast64_t seq; // 2 * index + 2 once span index is in place, odd while it is written
+    atomic_uint_fast64_t id;
+    atomic_uint_fast64_t start_ns;
+    atomic_uint_fast64_t dur_ns;
+    atomic_uint_fast64_t tid_stage; // thread ID above the low 8 bits, the stage in them
+};
+
+struct TraceRing
+{
+    struct TraceRing *next; // guarded by rings_mtx
+    atomic_int owned;       // a live thread records into the ring
+    atomic_uint_fast64_t head; // spans recorded so far
+    struct TraceSlot slots[TRACE_SLOTS];
+};
+
+unsigned trace_sample;
+__thread uint64_t trace_current;
+
+static const char *const stage_names[TRACE_STAGES] = {
+    [TRACE_RECV] = "recv",
+    [TRACE_LOCKWAIT] = "log lock",
+    [TRACE_APPEND] = "append",
+    [TRACE_RESOLVE] = "resolve",
+    [TRACE_SEEK] = "seek",
+    [TRACE_SEND] = "send",
+    [TRACE_REPLY] = "reply",
+};
+
+static const char *trace_path;
+static atomic_uint_fast64_t last_id;
+static atomic_ulong dropped; // spans of threads that found no ring
+static pthread_mutex_t rings_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct TraceRing *rings; // guarded by rings_mtx, as is nrings
+static unsigned nrings;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread struct TraceRing *myring;
+static __thread unsigned mytid;
+
+int trace_parse(const char *arg)
+{
+    char *end;
+    trace_sample = strtoul(arg, &end, 0);
+    trace_path = TRACE_DEFAULT_PATH;
+    if (end == arg)
+        return ERROR;
+    if (*end == ':' && end[1] != '\0')
+        trace_path = end + 1;
+    else if (*end != '\0')
+        return ERROR;
+    return 0;
+}
+
+uint64_t trace_next(void)
+{
+    // Each thread starts at a random point of the cycle. From 0, the first
+    // chunk of every thread, so of every connection in the thread model,
+    // would be traced.
+    static __thread unsigned seen;
+    static __thread bool seeded;
+    if (!seeded)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        unsigned seed = (unsigned)ts.tv_nsec ^ (unsigned)syscall(SYS_gettid);
+        seen = 1 + rand_r(&seed) % trace_sample;
+        seeded = true;
+    }
+    if (seen++ % trace_sample != 0)
+        return 0;
+    return atomic_fetch_add_explicit(&last_id, 1, memory_order_relaxed) + 1;
+}
+
+// The owner exited, the ring goes to the next thread that needs one
+static void release(void *arg)
+{
+    struct TraceRing *ring = arg;
+    atomic_store(&ring->owned, 0);
+}
+
+static void makekey(void)
+{
+    if (pthread_key_create(&ring_key, release) != 0)
+        perror("pthread_key_create");
+}
+
+static struct TraceRing *getring(void)
+{
+    if (myring)
+        return myring;
+
+    pthread_once(&key_once, makekey);
+    pthread_mutex_lock(&rings_mtx);
+    struct TraceRing *ring = rings;
+    while (ring && atomic_load(&ring->owned))
+        ring = ring->next;
+    if (ring == NULL && nrings < TRACE_RINGS && (ring = calloc(1, sizeof(struct TraceRing))) != NULL)
+    {
+        ring->next = rings;
+        rings = ring;
+        nrings++;
+    }
+    if (ring)
+        atomic_store(&ring->owned, 1);
+    pthread_mutex_unlock(&rings_mtx);
+    if (ring == NULL)
+        return NULL;
+
+    pthread_setspecific(ring_key, ring);
+    myring = ring;
+    mytid = syscall(SYS_gettid);
+    return ring;
+}
+
+void trace_span(uint64_t id, enum TraceStage stage, uint64_t start_ns, uint64_t end_ns)
+{
+    if (id == 0)
+        return;
+    struct TraceRing *ring = getring();
+    if (ring == NULL)
+    {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    uint64_t index = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct TraceSlot *slot = &ring->slots[index % TRACE_SLOTS];
+    atomic_store_explicit(&slot->seq, 2 * index + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&slot->id, id, memory_order_relaxed);
+    atomic_store_explicit(&slot->start_ns, start_ns, memory_order_relaxed);
+    atomic_store_explicit(&slot->dur_ns, end_ns - start_ns, memory_order_relaxed);
+    atomic_store_explicit(&slot->tid_stage, ((uint64_t)mytid << 8) | stage, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, 2 * index + 2, memory_order_release);
+    atomic_store_explicit(&ring->head, index + 1, memory_order_release);
+}
+
+// Write the spans of one ring, skipping any its owner is rewriting meanwhile
+static void writering(FILE *out, struct TraceRing *ring, pid_t pid, bool *first)
+{
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t index = (head > TRACE_SLOTS) ? head - TRACE_SLOTS : 0;
+    for (; index < head; index++)
+    {
+        struct TraceSlot *slot = &ring->slots[index % TRACE_SLOTS];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        uint64_t id = atomic_load_explicit(&slot->id, memory_order_relaxed);
+        uint64_t start = atomic_load_explicit(&slot->start_ns, memory_order_relaxed);
+        uint64_t dur = atomic_load_explicit(&slot->dur_ns, memory_order_relaxed);
+        uint64_t tid_stage = atomic_load_explicit(&slot->tid_stage, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (seq != 2 * index + 2 || atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+            continue;
+
+        unsigned stage = tid_stage & 0xff;
+        fprintf(out,
+                "%s\n{\"name\":\"%s\",\"cat\":\"aesd\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%d,\"tid\":%llu,\"args\":{\"request\":%llu}}",
+                *first ? "" : ",", (stage < TRACE_STAGES) ? stage_names[stage] : "?", start / 1e3, dur / 1e3,
+                (int)pid, (unsigned long long)(tid_stage >> 8), (unsigned long long)id);
+        *first = false;
+    }
+}
+
+void trace_write(FILE *out)
+{
+    bool first = true;
+    pid_t pid = getpid();
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", out);
+    pthread_mutex_lock(&rings_mtx);
+    for (struct TraceRing *ring = rings; ring; ring = ring->next)
+        writering(out, ring, pid, &first);
+    pthread_mutex_unlock(&rings_mtx);
+    fputs("\n]}\n", out);
+}
+
+void trace_stop(void)
+{
+    if (trace_sample == 0)
+        return;
+
+    FILE *out = fopen(trace_path, "w");
+    if (out == NULL)
+        perror(trace_path);
+    else
+    {
+        trace_write(out);
+        if (fclose(out) != 0)
+            perror(trace_path);
+        else
+            printf("trace of %llu requests written to %s\n", (unsigned long long)atomic_load(&last_id), trace_path);
+    }
+    unsigned long lost = atomic_load(&dropped);
+    if (lost)
+        printf("trace: %lu spans dropped, every ring was taken\n", lost);
+}
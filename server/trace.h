@@ -0,0 +1,81 @@
+/*
+ * trace.h
+ *
+ *  @brief Sampled per-request tracing exported as Chrome trace event JSON
+ *
+ * One in every trace_sample received chunks gets a request ID, and every
+ * stage the request passes through on its way to the log and back to the
+ * client is recorded as a span in the ring of the thread running it. The
+ * rings keep the newest spans and load in chrome://tracing or Perfetto.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum TraceStage
+{
+    TRACE_RECV,     // handling the received chunk
+    TRACE_LOCKWAIT, // waiting for the log lock
+    TRACE_APPEND,   // the append to the log backend
+    TRACE_RESOLVE,  // resolving the reply's range and taking its snapshot
+    TRACE_SEEK,     // the seek command, the driver ioctl on chardev
+    TRACE_SEND,     // one send of reply bytes
+    TRACE_REPLY,    // the reply from its start to its last byte sent
+    TRACE_STAGES,
+};
+
+// Trace one in every trace_sample received chunks, 0 traces none
+extern unsigned trace_sample;
+
+/**
+ * The sampled request the calling thread works for, 0 for none. Appends and
+ * seeks the thread makes are recorded against it; in an event loop that is
+ * the last sampled chunk it handled, whose appends share a batch with those
+ * of the connections handled around it.
+ */
+extern __thread uint64_t trace_current;
+
+/**
+ * Parse a -t argument: sample[:path]
+ * @return 0 on success, ERROR when arg is malformed
+ */
+int trace_parse(const char *arg);
+
+/**
+ * Count a received chunk towards the sample, used by trace_begin()
+ * @return the new request ID when the chunk is traced, 0 otherwise
+ */
+uint64_t trace_next(void);
+
+/**
+ * Decide whether the chunk about to be handled is traced, making its ID, or
+ * 0, the calling thread's trace_current. Costs a thread local increment when
+ * tracing is on and a single comparison when it is off.
+ * @return the request ID, 0 when the chunk is not traced
+ */
+static inline uint64_t trace_begin(void)
+{
+    trace_current = trace_sample ? trace_next() : 0;
+    return trace_current;
+}
+
+/**
+ * Record that request id spent start_ns to end_ns, on the stat_now() clock,
+ * in stage. Nothing is recorded for id 0.
+ */
+void trace_span(uint64_t id, enum TraceStage stage, uint64_t start_ns, uint64_t end_ns);
+
+/**
+ * Write every span the rings still hold as a Chrome trace event JSON object
+ */
+void trace_write(FILE *out);
+
+/**
+ * Write the trace to the file given with -t, if any, once the server stopped
+ */
+void trace_stop(void);
+
+#endif /* TRACE_H */
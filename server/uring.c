@@ -0,0 +1,1018 @@
+/**
+ * @file uring.c
+ * @brief io_uring driven event loop for aesdsocket
+ *
+ * Every connection has exactly one operation on the ring at a time: a recv
+ * while it waits for data, then sends of at most REPLY_CHUNK bytes from the
+ * shared log snapshot while it replies, each preceded by a read of the log
+ * when the log is too large for a snapshot. Appends from all connections of
+ * the loop are staged in one batch and written with a single ring write,
+ * replies start once the write that carries their data has completed. The
+ * ring is its own group commit, so this loop bypasses the writer thread.
+ * All submissions queued while handling one batch of completions go to the
+ * kernel in the same io_uring_enter() that waits for the next batch.
+ * Subscribers keep a recv queued while they are caught up with the log; an
+ * append signals the loop's feed eventfd, and the recv of every idle
+ * subscriber is cancelled to make way for pushing the new range.
+ *
+ * The ring is driven through the raw system calls so no liburing is needed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include "admit.h"
+#include "diaglog.h"
+#include "durable.h"
+#include "feed.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "trace.h"
+#include "uring.h"
+
+#define RING_ENTRIES 4096
+
+// Completions carry the connection pointer with the operation in the low bits
+enum UOp
+{
+    UOP_ACCEPT,
+    UOP_RECV,
+    UOP_READ,
+    UOP_SEND,
+    UOP_WRITE,
+    UOP_STOP,
+    UOP_FEED,
+    UOP_CANCEL,
+    UOP_SYNC,
+    UOP_PAUSE,
+};
+#define UOP_MASK 15ull
+
+struct Ring
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+enum UConnState
+{
+    UCONN_RECV,     // a recv is queued
+    UCONN_WAIT_LOG, // a reply is due once the staged appends are written
+    UCONN_READ,     // reading the next reply chunk from the log
+    UCONN_SEND,     // sending the current reply chunk
+    UCONN_CANCEL,   // the recv of an idle subscriber is being cancelled to push appends
+    UCONN_PAUSED,   // reads held off, on a timeout for the client's rate or for the staged backlog
+};
+
+struct UConn
+{
+    struct UConn *prev;
+    struct UConn *next;
+    struct UConn *wait_next;
+    struct UConn *sub_next;
+    struct UConn *pause_next;
+    int fd;
+    enum UConnState state;
+    bool subscribed; // the connection only receives appends from now on
+    uint64_t wait_gen;
+    struct Commands cmds;
+    unsigned replies; // packets the next reply answers
+    struct ReplyCursor cursor;
+    struct PacketBuf pkt;
+    char *reply;       // REPLY_CHUNK bytes, only allocated while streaming a reply from the log
+    struct Segment *pin; // holds the segment a queued read is from
+    const char *chunk; // the reply chunk being sent, in reply or in the snapshot
+    size_t reply_len;
+    size_t reply_sent;
+    struct AdmitClient *client;
+    struct __kernel_timespec pause; // the timeout a rate limited connection waits out
+    char client_ip[INET6_ADDRSTRLEN];
+    char buf[RECV_BUF_SIZE];
+} __attribute__((aligned(16)));
+
+// A listening socket the loop keeps an accept queued on
+struct UListener
+{
+    int fd;
+    struct sockaddr_storage addr; // filled in by the accept in flight
+    socklen_t addr_size;
+} __attribute__((aligned(16)));
+
+struct ULoop
+{
+    struct Ring ring;
+    struct UListener listeners[2]; // TCP, then the Unix socket when there is one
+    int nlisteners;
+    int stopfd;
+    struct Slab slab; // every struct UConn of the loop comes from here
+    struct UConn *head;
+    struct UConn *waiting;
+    struct UConn *subs;
+    struct UConn *paused; // waiting for the staged backlog to go down
+    int feedfd; // signalled by appends while there are subscribers
+    int feedslot;
+    uint64_t feedgen; // log generation subscribers were last pushed up to
+    bool feedcheck;   // look at the log even if the generation did not move
+    struct LogBatch batches[2]; // one stages appends while the other is written
+    struct LogBatch *staged;
+    struct LogBatch *writing;
+    uint64_t sync_gen; // log generation the sync in flight makes durable
+    size_t written;
+    uint64_t write_ns; // when the batch being written was handed to the ring
+    uint64_t write_id; // the traced request whose appends the batch carries, if any
+    uint64_t gen_done; // batches fully written so far
+};
+
+static int ring_setup(struct Ring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return ERROR;
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto fail_close;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ptr = ring->sq_ptr;
+    else
+    {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            goto fail_sq;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail_cq;
+
+    char *sq = ring->sq_ptr;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+
+    // Submission slots map one to one onto the sqe array
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+
+    char *cq = ring->cq_ptr;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail_cq:
+    if (ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+fail_sq:
+    munmap(ring->sq_ptr, ring->sq_size);
+fail_close:
+    close(ring->fd);
+    return ERROR;
+}
+
+static void ring_teardown(struct Ring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+}
+
+// Every opcode the loop queues, a kernel missing any of them fails the loop's sqes
+static const struct
+{
+    unsigned char op;
+    const char *name;
+} ring_ops[] = {
+    {IORING_OP_ACCEPT, "accept"},
+    {IORING_OP_RECV, "recv"},
+    {IORING_OP_TIMEOUT, "timeout"},
+    {IORING_OP_READ, "read"},
+    {IORING_OP_SEND, "send"},
+    {IORING_OP_WRITE, "write"},
+    {IORING_OP_FSYNC, "fsync"},
+    {IORING_OP_POLL_ADD, "poll_add"},
+    {IORING_OP_ASYNC_CANCEL, "async_cancel"},
+};
+
+/**
+ * Ask the kernel which opcodes the ring takes
+ * @return 0 if it takes every opcode the loop queues, ERROR if one is
+ *  missing or the kernel is too old to say
+ */
+static int ring_probe(struct Ring *ring)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe == NULL)
+        return ERROR;
+
+    int rc = 0;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+    {
+        DIAG(DIAG_WARN, "uring: opcode probe failed: %s", strerror(errno));
+        rc = ERROR;
+    }
+    for (size_t i = 0; rc == 0 && i < sizeof ring_ops / sizeof ring_ops[0]; i++)
+    {
+        unsigned char op = ring_ops[i].op;
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+        {
+            DIAG(DIAG_WARN, "uring: kernel does not support %s", ring_ops[i].name);
+            rc = ERROR;
+        }
+    }
+    free(probe);
+    return rc;
+}
+
+static unsigned ring_unsubmitted(struct Ring *ring)
+{
+    return *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static int ring_enter(struct Ring *ring, unsigned min_complete, const sigset_t *sigmask)
+{
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    return syscall(__NR_io_uring_enter, ring->fd, ring_unsubmitted(ring), min_complete, flags,
+                   sigmask, _NSIG / 8);
+}
+
+static struct io_uring_sqe *ring_sqe(struct Ring *ring, void *owner, enum UOp op)
+{
+    // Out of slots: hand what is queued to the kernel to free some up
+    while (ring_unsubmitted(ring) >= ring->sq_entries)
+    {
+        if (ring_enter(ring, 0, NULL) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            perror("io_uring_enter");
+            return NULL;
+        }
+    }
+
+    unsigned tail = *ring->sq_tail;
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->user_data = (uint64_t)(uintptr_t)owner | op;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static void queue_accept(struct ULoop *l, struct UListener *lst)
+{
+    struct io_uring_sqe *sqe = ring_sqe(&l->ring, lst, UOP_ACCEPT);
+    if (sqe == NULL)
+        return;
+    lst->addr_size = sizeof lst->addr;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = lst->fd;
+    sqe->addr = (uintptr_t)&lst->addr;
+    sqe->addr2 = (uintptr_t)&lst->addr_size;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+static void queue_recv(struct ULoop *l, struct UConn *conn)
+{
+    struct io_uring_sqe *sqe = ring_sqe(&l->ring, conn, UOP_RECV);
+    if (sqe == NULL)
+        return;
+    conn->state = UCONN_RECV;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)conn->buf;
+    sqe->len = sizeof conn->buf;
+}
+
+// The timeout completes with -ETIME and the connection reads again
+static void queue_pause(struct ULoop *l, struct UConn *conn, unsigned ms)
+{
+    struct io_uring_sqe *sqe = ring_sqe(&l->ring, conn, UOP_PAUSE);
+    if (sqe == NULL)
+        return;
+    conn->state = UCONN_PAUSED;
+    conn->pause.tv_sec = ms / 1000;
+    conn->pause.tv_nsec = (ms % 1000) * 1000000L;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&conn->pause;
+    sqe->len = 1;
+}
+
+// Queue the next recv, unless the client is over its rate or the loop has too much staged
+static void readnext(struct ULoop *l, struct UConn *conn)
+{
+    unsigned ms = rate_pause(conn->client);
+    if (ms)
+    {
+        queue_pause(l, conn, ms);
+        return;
+    }
+    if (backlog_pause(l->staged->len))
+    {
+        conn->state = UCONN_PAUSED;
+        conn->pause_next = l->paused;
+        l->paused = conn;
+        return;
+    }
+    queue_recv(l, conn);
+}
+
+// Let the connections held for the backlog read again once it went down
+static void resumepaused(struct ULoop *l)
+{
+    if (l->staged->len > admit_backlog)
+        return;
+    while (l->paused)
+    {
+        struct UConn *conn = l->paused;
+        l->paused = conn->pause_next;
+        readnext(l, conn);
+    }
+}
+
+static void onread(struct ULoop *l, struct UConn *conn, int res);
+
+static void queue_read(struct ULoop *l, struct UConn *conn)
+{
+    off_t local, seg_left;
+    int fd = logpin(conn->cursor.off, &local, &seg_left, &conn->pin);
+    if (fd == ERROR)
+    {
+        // No file to queue a read on: the log lives in memory, which is copied
+        // right away, or retention dropped the segment, which reads as the end
+        off_t left = conn->cursor.end - conn->cursor.off;
+        onread(l, conn, logread(conn->reply, (left < REPLY_CHUNK) ? left : REPLY_CHUNK, conn->cursor.off));
+        return;
+    }
+    struct io_uring_sqe *sqe = ring_sqe(&l->ring, conn, UOP_READ);
+    if (sqe == NULL)
+    {
+        logunpin(conn->pin);
+        conn->pin = NULL;
+        return;
+    }
+    conn->state = UCONN_READ;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    off_t left = conn->cursor.end - conn->cursor.off;
+    if (left > seg_left)
+        left = seg_left;
+    sqe->off = local;
+    sqe->addr = (uintptr_t)conn->reply;
+    sqe->len = (left < REPLY_CHUNK) ? left : REPLY_CHUNK;
+}
+
+static void queue_send(struct ULoop *l, struct UConn *conn)
+{
+    struct io_uring_sqe *sqe = ring_sqe(&l->ring, conn, UOP_SEND);
+    if (sqe == NULL)
+        return;
+    conn->state = UCONN_SEND;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)(conn->chunk + conn->reply_sent);
+    sqe->len = conn->reply_len - conn->reply_sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+// logappendfd() only hands out a log opened O_APPEND, so the write offset is ignored and appends stay atomic
+static void queue_write(struct ULoop *l)
+{
+    struct io_uring_sqe *sqe = ring_sqe(&l->ring, NULL, UOP_WRITE);
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = logappendfd();
+    sqe->off = -1;
+    sqe->addr = (uintptr_t)(l->writing->buf + l->written);
+    sqe->len = l->writing->len - l->written;
+}
+
+// Under the ack policy a written batch is only done once it is on disk
+static void queue_sync(struct ULoop *l)
+{
+    struct io_uring_sqe *sqe = ring_sqe(&l->ring, NULL, UOP_SYNC);
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = logappendfd();
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+}
+
+static void queue_stop(struct ULoop *l)
+{
+    struct io_uring_sqe *sqe = ring_sqe(&l->ring, NULL, UOP_STOP);
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = l->stopfd;
+    sqe->poll32_events = POLLIN;
+}
+
+static void queue_feed(struct ULoop *l)
+{
+    struct io_uring_sqe *sqe = ring_sqe(&l->ring, NULL, UOP_FEED);
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = l->feedfd;
+    sqe->poll32_events = POLLIN;
+}
+
+// The recv completes with -ECANCELED, or with whatever raced the cancel
+static void queue_cancel(struct ULoop *l, struct UConn *conn)
+{
+    struct io_uring_sqe *sqe = ring_sqe(&l->ring, NULL, UOP_CANCEL);
+    if (sqe == NULL)
+        return;
+    conn->state = UCONN_CANCEL;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t)conn | UOP_RECV;
+}
+
+static void closeuconn(struct ULoop *l, struct UConn *conn)
+{
+    DIAG(DIAG_INFO, "Closed connection from %s", conn->client_ip);
+
+    close(conn->fd);
+    if (conn->state == UCONN_PAUSED)
+    {
+        // Only a connection held for the backlog is on the list, not one on a timeout
+        struct UConn **link = &l->paused;
+        while (*link && *link != conn)
+            link = &(*link)->pause_next;
+        if (*link)
+            *link = conn->pause_next;
+    }
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        l->head = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    if (conn->subscribed)
+    {
+        struct UConn **link = &l->subs;
+        while (*link != conn)
+            link = &(*link)->sub_next;
+        *link = conn->sub_next;
+    }
+
+    replyend(&conn->cursor);
+    logunpin(conn->pin);
+    free(conn->reply);
+    packet_free(&conn->pkt);
+    conn_leave(conn->client);
+    slab_free(&l->slab, conn);
+}
+
+static void subscribe(struct ULoop *l, struct UConn *conn, off_t from)
+{
+    conn->subscribed = true;
+    conn->cursor.off = conn->cursor.start = conn->cursor.end = from;
+    conn->cursor.repeat = 0;
+    conn->sub_next = l->subs;
+    l->subs = conn;
+    l->feedcheck = true;
+    queue_recv(l, conn);
+}
+
+static void finishreply(struct ULoop *l, struct UConn *conn)
+{
+    replyend(&conn->cursor);
+    free(conn->reply);
+    conn->reply = NULL;
+    // Replies due before a subscribe go out first
+    if (conn->cmds.subscribe != ERROR && !conn->subscribed)
+    {
+        subscribe(l, conn, conn->cmds.subscribe);
+        return;
+    }
+    // A subscriber misses the appends that came in while it was pushing
+    if (conn->subscribed)
+    {
+        l->feedcheck = true;
+        queue_recv(l, conn);
+    }
+    else
+        readnext(l, conn);
+}
+
+// Queue the next chunk of the reply, a snapshot is sent from directly, the log is read first
+static void nextchunk(struct ULoop *l, struct UConn *conn)
+{
+    if (conn->cursor.head_len)
+    {
+        conn->chunk = conn->cursor.head;
+        conn->reply_len = conn->cursor.head_len;
+        conn->reply_sent = 0;
+        queue_send(l, conn);
+    }
+    else if (conn->cursor.snap)
+    {
+        off_t left = conn->cursor.end - conn->cursor.off;
+        conn->chunk = conn->cursor.snap->data + (conn->cursor.off - conn->cursor.snap->base);
+        conn->reply_len = (left < REPLY_CHUNK) ? left : REPLY_CHUNK;
+        conn->reply_sent = 0;
+        queue_send(l, conn);
+    }
+    else
+        queue_read(l, conn);
+}
+
+static void startreply(struct ULoop *l, struct UConn *conn)
+{
+    replystart(&conn->cursor, &conn->cmds, conn->replies);
+    if (conn->cursor.snap == NULL && conn->reply == NULL)
+    {
+        conn->reply = malloc(REPLY_CHUNK);
+        if (conn->reply == NULL)
+        {
+            perror("malloc");
+            finishreply(l, conn);
+            return;
+        }
+    }
+
+    if (replymore(&conn->cursor))
+        nextchunk(l, conn);
+    else
+        finishreply(l, conn);
+}
+
+// Start the replies whose data has reached the log
+static void wakewaiting(struct ULoop *l)
+{
+    struct UConn **link = &l->waiting;
+    while (*link)
+    {
+        struct UConn *conn = *link;
+        if (conn->wait_gen <= l->gen_done)
+        {
+            *link = conn->wait_next;
+            startreply(l, conn);
+        }
+        else
+            link = &conn->wait_next;
+    }
+}
+
+// The batch being written missed the log, close the connections whose replies depend on it
+static void failwaiting(struct ULoop *l)
+{
+    uint64_t gen = l->gen_done + 1;
+    struct UConn **link = &l->waiting;
+    while (*link)
+    {
+        struct UConn *conn = *link;
+        if (conn->wait_gen != gen)
+        {
+            link = &conn->wait_next;
+            continue;
+        }
+        *link = conn->wait_next;
+        DIAG(DIAG_WARN, "Appends from %s missed the log, closing the connection", conn->client_ip);
+        closeuconn(l, conn);
+    }
+}
+
+static void wrotebatch(struct ULoop *l)
+{
+    l->writing->len = 0;
+    l->writing->nends = 0;
+    l->writing = NULL;
+    l->gen_done++;
+}
+
+static void startwrite(struct ULoop *l)
+{
+    l->writing = l->staged;
+    l->staged = (l->staged == &l->batches[0]) ? &l->batches[1] : &l->batches[0];
+    l->written = 0;
+    l->write_ns = stat_now();
+    l->write_id = trace_current;
+    if (logappendfd() == ERROR)
+    {
+        // A segment roll is not safe against another loop's write in flight, a ring has no
+        // descriptor, and the driver writes at a file position seeks move under log_mtx
+        if (!batch_write(l->writing) || (durable_acks() && !durable_wait(loggeneration())))
+            failwaiting(l);
+        wrotebatch(l);
+        return;
+    }
+    queue_write(l);
+}
+
+static void onwrite(struct ULoop *l, int res)
+{
+    if (res <= 0)
+    {
+        errno = res ? -res : ENOSPC;
+        perror("write");
+        failwaiting(l);
+    }
+    else
+    {
+        l->written += res;
+        logcommitted();
+        if (l->written < l->writing->len)
+        {
+            queue_write(l);
+            return;
+        }
+    }
+    uint64_t done = stat_now();
+    stat_time(STAT_APPEND, done - l->write_ns);
+    trace_span(l->write_id, TRACE_APPEND, l->write_ns, done);
+
+    if (durable_acks())
+    {
+        l->sync_gen = loggeneration();
+        queue_sync(l);
+        return;
+    }
+    wrotebatch(l);
+    if (l->staged->len)
+        startwrite(l);
+}
+
+static void onsync(struct ULoop *l, int res)
+{
+    if (res < 0)
+    {
+        // The batch may never reach the disk, its connections get no acks
+        errno = -res;
+        perror("fdatasync");
+        durable_failed(l->sync_gen);
+        failwaiting(l);
+    }
+    else
+        durable_synced(l->sync_gen);
+    wrotebatch(l);
+    if (l->staged->len)
+        startwrite(l);
+}
+
+// Push the range of the log a subscriber has not seen yet, or go back to waiting for it
+static void pushsub(struct ULoop *l, struct UConn *conn)
+{
+    if (conn->cursor.off >= conn->cursor.end)
+    {
+        queue_recv(l, conn);
+        return;
+    }
+    if (conn->reply == NULL)
+    {
+        conn->reply = malloc(REPLY_CHUNK);
+        if (conn->reply == NULL)
+        {
+            perror("malloc");
+            closeuconn(l, conn);
+            return;
+        }
+    }
+    queue_read(l, conn);
+}
+
+// Cancel the recv of every subscriber that is caught up once the log has grown
+static void pumpsubs(struct ULoop *l)
+{
+    if (l->subs == NULL)
+        return;
+
+    // Arm before looking, an append from elsewhere after the look then wakes the loop
+    feed_arm(l->feedslot);
+    uint64_t gen = loggeneration();
+    if (gen == l->feedgen && !l->feedcheck)
+        return;
+    l->feedgen = gen;
+    l->feedcheck = false;
+
+    off_t size = logsize();
+    for (struct UConn *conn = l->subs; conn; conn = conn->sub_next)
+    {
+        if (conn->state != UCONN_RECV || conn->cursor.off >= size)
+            continue;
+        conn->cursor.end = size;
+        queue_cancel(l, conn);
+    }
+}
+
+static void onfeed(struct ULoop *l)
+{
+    eventfd_t count;
+    eventfd_read(l->feedfd, &count);
+    if (running)
+        queue_feed(l);
+}
+
+static void onrecv(struct ULoop *l, struct UConn *conn, int res)
+{
+    // What a subscriber sends is dropped, a cancelled recv makes way for a push
+    if (conn->subscribed && (res > 0 || res == -ECANCELED))
+    {
+        pushsub(l, conn);
+        return;
+    }
+    if (res <= 0)
+    {
+        closeuconn(l, conn);
+        return;
+    }
+
+    int completed = handlechunk(&conn->pkt, conn->buf, res, &conn->cmds, l->staged);
+    if (completed == ERROR)
+    {
+        closeuconn(l, conn);
+        return;
+    }
+    rate_charge(conn->client, res, completed);
+    if (completed == 0 && conn->cmds.subscribe != ERROR)
+    {
+        subscribe(l, conn, conn->cmds.subscribe);
+        return;
+    }
+    if (completed == 0)
+    {
+        readnext(l, conn);
+        return;
+    }
+    conn->replies = completed;
+
+    // The reply has to include everything staged or being written right now
+    if (l->staged->len)
+        conn->wait_gen = l->gen_done + (l->writing ? 2 : 1);
+    else
+        conn->wait_gen = l->gen_done + (l->writing ? 1 : 0);
+    conn->state = UCONN_WAIT_LOG;
+    conn->wait_next = l->waiting;
+    l->waiting = conn;
+}
+
+static void onread(struct ULoop *l, struct UConn *conn, int res)
+{
+    logunpin(conn->pin);
+    conn->pin = NULL;
+    if (res <= 0)
+    {
+        if (res < 0)
+        {
+            errno = -res;
+            perror("read");
+        }
+        // A binary reply header already promised the bytes the log no longer has
+        if (conn->cursor.frames)
+            closeuconn(l, conn);
+        else
+        {
+            // A subscriber the log was dropped under goes on from what is appended next
+            conn->cursor.off = conn->cursor.end;
+            finishreply(l, conn);
+        }
+        return;
+    }
+
+    conn->chunk = conn->reply;
+    conn->reply_len = res;
+    conn->reply_sent = 0;
+    queue_send(l, conn);
+}
+
+static void onsend(struct ULoop *l, struct UConn *conn, int res)
+{
+    if (res <= 0)
+    {
+        closeuconn(l, conn);
+        return;
+    }
+
+    conn->reply_sent += res;
+    stat_add(STAT_BYTES_OUT, res);
+    if (conn->reply_sent < conn->reply_len)
+        queue_send(l, conn);
+    else
+    {
+        replyadvance(&conn->cursor, conn->reply_len);
+        if (replymore(&conn->cursor))
+            nextchunk(l, conn);
+        else
+            finishreply(l, conn);
+    }
+}
+
+static void onaccept(struct ULoop *l, struct UListener *lst, int res)
+{
+    if (running)
+        queue_accept(l, lst);
+
+    if (res < 0)
+    {
+        if (res != -EINTR && res != -EAGAIN && res != -ECONNABORTED)
+        {
+            errno = -res;
+            perror("accept");
+        }
+        return;
+    }
+
+    struct AdmitClient *client = conn_admit(&lst->addr);
+    if (client == NULL)
+    {
+        DIAG(DIAG_INFO, "Refused a connection, a connection limit is reached");
+        close(res);
+        return;
+    }
+    struct UConn *conn = slab_alloc(&l->slab);
+    if (conn == NULL)
+    {
+        perror("malloc");
+        close(res);
+        conn_leave(client);
+        return;
+    }
+    conn->fd = res;
+    conn->client = client;
+    peername(&lst->addr, conn->client_ip, sizeof conn->client_ip);
+
+    conn->next = l->head;
+    if (l->head)
+        l->head->prev = conn;
+    l->head = conn;
+
+    DIAG(DIAG_INFO, "Accepted connection from %s", conn->client_ip);
+    queue_recv(l, conn);
+}
+
+static void oncompletion(struct ULoop *l, const struct io_uring_cqe *cqe)
+{
+    struct UConn *conn = (struct UConn *)(uintptr_t)(cqe->user_data & ~UOP_MASK);
+    switch (cqe->user_data & UOP_MASK)
+    {
+    case UOP_ACCEPT:
+        onaccept(l, (struct UListener *)conn, cqe->res);
+        break;
+    case UOP_RECV:
+        onrecv(l, conn, cqe->res);
+        break;
+    case UOP_READ:
+        onread(l, conn, cqe->res);
+        break;
+    case UOP_SEND:
+        onsend(l, conn, cqe->res);
+        break;
+    case UOP_WRITE:
+        onwrite(l, cqe->res);
+        break;
+    case UOP_FEED:
+        onfeed(l);
+        break;
+    case UOP_SYNC:
+        onsync(l, cqe->res);
+        break;
+    case UOP_PAUSE:
+        readnext(l, conn);
+        break;
+    default:
+        break;
+    }
+}
+
+int uring_loop(int listenfd, int localfd, int stopfd, const sigset_t *waitmask, struct LogBatch *batch)
+{
+    struct ULoop *l = calloc(1, sizeof(struct ULoop));
+    if (l == NULL)
+        return ERROR;
+
+    if (ring_setup(&l->ring, RING_ENTRIES) == ERROR)
+    {
+        perror("io_uring_setup");
+        free(l);
+        return ERROR;
+    }
+    if (ring_probe(&l->ring) == ERROR)
+    {
+        ring_teardown(&l->ring);
+        free(l);
+        return ERROR;
+    }
+
+    l->listeners[l->nlisteners++].fd = listenfd;
+    if (localfd != ERROR)
+        l->listeners[l->nlisteners++].fd = localfd;
+    for (int i = 0; i < l->nlisteners; i++)
+    {
+        // The ring waits for readiness itself, a non-blocking listener would just fail accepts
+        int flags = fcntl(l->listeners[i].fd, F_GETFL, 0);
+        if (flags != ERROR)
+            fcntl(l->listeners[i].fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    l->stopfd = stopfd;
+    slab_init(&l->slab, sizeof(struct UConn));
+    l->batches[0] = *batch;
+    l->staged = &l->batches[0];
+
+    l->feedslot = ERROR;
+    l->feedfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (l->feedfd != ERROR)
+        l->feedslot = feed_addwaker(l->feedfd);
+    if (l->feedslot == ERROR)
+        DIAG(DIAG_WARN, "uring: no feed eventfd, subscribers are only pushed on other events");
+
+    for (int i = 0; i < l->nlisteners; i++)
+        queue_accept(l, &l->listeners[i]);
+    queue_stop(l);
+    if (l->feedslot != ERROR)
+        queue_feed(l);
+
+    while (running)
+    {
+        if (ring_enter(&l->ring, 1, waitmask) < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            perror("io_uring_enter");
+            break;
+        }
+
+        unsigned head = *l->ring.cq_head;
+        unsigned tail = __atomic_load_n(l->ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe cqe = l->ring.cqes[head & l->ring.cq_mask];
+            __atomic_store_n(l->ring.cq_head, head + 1, __ATOMIC_RELEASE);
+            oncompletion(l, &cqe);
+        }
+
+        if (l->writing == NULL && l->staged->len)
+            startwrite(l);
+        wakewaiting(l);
+        resumepaused(l);
+        pumpsubs(l);
+    }
+
+    // Closing the ring cancels whatever is still queued on it
+    ring_teardown(&l->ring);
+    feed_delwaker(l->feedslot);
+    if (l->feedfd != ERROR)
+        close(l->feedfd);
+    while (l->head != NULL)
+        closeuconn(l, l->head);
+    slab_destroy(&l->slab);
+
+    if (l->writing && l->written < l->writing->len)
+        writelog(l->writing->buf + l->written, l->writing->len - l->written);
+    batch_write(l->staged);
+    for (int i = 0; i < 2; i++)
+    {
+        free(l->batches[i].buf);
+        free(l->batches[i].ends);
+    }
+    memset(batch, 0, sizeof *batch);
+    free(l);
+    return 0;
+}
@@ -0,0 +1,24 @@
+/*
+ * uring.h
+ *
+ *  @brief io_uring driven event loop for aesdsocket
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <signal.h>
+#include "aesdsocket.h"
+
+/**
+ * Serve connections accepted on listenfd, and on localfd unless it is ERROR,
+ * through an io_uring until running drops or stopfd becomes readable. Accept, recv, log write, reply read and
+ * send are all queued on the ring and submitted together once per pass.
+ * @param waitmask is the signal mask applied while waiting for completions, NULL keeps the current mask
+ * @param batch stages this loop's appends, it is left empty on return
+ * @return 0 once the loop finished, ERROR if the ring could not be set up or the kernel lacks an opcode it needs,
+ *  and nothing was done, so the caller can fall back to epoll
+ */
+int uring_loop(int listenfd, int localfd, int stopfd, const sigset_t *waitmask, struct LogBatch *batch);
+
+#endif /* URING_H */
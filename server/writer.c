@@ -0,0 +1,417 @@
+/**
+ * @file writer.c
+ * @brief Group commit stage that owns all appends to the aesdsocket log
+ *
+ * Connections push their appends onto a lock-free multi-producer single-
+ * consumer queue (the intrusive design by Dmitry Vyukov: producers only
+ * exchange the tail pointer, the consumer alone walks from the head). One
+ * writer thread drains it and coalesces whatever is queued, up to max_batch
+ * bytes, into a single writev(). When max_delay_us is set the writer holds
+ * on to a partial batch for up to that long so more appends can join it.
+ *
+ * Producers and the writer only sleep through futexes, and only when the
+ * other side has nothing for them.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "aesdsocket.h"
+#include "durable.h"
+#include "writer.h"
+
+// Most appends gathered into one writev()
+#define WRITER_IOV 256
+// Most event loops that can ask for completion wakeups
+#define WRITER_WAKERS 64
+
+struct WriterReq
+{
+    _Atomic(struct WriterReq *) next;
+    atomic_int refs;
+    atomic_int done;
+    atomic_int failed; // the write of data failed, set before done
+    atomic_int waiters;
+    struct WriterReq *earlier; // chained by the submitter, held by this request
+    size_t len;
+    char data[];
+};
+
+struct Waker
+{
+    int fd;
+    atomic_int armed;
+};
+
+static struct WriterReq stub;
+static _Atomic(struct WriterReq *) qtail = &stub;
+static struct WriterReq *qhead = &stub; // only touched by the writer thread
+static atomic_size_t queued;
+static atomic_size_t queued_bytes;
+static atomic_int drained; // bumped after every batch for writer_drain()
+static atomic_int drainers;
+static atomic_int parked;
+static atomic_int stopping;
+
+static pthread_t thread;
+static bool started;
+static size_t batch_limit;
+static unsigned delay_us;
+
+static struct Waker wakers[WRITER_WAKERS];
+static atomic_int nwakers;
+
+static long futex(atomic_int *addr, int op, int val, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static uint64_t nowns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void push(struct WriterReq *req)
+{
+    atomic_store(&req->next, NULL);
+    struct WriterReq *prev = atomic_exchange(&qtail, req);
+    atomic_store(&prev->next, req);
+}
+
+// Returns NULL when the queue is empty or a producer is half way through a push
+static struct WriterReq *pop(void)
+{
+    struct WriterReq *head = qhead;
+    struct WriterReq *next = atomic_load(&head->next);
+
+    if (head == &stub)
+    {
+        if (next == NULL)
+            return NULL;
+        qhead = head = next;
+        next = atomic_load(&head->next);
+    }
+    if (next)
+    {
+        qhead = next;
+        return head;
+    }
+    if (head != atomic_load(&qtail))
+        return NULL;
+
+    // head is the last node, put the stub behind it so it can be handed out
+    push(&stub);
+    next = atomic_load(&head->next);
+    if (next)
+    {
+        qhead = next;
+        return head;
+    }
+    return NULL;
+}
+
+// Sleep until a producer queues something or timeout_ns passes, 0 waits without limit
+static void park(uint64_t timeout_ns)
+{
+    atomic_store(&parked, 1);
+    if (atomic_load(&queued) == 0 && !atomic_load(&stopping))
+    {
+        struct timespec ts = {.tv_sec = timeout_ns / 1000000000ull, .tv_nsec = timeout_ns % 1000000000ull};
+        futex(&parked, FUTEX_WAIT_PRIVATE, 1, timeout_ns ? &ts : NULL);
+    }
+    else if (atomic_load(&queued) != 0)
+    {
+        // Counted but not linked yet, the producer is about to finish
+        sched_yield();
+    }
+    atomic_store(&parked, 0);
+}
+
+static void unpark(void)
+{
+    if (atomic_load(&parked) && atomic_exchange(&parked, 0))
+        futex(&parked, FUTEX_WAKE_PRIVATE, 1, NULL);
+}
+
+static void complete(struct WriterReq **reqs, int n)
+{
+    size_t bytes = 0;
+    for (int i = 0; i < n; i++)
+        bytes += reqs[i]->len;
+    atomic_fetch_sub(&queued_bytes, bytes);
+    atomic_fetch_add(&drained, 1);
+    if (atomic_load(&drainers))
+        futex(&drained, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+
+    for (int i = 0; i < n; i++)
+    {
+        atomic_store(&reqs[i]->done, 1);
+        if (atomic_load(&reqs[i]->waiters))
+            futex(&reqs[i]->done, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+        writer_release(reqs[i]);
+    }
+
+    int count = atomic_load(&nwakers);
+    for (int i = 0; i < count; i++)
+    {
+        if (atomic_exchange(&wakers[i].armed, 0))
+            eventfd_write(wakers[i].fd, 1);
+    }
+}
+
+static void commit(struct WriterReq **reqs, int n)
+{
+    struct iovec iov[WRITER_IOV];
+    for (int i = 0; i < n; i++)
+    {
+        iov[i].iov_base = reqs[i]->data;
+        iov[i].iov_len = reqs[i]->len;
+    }
+
+    struct iovec *next = iov;
+    int left = n;
+    while (left > 0)
+    {
+        ssize_t written = writelogv(next, left);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("writev");
+            // Nothing from next on is in the log, its submitters must not be acknowledged
+            for (int i = n - left; i < n; i++)
+                atomic_store(&reqs[i]->failed, 1);
+            break;
+        }
+        // Skip what went out and retry the rest of a short write
+        while (left > 0 && (size_t)written >= next->iov_len)
+        {
+            written -= next->iov_len;
+            next++;
+            left--;
+        }
+        if (left > 0)
+        {
+            next->iov_base = (char *)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+
+    // Completion is what releases the replies, under the ack policy they wait for the disk
+    if (durable_acks() && !durable_wait(loggeneration()))
+    {
+        for (int i = 0; i < n; i++)
+            atomic_store(&reqs[i]->failed, 1);
+    }
+    complete(reqs, n);
+}
+
+static struct WriterReq *take(void)
+{
+    struct WriterReq *req = pop();
+    if (req)
+        atomic_fetch_sub(&queued, 1);
+    return req;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct WriterReq *reqs[WRITER_IOV];
+
+    for (;;)
+    {
+        struct WriterReq *req;
+        while ((req = take()) == NULL)
+        {
+            if (atomic_load(&stopping) && atomic_load(&queued) == 0)
+                return NULL;
+            park(0);
+        }
+
+        int n = 0;
+        size_t bytes = 0;
+        reqs[n++] = req;
+        bytes += req->len;
+
+        uint64_t deadline = nowns() + delay_us * 1000ull;
+        while (n < WRITER_IOV && bytes < batch_limit)
+        {
+            req = take();
+            if (req)
+            {
+                reqs[n++] = req;
+                bytes += req->len;
+                continue;
+            }
+
+            uint64_t now = nowns();
+            if (delay_us == 0 || now >= deadline || atomic_load(&stopping))
+                break;
+            park(deadline - now);
+        }
+
+        commit(reqs, n);
+    }
+}
+
+int writer_start(size_t max_batch, unsigned max_delay_us)
+{
+    batch_limit = max_batch ? max_batch : 1;
+    delay_us = max_delay_us;
+    atomic_store(&stopping, 0);
+
+    // Signals are for the main thread, keep them off the writer
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int err = pthread_create(&thread, NULL, writer_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0)
+    {
+        errno = err;
+        perror("pthread_create");
+        return ERROR;
+    }
+    started = true;
+    return 0;
+}
+
+void writer_stop(void)
+{
+    if (!started)
+        return;
+
+    atomic_store(&stopping, 1);
+    unpark();
+    pthread_join(thread, NULL);
+    started = false;
+}
+
+bool writer_running(void)
+{
+    return started;
+}
+
+struct WriterReq *writer_append(const char *buf, size_t len)
+{
+    struct WriterReq *req = malloc(sizeof(struct WriterReq) + len);
+    if (req == NULL)
+    {
+        perror("malloc");
+        return NULL;
+    }
+
+    // One reference for the writer, one for the caller
+    atomic_init(&req->refs, 2);
+    atomic_init(&req->done, 0);
+    atomic_init(&req->failed, 0);
+    atomic_init(&req->waiters, 0);
+    req->earlier = NULL;
+    req->len = len;
+    memcpy(req->data, buf, len);
+
+    atomic_fetch_add(&queued_bytes, len);
+    push(req);
+    atomic_fetch_add(&queued, 1);
+    unpark();
+    return req;
+}
+
+struct WriterReq *writer_hold(struct WriterReq *req)
+{
+    if (req)
+        atomic_fetch_add(&req->refs, 1);
+    return req;
+}
+
+void writer_release(struct WriterReq *req)
+{
+    while (req && atomic_fetch_sub(&req->refs, 1) == 1)
+    {
+        struct WriterReq *earlier = req->earlier;
+        free(req);
+        req = earlier;
+    }
+}
+
+bool writer_done(struct WriterReq *req)
+{
+    return req == NULL || atomic_load(&req->done);
+}
+
+bool writer_failed(struct WriterReq *req)
+{
+    for (; req; req = req->earlier)
+    {
+        if (atomic_load(&req->failed))
+            return true;
+    }
+    return false;
+}
+
+void writer_chain(struct WriterReq *req, struct WriterReq *earlier)
+{
+    req->earlier = earlier;
+}
+
+void writer_wait(struct WriterReq *req)
+{
+    if (req == NULL)
+        return;
+
+    atomic_store(&req->waiters, 1);
+    while (!atomic_load(&req->done))
+        futex(&req->done, FUTEX_WAIT_PRIVATE, 0, NULL);
+}
+
+size_t writer_queued(void)
+{
+    return atomic_load(&queued_bytes);
+}
+
+void writer_drain(size_t limit)
+{
+    while (atomic_load(&queued_bytes) > limit && !atomic_load(&stopping))
+    {
+        // A batch completing after the snapshot of drained makes the wait return at once
+        int seen = atomic_load(&drained);
+        atomic_fetch_add(&drainers, 1);
+        if (atomic_load(&queued_bytes) > limit)
+            futex(&drained, FUTEX_WAIT_PRIVATE, seen, NULL);
+        atomic_fetch_sub(&drainers, 1);
+    }
+}
+
+int writer_addwaker(int eventfd)
+{
+    // A slot is never armed before its owner filled in the descriptor
+    int slot = atomic_fetch_add(&nwakers, 1);
+    if (slot >= WRITER_WAKERS)
+    {
+        atomic_fetch_sub(&nwakers, 1);
+        return ERROR;
+    }
+    wakers[slot].fd = eventfd;
+    return slot;
+}
+
+void writer_arm(int slot)
+{
+    if (slot >= 0)
+        atomic_store(&wakers[slot].armed, 1);
+}
@@ -0,0 +1,103 @@
+/*
+ * writer.h
+ *
+ *  @brief Group commit stage that owns all appends to the aesdsocket log
+ */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * One append handed to the writer. Requests are reference counted: the
+ * writer holds one reference until the data is in the log, the submitter
+ * gets another one back from writer_append() and drops it with
+ * writer_release() once it no longer needs to know about completion.
+ */
+struct WriterReq;
+
+/**
+ * Start the writer thread.
+ * @param max_batch is the most bytes gathered into one writev()
+ * @param max_delay_us is how long the writer waits for more appends once it
+ *  has one in hand, 0 writes whatever is queued right away
+ * @return 0 on success, ERROR if the thread could not be started
+ */
+int writer_start(size_t max_batch, unsigned max_delay_us);
+
+/**
+ * Write out everything still queued and stop the writer thread
+ */
+void writer_stop(void);
+
+/**
+ * @return true while the writer thread owns the appends
+ */
+bool writer_running(void);
+
+/**
+ * Queue len bytes for the log. Appends from one thread reach the log in the
+ * order they were queued, appends from different threads in queue order.
+ * @return a reference to the request, or NULL if it could not be queued
+ */
+struct WriterReq *writer_append(const char *buf, size_t len);
+
+/**
+ * Take another reference to req
+ */
+struct WriterReq *writer_hold(struct WriterReq *req);
+
+/**
+ * Drop a reference to req, NULL is ignored
+ */
+void writer_release(struct WriterReq *req);
+
+/**
+ * @return true once the writer is finished with req, whether or not its data
+ *  made it to the log. NULL counts as done.
+ */
+bool writer_done(struct WriterReq *req);
+
+/**
+ * @return true when the data of req, or of a request chained to it with
+ *  writer_chain(), did not reach the log. Only settled once writer_done(req).
+ */
+bool writer_failed(struct WriterReq *req);
+
+/**
+ * Make req answer for earlier, a request of the same submitter queued before
+ * it: writer_failed(req) then covers earlier too, and the reference to
+ * earlier passes to req
+ */
+void writer_chain(struct WriterReq *req, struct WriterReq *earlier);
+
+/**
+ * Block until the writer is finished with req
+ */
+void writer_wait(struct WriterReq *req);
+
+/**
+ * @return the bytes of appends queued and not in the log yet
+ */
+size_t writer_queued(void);
+
+/**
+ * Block until no more than limit bytes of appends are queued, or the writer stops
+ */
+void writer_drain(size_t limit);
+
+/**
+ * Register an eventfd the writer signals after a batch is written while
+ * it is armed, so event loops learn about completions without blocking.
+ * @return a slot for writer_arm(), or ERROR when all slots are taken
+ */
+int writer_addwaker(int eventfd);
+
+/**
+ * Ask for the eventfd of slot to be signalled after the next batch
+ */
+void writer_arm(int slot);
+
+#endif /* WRITER_H */
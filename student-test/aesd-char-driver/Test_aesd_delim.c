@@ -0,0 +1,153 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-delim.h"
+
+typedef size_t (*delim_scanner)(const char *buf, size_t len, char delim, size_t *pos, size_t max);
+
+static const struct
+{
+    const char *name;
+    delim_scanner scan;
+} scanners[] = {
+    {"byte", aesd_delim_scan_byte},
+    {"word", aesd_delim_scan_word},
+    {"sse2", aesd_delim_scan_sse2},
+    {"avx2", aesd_delim_scan_avx2},
+    {"picked", aesd_delim_scan},
+};
+
+#define NSCANNERS (sizeof scanners / sizeof *scanners)
+
+/**
+ * Scan buf with every variant, and with max small enough that each has to
+ * stop early and be continued after the last offset it returned, checking
+ * the offsets against a byte by byte loop
+ */
+static void check_all(const char *buf, size_t len, char delim, size_t max)
+{
+    size_t want[512], got[512];
+    size_t nwant = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (buf[i] == delim)
+            want[nwant++] = i;
+    }
+
+    for (size_t s = 0; s < NSCANNERS; s++)
+    {
+        size_t ngot = 0, start = 0, found;
+        do
+        {
+            found = scanners[s].scan(buf + start, len - start, delim, got + ngot, max);
+            TEST_ASSERT_TRUE_MESSAGE(found <= max, scanners[s].name);
+            for (size_t i = 0; i < found; i++)
+                got[ngot + i] += start;
+            ngot += found;
+            if (found)
+                start = got[ngot - 1] + 1;
+        } while (found == max && start < len);
+
+        TEST_ASSERT_EQUAL_size_t_MESSAGE(nwant, ngot, scanners[s].name);
+        for (size_t i = 0; i < nwant; i++)
+            TEST_ASSERT_EQUAL_size_t_MESSAGE(want[i], got[i], scanners[s].name);
+        TEST_ASSERT_EQUAL_size_t_MESSAGE(nwant ? want[0] : len, aesd_delim_find(buf, len, delim), scanners[s].name);
+    }
+}
+
+void test_delim_empty_and_no_match()
+{
+    char buf[200];
+    memset(buf, 'x', sizeof buf);
+    size_t pos[4];
+    for (size_t s = 0; s < NSCANNERS; s++)
+    {
+        TEST_ASSERT_EQUAL_size_t_MESSAGE(0, scanners[s].scan(buf, 0, '\n', pos, 4), scanners[s].name);
+        TEST_ASSERT_EQUAL_size_t_MESSAGE(0, scanners[s].scan(buf, sizeof buf, '\n', pos, 4), scanners[s].name);
+    }
+    TEST_ASSERT_EQUAL_size_t(0, aesd_delim_find(buf, 0, '\n'));
+    TEST_ASSERT_EQUAL_size_t(sizeof buf, aesd_delim_find(buf, sizeof buf, '\n'));
+}
+
+void test_delim_single_at_every_position()
+{
+    // Every offset of a block, of its tail and of the word and vector edges
+    // between them, at every misalignment of the start
+    static char area[256 + 64];
+    for (size_t align = 0; align < 64; align++)
+    {
+        for (size_t len = 1; len <= 200; len += (len < 80) ? 1 : 13)
+        {
+            char *buf = area + align;
+            for (size_t at = 0; at < len; at++)
+            {
+                memset(buf, 'a', len);
+                buf[at] = '\n';
+                check_all(buf, len, '\n', 64);
+            }
+        }
+    }
+}
+
+void test_delim_every_byte_a_delimiter()
+{
+    char buf[300];
+    memset(buf, '\n', sizeof buf);
+    for (size_t len = 0; len <= sizeof buf; len += 7)
+    {
+        check_all(buf, len, '\n', 1);
+        check_all(buf, len, '\n', 3);
+        check_all(buf, len, '\n', 64);
+    }
+}
+
+void test_delim_stops_when_pos_is_full()
+{
+    char buf[128];
+    memset(buf, 'a', sizeof buf);
+    for (size_t i = 0; i < sizeof buf; i += 5)
+        buf[i] = '\n';
+
+    for (size_t s = 0; s < NSCANNERS; s++)
+    {
+        size_t pos[5] = {0};
+        TEST_ASSERT_EQUAL_size_t_MESSAGE(4, scanners[s].scan(buf, sizeof buf, '\n', pos, 4), scanners[s].name);
+        TEST_ASSERT_EQUAL_size_t_MESSAGE(15, pos[3], scanners[s].name);
+        // Nothing is stored past max
+        TEST_ASSERT_EQUAL_size_t_MESSAGE(0, pos[4], scanners[s].name);
+    }
+}
+
+void test_delim_bytes_close_to_the_delimiter()
+{
+    // Bytes sharing all but one bit with '\n', or with the sign bit set, must
+    // not be taken for it by the word at a time carry tricks
+    static const char near[] = {'\x0b', '\x08', '\x8a', '\x0a' ^ 0x80, '\x00', '\xff', '\x09', '\x1a'};
+    char buf[192];
+    for (size_t i = 0; i < sizeof buf; i++)
+        buf[i] = near[i % sizeof near];
+    check_all(buf, sizeof buf, '\n', 64);
+
+    srand(8);
+    for (int round = 0; round < 200; round++)
+    {
+        size_t len = rand() % sizeof buf;
+        for (size_t i = 0; i < len; i++)
+            buf[i] = (rand() % 8) ? near[rand() % sizeof near] : '\n';
+        check_all(buf, len, '\n', 1 + rand() % 64);
+    }
+}
+
+void test_delim_other_delimiters()
+{
+    char buf[150];
+    srand(9);
+    for (int round = 0; round < 100; round++)
+    {
+        char delim = (char)(rand() % 256);
+        for (size_t i = 0; i < sizeof buf; i++)
+            buf[i] = (char)(rand() % 256);
+        check_all(buf, sizeof buf, delim, 64);
+    }
+}
@@ -0,0 +1,183 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <errno.h>
+#include <limits.h>
+#include "../../server/aesdsocket.h"
+#include "../../server/aesdproto.h"
+#include "../../server/admit.h"
+#include "../../server/store.h"
+
+/**
+ * A binary mode connection's parsing state, with the log held by the memory backend
+ */
+struct FrameConn
+{
+    struct PacketBuf pkt;
+    struct LogBatch batch;
+    struct Commands cmds;
+};
+
+static void frames_open(struct FrameConn *conn)
+{
+    static const struct StoreConfig cfg = {0};
+    memset(conn, 0, sizeof *conn);
+    TEST_ASSERT_EQUAL_INT(0, logopen(&memory_store, &cfg));
+}
+
+static int frames_chunk(struct FrameConn *conn, const void *buf, size_t len)
+{
+    return handlechunk(&conn->pkt, buf, len, &conn->cmds, &conn->batch);
+}
+
+static void frames_close(struct FrameConn *conn, const char *expected)
+{
+    batch_free(&conn->batch);
+    packet_free(&conn->pkt);
+
+    size_t len = strlen(expected);
+    char log[256];
+    TEST_ASSERT_EQUAL_INT64(len, logsize());
+    TEST_ASSERT_EQUAL_INT64(len, len ? logread(log, len, 0) : 0);
+    TEST_ASSERT_EQUAL_MEMORY(expected, log, len);
+    logclose();
+}
+
+/**
+ * Append a request frame to buf
+ * @return the length of buf with the frame
+ */
+static size_t putframe(char *buf, size_t len, uint8_t opcode, uint32_t seq, const void *payload, uint32_t plen)
+{
+    struct aesd_frame req = {.opcode = opcode, .length = htole32(plen), .seq = htole32(seq)};
+    memcpy(buf + len, &req, sizeof req);
+    memcpy(buf + len + sizeof req, payload, plen);
+    return len + sizeof req + plen;
+}
+
+static size_t puthello(char *buf)
+{
+    memcpy(buf, AESD_BINARY_HELLO, sizeof AESD_BINARY_HELLO - 1);
+    return sizeof AESD_BINARY_HELLO - 1;
+}
+
+void test_frames_hello_append_and_read_in_one_chunk()
+{
+    char buf[256];
+    size_t len = puthello(buf);
+    len = putframe(buf, len, AESD_OP_APPEND, 7, "abc\n", 4);
+    struct aesd_frame_range range = {.first = htole64(1), .count = htole64(UINT64_MAX)};
+    len = putframe(buf, len, AESD_OP_READPKT, 8, &range, sizeof range);
+
+    struct FrameConn conn;
+    frames_open(&conn);
+    TEST_ASSERT_EQUAL_INT(3, frames_chunk(&conn, buf, len));
+    TEST_ASSERT_EQUAL_INT(PROTO_BINARY, conn.pkt.proto);
+    TEST_ASSERT_EQUAL_UINT(3, conn.cmds.nframes);
+
+    const struct ReplyFrame *f = conn.cmds.frames;
+    TEST_ASSERT_EQUAL_UINT(AESD_OP_HELLO | AESD_OP_REPLY, f[0].head.opcode);
+    TEST_ASSERT_EQUAL_UINT(AESD_OP_APPEND | AESD_OP_REPLY, f[1].head.opcode);
+    TEST_ASSERT_EQUAL_UINT(7, le32toh(f[1].head.seq));
+    TEST_ASSERT_EQUAL_UINT(0, f[1].head.status);
+    TEST_ASSERT_EQUAL_UINT(AESD_OP_READPKT | AESD_OP_REPLY, f[2].head.opcode);
+    TEST_ASSERT_EQUAL_UINT(8, le32toh(f[2].head.seq));
+    TEST_ASSERT_EQUAL_INT(RANGE_PACKETS, f[2].range);
+    TEST_ASSERT_EQUAL_INT64(1, f[2].first);
+    // A count past what an offset holds is clamped, it runs to the end of the log
+    TEST_ASSERT_EQUAL_INT64(LLONG_MAX, f[2].count);
+    frames_close(&conn, "abc\n");
+}
+
+void test_frames_hello_and_frame_split_everywhere()
+{
+    char buf[128];
+    size_t len = puthello(buf);
+    len = putframe(buf, len, AESD_OP_APPEND, 1, "payload without newline", 23);
+
+    for (size_t cut = 1; cut < len; cut++)
+    {
+        struct FrameConn conn;
+        frames_open(&conn);
+        int first = frames_chunk(&conn, buf, cut);
+        int second = frames_chunk(&conn, buf + cut, len - cut);
+        TEST_ASSERT_EQUAL_INT(PROTO_BINARY, conn.pkt.proto);
+        // The hello completes once all of it is in, the append with the last byte
+        TEST_ASSERT_EQUAL_INT(2, first + second);
+        TEST_ASSERT_TRUE(second >= 1);
+        TEST_ASSERT_EQUAL_size_t(0, conn.pkt.len);
+        frames_close(&conn, "payload without newline");
+    }
+}
+
+void test_frames_bad_requests_get_einval()
+{
+    char buf[128];
+    size_t len = puthello(buf);
+    uint32_t shortrange = 0;
+    len = putframe(buf, len, AESD_OP_READ, 1, &shortrange, sizeof shortrange);
+    len = putframe(buf, len, AESD_OP_SEEK, 2, "", 0);
+    len = putframe(buf, len, 0x7f, 3, "", 0);
+
+    struct FrameConn conn;
+    frames_open(&conn);
+    TEST_ASSERT_EQUAL_INT(4, frames_chunk(&conn, buf, len));
+    TEST_ASSERT_EQUAL_UINT(4, conn.cmds.nframes);
+    for (unsigned i = 1; i < 4; i++)
+    {
+        TEST_ASSERT_EQUAL_UINT(EINVAL, conn.cmds.frames[i].head.status);
+        TEST_ASSERT_EQUAL_UINT(i, le32toh(conn.cmds.frames[i].head.seq));
+    }
+    frames_close(&conn, "");
+}
+
+void test_frames_seek_and_subscribe()
+{
+    char buf[128];
+    size_t len = puthello(buf);
+    struct aesd_seekto seekto = {.write_cmd = htole32(2), .write_cmd_offset = htole32(5)};
+    len = putframe(buf, len, AESD_OP_SEEK, 1, &seekto, sizeof seekto);
+    uint64_t from = htole64(99);
+    len = putframe(buf, len, AESD_OP_SUBSCRIBE, 2, &from, sizeof from);
+
+    struct FrameConn conn;
+    frames_open(&conn);
+    TEST_ASSERT_EQUAL_INT(3, frames_chunk(&conn, buf, len));
+    TEST_ASSERT_EQUAL_INT(RANGE_NONE, conn.cmds.frames[1].range);
+    TEST_ASSERT_EQUAL_UINT(2, conn.cmds.frames[1].seekto.write_cmd);
+    TEST_ASSERT_EQUAL_UINT(5, conn.cmds.frames[1].seekto.write_cmd_offset);
+    TEST_ASSERT_EQUAL_INT64(99, conn.cmds.subscribe);
+    frames_close(&conn, "");
+}
+
+void test_frames_oversized_frame_closes()
+{
+    size_t packet_limit = admit_packet;
+    admit_packet = 16;
+
+    char buf[128];
+    size_t len = puthello(buf);
+    len = putframe(buf, len, AESD_OP_APPEND, 1, "seventeen bytes!!", 17);
+
+    struct FrameConn conn;
+    frames_open(&conn);
+    // Refused on its header, before the payload is in
+    TEST_ASSERT_EQUAL_INT(ERROR, frames_chunk(&conn, buf, len - 17));
+    frames_close(&conn, "");
+
+    admit_packet = packet_limit;
+}
+
+void test_frames_text_that_starts_like_hello()
+{
+    struct FrameConn conn;
+    frames_open(&conn);
+    TEST_ASSERT_EQUAL_INT(0, frames_chunk(&conn, "AESDSOCKET_", 11));
+    TEST_ASSERT_EQUAL_INT(PROTO_NEW, conn.pkt.proto);
+    TEST_ASSERT_EQUAL_INT(1, frames_chunk(&conn, "BIN\n", 4));
+    TEST_ASSERT_EQUAL_INT(PROTO_TEXT, conn.pkt.proto);
+    TEST_ASSERT_EQUAL_UINT(0, conn.cmds.nframes);
+    frames_close(&conn, "AESDSOCKET_BIN\n");
+}
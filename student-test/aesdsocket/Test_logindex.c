@@ -0,0 +1,154 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include "../../server/aesdsocket.h"
+#include "../../server/logindex.h"
+#include "../../server/store.h"
+
+// The sidecar header: magic, log size, entry count and tail checksum
+#define SIDECAR_HEADER (4 * sizeof(uint64_t))
+
+static char sidecar[64];
+
+/**
+ * Hold log in the memory backend, indexed through a sidecar in a new
+ * directory unless keep is set
+ */
+static void index_open(const char *log, bool keep)
+{
+    static const struct StoreConfig cfg = {0};
+    if (!keep)
+    {
+        char dir[] = "/tmp/aesdindexXXXXXX";
+        TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+        snprintf(sidecar, sizeof sidecar, "%s/index", dir);
+    }
+    TEST_ASSERT_EQUAL_INT(0, logopen(&memory_store, &cfg));
+    TEST_ASSERT_EQUAL_size_t(strlen(log), writelog(log, strlen(log)));
+    // The backend indexes in memory, take the sidecar instead
+    logindex_close();
+    TEST_ASSERT_EQUAL_INT(0, logindex_open(sidecar));
+}
+
+static void index_close(bool keep)
+{
+    logclose();
+    if (!keep)
+    {
+        unlink(sidecar);
+        *strrchr(sidecar, '/') = '\0';
+        rmdir(sidecar);
+    }
+}
+
+static off_t index_seek(unsigned write_cmd, unsigned write_cmd_offset)
+{
+    struct aesd_seekto seekto = {.write_cmd = write_cmd, .write_cmd_offset = write_cmd_offset};
+    return logindex_seek(&seekto);
+}
+
+static off_t sidecar_size(void)
+{
+    struct stat st;
+    TEST_ASSERT_EQUAL_INT(0, stat(sidecar, &st));
+    return st.st_size;
+}
+
+static void sidecar_put(off_t off, uint64_t value)
+{
+    int fd = open(sidecar, O_WRONLY);
+    TEST_ASSERT_TRUE(fd >= 0);
+    value = htole64(value);
+    TEST_ASSERT_EQUAL_INT(sizeof value, pwrite(fd, &value, sizeof value, off));
+    close(fd);
+}
+
+void test_logindex_builds_the_sidecar()
+{
+    index_open("one\ntwo\nthree\n", false);
+    TEST_ASSERT_EQUAL_INT64(SIDECAR_HEADER + 3 * sizeof(uint64_t), sidecar_size());
+    TEST_ASSERT_EQUAL_INT64(4, index_seek(1, 0));
+    TEST_ASSERT_EQUAL_INT64(10, index_seek(2, 2));
+    // Past the end of a packet, and past the last packet
+    TEST_ASSERT_EQUAL_INT64(ERROR, index_seek(0, 4));
+    TEST_ASSERT_EQUAL_INT64(ERROR, index_seek(3, 0));
+    index_close(false);
+}
+
+void test_logindex_matching_sidecar_is_reused()
+{
+    index_open("aa\nbb\ncc\n", false);
+    index_close(true);
+
+    // An entry only the sidecar has shows it was taken over rather than rebuilt
+    sidecar_put(SIDECAR_HEADER, 1);
+    index_open("aa\nbb\ncc\n", true);
+    TEST_ASSERT_EQUAL_INT64(1, index_seek(1, 0));
+    index_close(false);
+}
+
+void test_logindex_catches_up_with_a_longer_log()
+{
+    index_open("aa\nbb\n", false);
+    index_close(true);
+
+    index_open("aa\nbb\ncc\ndd\n", true);
+    TEST_ASSERT_EQUAL_INT64(9, index_seek(3, 0));
+    TEST_ASSERT_EQUAL_INT64(SIDECAR_HEADER + 4 * sizeof(uint64_t), sidecar_size());
+    index_close(false);
+}
+
+void test_logindex_rebuilds_for_a_rewritten_log()
+{
+    // Same size and a newline where the old last entry ends, but other packets
+    index_open("aaaaa\nbbbbbb\n", false);
+    index_close(true);
+
+    index_open("a\nbbbbbbbbbb\n", true);
+    TEST_ASSERT_EQUAL_INT64(2, index_seek(1, 0));
+    TEST_ASSERT_EQUAL_INT64(ERROR, index_seek(2, 0));
+    index_close(false);
+}
+
+void test_logindex_rebuilds_for_a_shorter_log()
+{
+    index_open("aa\nbb\ncc\n", false);
+    index_close(true);
+
+    index_open("aa\nb", true);
+    TEST_ASSERT_EQUAL_INT64(ERROR, index_seek(1, 0));
+    TEST_ASSERT_EQUAL_INT64(SIDECAR_HEADER + sizeof(uint64_t), sidecar_size());
+    index_close(false);
+}
+
+void test_logindex_rebuilds_for_a_foreign_sidecar()
+{
+    index_open("aa\nbb\n", false);
+    index_close(true);
+
+    sidecar_put(0, 0x0123456789abcdefull);
+    index_open("aa\nbb\n", true);
+    TEST_ASSERT_EQUAL_INT64(3, index_seek(1, 0));
+    TEST_ASSERT_EQUAL_INT64(SIDECAR_HEADER + 2 * sizeof(uint64_t), sidecar_size());
+    index_close(false);
+}
+
+void test_logindex_drops_entries_the_header_does_not_count()
+{
+    index_open("aa\nbb\n", false);
+    index_close(true);
+
+    // As a crash between writing the entries and the header leaves it
+    sidecar_put(SIDECAR_HEADER + 2 * sizeof(uint64_t), 4);
+    index_open("aa\nbb\n", true);
+    TEST_ASSERT_EQUAL_INT64(ERROR, index_seek(2, 0));
+    TEST_ASSERT_EQUAL_INT64(SIDECAR_HEADER + 2 * sizeof(uint64_t), sidecar_size());
+    index_close(false);
+}
@@ -0,0 +1,166 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../server/aesdsocket.h"
+#include "../../server/admit.h"
+#include "../../server/store.h"
+
+/**
+ * One connection's parsing state, with the log held by the memory backend
+ */
+struct PacketConn
+{
+    struct PacketBuf pkt;
+    struct LogBatch batch;
+    struct Commands cmds;
+};
+
+static void conn_open(struct PacketConn *conn)
+{
+    static const struct StoreConfig cfg = {0};
+    memset(conn, 0, sizeof *conn);
+    TEST_ASSERT_EQUAL_INT(0, logopen(&memory_store, &cfg));
+}
+
+static int conn_chunk(struct PacketConn *conn, const char *buf)
+{
+    return handlechunk(&conn->pkt, buf, strlen(buf), &conn->cmds, &conn->batch);
+}
+
+/**
+ * Flush what the connection staged and check the log holds exactly expected
+ */
+static void conn_close(struct PacketConn *conn, const char *expected)
+{
+    batch_free(&conn->batch);
+    packet_free(&conn->pkt);
+
+    size_t len = strlen(expected);
+    TEST_ASSERT_EQUAL_INT64(len, logsize());
+    char *log = malloc(len + 1);
+    TEST_ASSERT_NOT_NULL(log);
+    TEST_ASSERT_EQUAL_INT64(len, len ? logread(log, len, 0) : 0);
+    TEST_ASSERT_EQUAL_MEMORY(expected, log, len);
+    free(log);
+    logclose();
+}
+
+void test_packet_whole_packets_are_staged()
+{
+    struct PacketConn conn;
+    conn_open(&conn);
+    TEST_ASSERT_EQUAL_INT(1, conn_chunk(&conn, "hello\n"));
+    TEST_ASSERT_EQUAL_size_t(0, conn.pkt.len);
+    TEST_ASSERT_EQUAL_size_t(6, conn.batch.len);
+    TEST_ASSERT_EQUAL_INT(RANGE_NONE, conn.cmds.range);
+    TEST_ASSERT_EQUAL_INT64(ERROR, conn.cmds.subscribe);
+    conn_close(&conn, "hello\n");
+}
+
+void test_packet_reassembled_byte_by_byte()
+{
+    static const char packet[] = "split over many reads\n";
+    struct PacketConn conn;
+    conn_open(&conn);
+    for (size_t i = 0; i + 1 < sizeof packet - 1; i++)
+    {
+        char one[2] = {packet[i], '\0'};
+        TEST_ASSERT_EQUAL_INT(0, conn_chunk(&conn, one));
+        TEST_ASSERT_EQUAL_size_t(i + 1, conn.pkt.len);
+        // Nothing of the packet reaches the batch before its newline
+        TEST_ASSERT_EQUAL_size_t(0, conn.batch.len);
+    }
+    TEST_ASSERT_EQUAL_INT(1, conn_chunk(&conn, "\n"));
+    TEST_ASSERT_EQUAL_size_t(0, conn.pkt.len);
+    conn_close(&conn, packet);
+}
+
+void test_packet_pipelined_in_one_chunk()
+{
+    struct PacketConn conn;
+    conn_open(&conn);
+    TEST_ASSERT_EQUAL_INT(3, conn_chunk(&conn, "one\ntwo\nthree\nfou"));
+    TEST_ASSERT_EQUAL_size_t(3, conn.pkt.len);
+    TEST_ASSERT_EQUAL_INT(2, conn_chunk(&conn, "r\nfive\n"));
+    conn_close(&conn, "one\ntwo\nthree\nfour\nfive\n");
+}
+
+void test_packet_more_than_one_scan_batch()
+{
+    // More packets than one delimiter scan looks up, and a partial one after them
+    char chunk[3 * DELIM_BATCH * 2 + 8];
+    size_t len = 0;
+    for (int i = 0; i < 3 * DELIM_BATCH; i++)
+    {
+        chunk[len++] = 'a' + i % 26;
+        chunk[len++] = '\n';
+    }
+    memcpy(chunk + len, "tail", 5);
+
+    struct PacketConn conn;
+    conn_open(&conn);
+    TEST_ASSERT_EQUAL_INT(3 * DELIM_BATCH, conn_chunk(&conn, chunk));
+    TEST_ASSERT_EQUAL_size_t(4, conn.pkt.len);
+    TEST_ASSERT_EQUAL_INT(1, conn_chunk(&conn, "\n"));
+    strcat(chunk, "\n");
+    conn_close(&conn, chunk);
+}
+
+void test_packet_seekto_command_is_not_logged()
+{
+    struct PacketConn conn;
+    conn_open(&conn);
+    TEST_ASSERT_EQUAL_INT(2, conn_chunk(&conn, "data\nAESDCHAR_IOCSEEKTO:3,7\n"));
+    TEST_ASSERT_EQUAL_UINT(3, conn.cmds.seekto.write_cmd);
+    TEST_ASSERT_EQUAL_UINT(7, conn.cmds.seekto.write_cmd_offset);
+
+    // The next chunk starts over from no seek
+    TEST_ASSERT_EQUAL_INT(1, conn_chunk(&conn, "more\n"));
+    TEST_ASSERT_EQUAL_UINT(0, conn.cmds.seekto.write_cmd);
+    TEST_ASSERT_EQUAL_UINT(0, conn.cmds.seekto.write_cmd_offset);
+    conn_close(&conn, "data\nmore\n");
+}
+
+void test_packet_command_split_across_chunks()
+{
+    struct PacketConn conn;
+    conn_open(&conn);
+    TEST_ASSERT_EQUAL_INT(0, conn_chunk(&conn, "AESDCHAR_IOC"));
+    TEST_ASSERT_EQUAL_INT(1, conn_chunk(&conn, "SEEKTO:1,2\n"));
+    TEST_ASSERT_EQUAL_UINT(1, conn.cmds.seekto.write_cmd);
+    TEST_ASSERT_EQUAL_UINT(2, conn.cmds.seekto.write_cmd_offset);
+    conn_close(&conn, "");
+}
+
+void test_packet_subscribe_is_not_answered()
+{
+    struct PacketConn conn;
+    conn_open(&conn);
+    // Only the packet ahead of the subscribe is due a reply
+    TEST_ASSERT_EQUAL_INT(1, conn_chunk(&conn, "before\nAESDSOCKET_SUBSCRIBE:42\n"));
+    TEST_ASSERT_EQUAL_INT64(42, conn.cmds.subscribe);
+    conn_close(&conn, "before\n");
+}
+
+void test_packet_spilled_start_stays_data()
+{
+    size_t packet_limit = admit_packet;
+    admit_packet = 16;
+
+    struct PacketConn conn;
+    conn_open(&conn);
+    // Too long to keep: what is held goes to the log unfinished, and the
+    // rest of the packet follows it as data even though it began as a command
+    TEST_ASSERT_EQUAL_INT(0, conn_chunk(&conn, "AESDSOCKET_READ:0,5 and then some"));
+    TEST_ASSERT_EQUAL_size_t(0, conn.pkt.len);
+    TEST_ASSERT_TRUE(conn.pkt.spilled);
+    TEST_ASSERT_EQUAL_INT(2, conn_chunk(&conn, " more\nAESDSOCKET_READ:1,2\n"));
+    TEST_ASSERT_FALSE(conn.pkt.spilled);
+    TEST_ASSERT_EQUAL_INT(RANGE_BYTES, conn.cmds.range);
+    TEST_ASSERT_EQUAL_INT64(1, conn.cmds.range_first);
+    TEST_ASSERT_EQUAL_INT64(2, conn.cmds.range_count);
+    conn_close(&conn, "AESDSOCKET_READ:0,5 and then some more\n");
+
+    admit_packet = packet_limit;
+}
@@ -0,0 +1,98 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include "../../server/aesdsocket.h"
+#include "../../server/logindex.h"
+#include "../../server/store.h"
+
+static void range_open(void)
+{
+    static const struct StoreConfig cfg = {0};
+    TEST_ASSERT_EQUAL_INT(0, logopen(&memory_store, &cfg));
+}
+
+/**
+ * Parse one command packet
+ * @return the number of packets due a reply
+ */
+static int range_parse(const char *packet, struct Commands *cmds)
+{
+    struct PacketBuf pkt = {0};
+    struct LogBatch batch = {0};
+    int completed = handlechunk(&pkt, packet, strlen(packet), cmds, &batch);
+    // Range reads are commands, none of them reaches the log
+    TEST_ASSERT_EQUAL_size_t(0, batch.len);
+    batch_free(&batch);
+    packet_free(&pkt);
+    return completed;
+}
+
+void test_range_byte_read()
+{
+    struct Commands cmds;
+    range_open();
+    TEST_ASSERT_EQUAL_INT(1, range_parse("AESDSOCKET_READ:10,20\n", &cmds));
+    TEST_ASSERT_EQUAL_INT(RANGE_BYTES, cmds.range);
+    TEST_ASSERT_EQUAL_INT64(10, cmds.range_first);
+    TEST_ASSERT_EQUAL_INT64(20, cmds.range_count);
+    logclose();
+}
+
+void test_range_without_count_runs_to_the_end()
+{
+    struct Commands cmds;
+    range_open();
+    TEST_ASSERT_EQUAL_INT(1, range_parse("AESDSOCKET_READPKT:3\n", &cmds));
+    TEST_ASSERT_EQUAL_INT(RANGE_PACKETS, cmds.range);
+    TEST_ASSERT_EQUAL_INT64(3, cmds.range_first);
+    TEST_ASSERT_EQUAL_INT64(LLONG_MAX, cmds.range_count);
+    logclose();
+}
+
+void test_range_negative_and_malformed_arguments()
+{
+    struct Commands cmds;
+    range_open();
+    TEST_ASSERT_EQUAL_INT(1, range_parse("AESDSOCKET_READ:-5,-1\n", &cmds));
+    TEST_ASSERT_EQUAL_INT64(0, cmds.range_first);
+    TEST_ASSERT_EQUAL_INT64(0, cmds.range_count);
+
+    TEST_ASSERT_EQUAL_INT(1, range_parse("AESDSOCKET_READPKT:x\n", &cmds));
+    TEST_ASSERT_EQUAL_INT(RANGE_PACKETS, cmds.range);
+    TEST_ASSERT_EQUAL_INT64(0, cmds.range_first);
+    TEST_ASSERT_EQUAL_INT64(LLONG_MAX, cmds.range_count);
+    logclose();
+}
+
+void test_range_packets_from_the_index()
+{
+    static const char log[] = "a\nbb\nccc\ndddd\nunfinished";
+    range_open();
+    TEST_ASSERT_EQUAL_size_t(sizeof log - 1, writelog(log, sizeof log - 1));
+    off_t size = logsize();
+    off_t start, end;
+
+    TEST_ASSERT_TRUE(logindex_packets(size, 1, 2, &start, &end));
+    TEST_ASSERT_EQUAL_INT64(2, start);
+    TEST_ASSERT_EQUAL_INT64(9, end);
+
+    // From packet 0, and past the last complete packet the range runs to size
+    TEST_ASSERT_TRUE(logindex_packets(size, 0, LLONG_MAX, &start, &end));
+    TEST_ASSERT_EQUAL_INT64(0, start);
+    TEST_ASSERT_EQUAL_INT64(size, end);
+
+    // A first packet past the end is empty at size
+    TEST_ASSERT_TRUE(logindex_packets(size, 9, 1, &start, &end));
+    TEST_ASSERT_EQUAL_INT64(size, start);
+    TEST_ASSERT_EQUAL_INT64(size, end);
+
+    // Packets ending after size do not count, even once indexed
+    TEST_ASSERT_TRUE(logindex_packets(5, 0, 3, &start, &end));
+    TEST_ASSERT_EQUAL_INT64(0, start);
+    TEST_ASSERT_EQUAL_INT64(5, end);
+
+    TEST_ASSERT_TRUE(logindex_packets(size, 2, 0, &start, &end));
+    TEST_ASSERT_EQUAL_INT64(start, end);
+    logclose();
+}
@@ -0,0 +1,181 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/uio.h>
+#include "../../server/seglog.h"
+
+static char segdir[32];
+
+static void seg_newdir(void)
+{
+    strcpy(segdir, "/tmp/aesdsegXXXXXX");
+    TEST_ASSERT_NOT_NULL(mkdtemp(segdir));
+}
+
+static int seg_files(void)
+{
+    int count = 0;
+    DIR *dir = opendir(segdir);
+    TEST_ASSERT_NOT_NULL(dir);
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (strstr(ent->d_name, ".seg"))
+            count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+static void seg_rmdir(void)
+{
+    DIR *dir = opendir(segdir);
+    TEST_ASSERT_NOT_NULL(dir);
+    struct dirent *ent;
+    char path[300];
+    while ((ent = readdir(dir)) != NULL)
+    {
+        snprintf(path, sizeof path, "%s/%s", segdir, ent->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+    rmdir(segdir);
+}
+
+static void seg_append(const char *data, int times)
+{
+    struct iovec iov = {.iov_base = (void *)data, .iov_len = strlen(data)};
+    for (int i = 0; i < times; i++)
+        TEST_ASSERT_EQUAL_INT64(iov.iov_len, seglog_append(&iov, 1));
+}
+
+/**
+ * @return whether log offset off is still kept, checking what is there
+ *  against expected when it is
+ */
+static bool seg_holds(off_t off, char expected)
+{
+    int fd;
+    off_t local, left;
+    struct Segment *seg = seglog_pin(off, &fd, &local, &left);
+    if (seg == NULL)
+        return false;
+    char got;
+    TEST_ASSERT_TRUE(left > 0);
+    TEST_ASSERT_EQUAL_INT(1, pread(fd, &got, 1, local));
+    TEST_ASSERT_EQUAL_INT(expected, got);
+    seglog_unpin(seg);
+    return true;
+}
+
+void test_seglog_rolls_at_the_size_limit()
+{
+    seg_newdir();
+    TEST_ASSERT_EQUAL_INT(0, seglog_open(segdir, 10, 0, 0, 0));
+    TEST_ASSERT_TRUE(seglog_enabled());
+    seg_append("abcd", 5);
+    // A segment of 12 bytes and one of the 8 after it, without retention both stay
+    TEST_ASSERT_EQUAL_INT(2, seg_files());
+    TEST_ASSERT_EQUAL_INT64(0, seglog_start());
+    TEST_ASSERT_EQUAL_INT64(20, seglog_end());
+    TEST_ASSERT_TRUE(seg_holds(12, 'a'));
+    TEST_ASSERT_TRUE(seg_holds(19, 'd'));
+    TEST_ASSERT_FALSE(seg_holds(20, 0));
+    seglog_close();
+    TEST_ASSERT_FALSE(seglog_enabled());
+    seg_rmdir();
+}
+
+void test_seglog_keeps_bytes()
+{
+    seg_newdir();
+    TEST_ASSERT_EQUAL_INT(0, seglog_open(segdir, 10, 0, 20, 0));
+    seg_append("0123456789", 6);
+    // The oldest go while the rest still hold 20 bytes, the empty newest one included
+    TEST_ASSERT_EQUAL_INT64(40, seglog_start());
+    TEST_ASSERT_EQUAL_INT64(60, seglog_end());
+    TEST_ASSERT_EQUAL_INT(3, seg_files());
+    TEST_ASSERT_FALSE(seg_holds(39, 0));
+    TEST_ASSERT_TRUE(seg_holds(40, '0'));
+    seglog_close();
+    seg_rmdir();
+}
+
+void test_seglog_keeps_packets()
+{
+    seg_newdir();
+    TEST_ASSERT_EQUAL_INT(0, seglog_open(segdir, 8, 0, 0, 3));
+    seg_append("aaa\n", 6);
+    // Two packets a segment: dropping the second oldest would leave only two
+    TEST_ASSERT_EQUAL_INT64(8, seglog_start());
+    TEST_ASSERT_EQUAL_INT64(24, seglog_end());
+    seglog_close();
+    seg_rmdir();
+}
+
+void test_seglog_pinned_segment_outlives_retention()
+{
+    seg_newdir();
+    TEST_ASSERT_EQUAL_INT(0, seglog_open(segdir, 4, 0, 4, 0));
+    seg_append("wxyz", 1);
+
+    int fd;
+    off_t local, left;
+    struct Segment *seg = seglog_pin(0, &fd, &local, &left);
+    TEST_ASSERT_NOT_NULL(seg);
+    seg_append("abcd", 2);
+    TEST_ASSERT_EQUAL_INT64(8, seglog_start());
+
+    // Unlinked by retention, still readable through the pin
+    char got[4];
+    TEST_ASSERT_EQUAL_INT(4, pread(fd, got, sizeof got, local));
+    TEST_ASSERT_EQUAL_MEMORY("wxyz", got, 4);
+    seglog_unpin(seg);
+    seglog_close();
+    seg_rmdir();
+}
+
+void test_seglog_reopen_picks_up_segments()
+{
+    seg_newdir();
+    TEST_ASSERT_EQUAL_INT(0, seglog_open(segdir, 10, 0, 0, 0));
+    seg_append("0123456789", 4);
+    seglog_close();
+
+    TEST_ASSERT_EQUAL_INT(0, seglog_open(segdir, 10, 0, 0, 0));
+    TEST_ASSERT_EQUAL_INT64(0, seglog_start());
+    TEST_ASSERT_EQUAL_INT64(40, seglog_end());
+    TEST_ASSERT_TRUE(seg_holds(35, '5'));
+    seglog_close();
+
+    // Tighter retention on the next start applies straight away
+    TEST_ASSERT_EQUAL_INT(0, seglog_open(segdir, 10, 0, 10, 0));
+    TEST_ASSERT_EQUAL_INT64(30, seglog_start());
+    TEST_ASSERT_EQUAL_INT64(40, seglog_end());
+    seglog_close();
+    seg_rmdir();
+}
+
+void test_seglog_reopen_after_a_gap()
+{
+    seg_newdir();
+    TEST_ASSERT_EQUAL_INT(0, seglog_open(segdir, 10, 0, 0, 0));
+    seg_append("0123456789", 3);
+    seglog_close();
+
+    char path[300];
+    snprintf(path, sizeof path, "%s/%020d.seg", segdir, 10);
+    TEST_ASSERT_EQUAL_INT(0, unlink(path));
+
+    // Offsets can not run on past the missing segment, the ones before it go
+    TEST_ASSERT_EQUAL_INT(0, seglog_open(segdir, 10, 0, 0, 0));
+    TEST_ASSERT_EQUAL_INT64(20, seglog_start());
+    TEST_ASSERT_EQUAL_INT64(30, seglog_end());
+    TEST_ASSERT_FALSE(seg_holds(5, 0));
+    seglog_close();
+    seg_rmdir();
+}
@@ -0,0 +1,128 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "../../server/aesdsocket.h"
+#include "../../server/aesdring.h"
+#include "../../server/shmring.h"
+#include "../../server/store.h"
+
+// The smallest ring, so a few dozen records go round it
+#define RING_BYTES (64 * 1024)
+
+static char ringname[32];
+static char *expected;
+static size_t expected_len;
+
+static struct aesdring *ring_open(void)
+{
+    static const struct StoreConfig cfg = {0};
+    TEST_ASSERT_EQUAL_INT(0, logopen(&memory_store, &cfg));
+    snprintf(ringname, sizeof ringname, "/aesdtest%d:%d", (int)getpid(), RING_BYTES);
+    TEST_ASSERT_EQUAL_INT(0, shmring_parse(ringname));
+    TEST_ASSERT_EQUAL_INT(0, shmring_start());
+    *strchr(ringname, ':') = '\0';
+    struct aesdring *ring = aesdring_open(ringname);
+    TEST_ASSERT_NOT_NULL(ring);
+
+    expected = malloc(1024 * 1024);
+    TEST_ASSERT_NOT_NULL(expected);
+    expected_len = 0;
+    return ring;
+}
+
+/**
+ * Append a record of len bytes, the newline the server adds included in
+ * what the log is expected to hold
+ */
+static void ring_append(struct aesdring *ring, size_t len, bool newline)
+{
+    char *packet = expected + expected_len;
+    for (size_t i = 0; i < len; i++)
+        packet[i] = 'a' + (expected_len + i) % 26;
+    if (newline)
+        packet[len - 1] = '\n';
+    TEST_ASSERT_EQUAL_INT(0, aesdring_append(ring, packet, len));
+    expected_len += len;
+    if (!newline)
+        expected[expected_len++] = '\n';
+}
+
+/**
+ * Stop the ring, which appends everything committed, and check the log
+ * holds the records in order
+ */
+static void ring_close(struct aesdring *ring)
+{
+    shmring_stop();
+    TEST_ASSERT_EQUAL_INT64(expected_len, logsize());
+    char *log = malloc(expected_len);
+    TEST_ASSERT_NOT_NULL(log);
+    for (size_t got = 0; got < expected_len;)
+    {
+        ssize_t n = logread(log + got, expected_len - got, got);
+        TEST_ASSERT_TRUE(n > 0);
+        got += n;
+    }
+    TEST_ASSERT_EQUAL_MEMORY(expected, log, expected_len);
+    free(log);
+    free(expected);
+    aesdring_close(ring);
+    logclose();
+}
+
+void test_shmring_records_fill_the_end_exactly()
+{
+    struct aesdring *ring = ring_open();
+    // Records taking 4096 bytes each end exactly at the end of the data
+    // area, the next one starts over at 0 without a pad
+    size_t len = 4096 - sizeof(struct aesdring_record);
+    TEST_ASSERT_EQUAL_size_t(4096, AESDRING_SPACE(len));
+    for (int i = 0; i < 3 * RING_BYTES / 4096; i++)
+        ring_append(ring, len, i % 2);
+    ring_close(ring);
+}
+
+void test_shmring_pads_records_that_do_not_fit()
+{
+    struct aesdring *ring = ring_open();
+    // 16 records of 4016 bytes leave 1280 at the end, too little for the next
+    for (int i = 0; i < 40; i++)
+        ring_append(ring, 4000, true);
+    ring_close(ring);
+}
+
+void test_shmring_mixed_sizes_wrap_many_times()
+{
+    struct aesdring *ring = ring_open();
+    size_t space = 0;
+    for (int i = 0; space < 8 * RING_BYTES; i++)
+    {
+        size_t len = 1 + (i * 7919) % 6000;
+        ring_append(ring, len, i % 3 == 0);
+        space += AESDRING_SPACE(len);
+    }
+    ring_close(ring);
+}
+
+void test_shmring_refused_records()
+{
+    struct aesdring *ring = ring_open();
+    char big[RING_BYTES];
+    memset(big, 'x', sizeof big);
+    TEST_ASSERT_EQUAL_INT(-1, aesdring_tryappend(ring, big, 0));
+    TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+    // At most half the ring, less the record header
+    TEST_ASSERT_EQUAL_INT(-1, aesdring_tryappend(ring, big, RING_BYTES / 2));
+    TEST_ASSERT_EQUAL_INT(EMSGSIZE, errno);
+    ring_append(ring, RING_BYTES / 2 - sizeof(struct aesdring_record), false);
+
+    // Once the server stopped taking records appends fail
+    shmring_stop();
+    TEST_ASSERT_EQUAL_INT(-1, aesdring_tryappend(ring, "late\n", 5));
+    TEST_ASSERT_EQUAL_INT(EPIPE, errno);
+    ring_close(ring);
+}